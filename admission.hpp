@@ -0,0 +1,410 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/format.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "callback.hpp"
+
+// Admission control: per-IP token buckets, a cap on open connections that
+// pauses accept, and shedding once requests wait in the socket queues for
+// too long (measured from kernel receive timestamps). The buckets and the
+// cap are shared by every loop (a client is limited however its connections
+// are spread, the cap counts the whole process), the buckets in shards
+// with a lock each; queue delay and the counters are per loop.
+
+inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+// the clock of SO_TIMESTAMPNS receive timestamps
+inline uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+// IPv4 is stored v4-mapped so both families share one table
+struct ip_key {
+    uint64_t m_hi = 0;
+    uint64_t m_lo = 0;
+
+    bool operator==(ip_key const &that) const {
+        return m_hi == that.m_hi && m_lo == that.m_lo;
+    }
+
+    static ip_key from_sockaddr(struct sockaddr const *addr) {
+        ip_key key;
+        if (addr->sa_family == AF_INET) {
+            auto in = reinterpret_cast<struct sockaddr_in const *>(addr);
+            key.m_lo = (uint64_t(0xffff) << 32) | ntohl(in->sin_addr.s_addr);
+        } else if (addr->sa_family == AF_INET6) {
+            auto in6 = reinterpret_cast<struct sockaddr_in6 const *>(addr);
+            memcpy(&key.m_hi, in6->sin6_addr.s6_addr, 8);
+            memcpy(&key.m_lo, in6->sin6_addr.s6_addr + 8, 8);
+        }
+        return key; // unix sockets all share the zero key
+    }
+
+    size_t hash() const {
+        uint64_t h = (m_hi ^ (m_lo * 0x9e3779b97f4a7c15)) * 0xff51afd7ed558ccd;
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+};
+
+// fixed-size open addressing; when the probe window is full the bucket
+// touched least recently gives up its slot
+struct token_bucket_table {
+    static constexpr size_t probe_limit = 8;
+
+    struct slot {
+        ip_key m_key;
+        uint64_t m_stamp_ns = 0;
+        double m_tokens = 0;
+        bool m_used = false;
+    };
+
+    std::vector<slot> m_slots;
+    size_t m_mask;
+    double m_rate;  // tokens per second, 0 turns the limit off
+    double m_burst; // bucket size, a new client starts with a full bucket
+
+    token_bucket_table(size_t slots, double rate, double burst)
+        : m_rate(rate), m_burst(burst) {
+        size_t n = 1;
+        while (n < slots) {
+            n <<= 1;
+        }
+        m_slots.resize(n);
+        m_mask = n - 1;
+    }
+
+    [[nodiscard]] bool take(ip_key const &key, uint64_t now_ns) {
+        if (m_rate <= 0) {
+            return true;
+        }
+        size_t h = key.hash();
+        slot *victim = nullptr;
+        for (size_t i = 0; i < probe_limit; ++i) {
+            slot &s = m_slots[(h + i) & m_mask];
+            if (!s.m_used) {
+                victim = &s;
+                break;
+            }
+            if (s.m_key == key) {
+                return _take(s, now_ns);
+            }
+            if (!victim || s.m_stamp_ns < victim->m_stamp_ns) {
+                victim = &s;
+            }
+        }
+        victim->m_used = true;
+        victim->m_key = key;
+        victim->m_tokens = m_burst;
+        victim->m_stamp_ns = now_ns;
+        return _take(*victim, now_ns);
+    }
+
+    bool _take(slot &s, uint64_t now_ns) {
+        // callers read the clock before they get the shard lock, so another
+        // loop may have stamped the bucket later than now_ns
+        if (now_ns > s.m_stamp_ns) {
+            s.m_tokens += double(now_ns - s.m_stamp_ns) * 1e-9 * m_rate;
+            if (s.m_tokens > m_burst) {
+                s.m_tokens = m_burst;
+            }
+            s.m_stamp_ns = now_ns;
+        }
+        if (s.m_tokens < 1) {
+            return false;
+        }
+        s.m_tokens -= 1;
+        return true;
+    }
+};
+
+// the table split by key, so loops admitting different clients rarely
+// wait for each other
+struct sharded_token_buckets {
+    static constexpr size_t shard_count = 16;
+
+    struct shard {
+        std::mutex m_mutex;
+        token_bucket_table m_table;
+
+        shard(size_t slots, double rate, double burst)
+            : m_table(slots, rate, burst) {}
+    };
+
+    std::vector<std::unique_ptr<shard>> m_shards;
+    double m_rate;
+
+    sharded_token_buckets(size_t slots, double rate, double burst)
+        : m_rate(rate) {
+        for (size_t i = 0; i < shard_count; ++i) {
+            m_shards.push_back(std::make_unique<shard>(
+                std::max<size_t>(slots / shard_count, token_bucket_table::probe_limit),
+                rate, burst));
+        }
+    }
+
+    // at startup, before any loop takes from the buckets
+    void set_rate(double rate, double burst) {
+        m_rate = rate;
+        for (auto &s : m_shards) {
+            s->m_table.m_rate = rate;
+            s->m_table.m_burst = burst;
+        }
+    }
+
+    [[nodiscard]] bool take(ip_key const &key, uint64_t now_ns) {
+        if (m_rate <= 0) {
+            return true;
+        }
+        // the table probes from the low bits, shards take the high ones
+        auto &s = *m_shards[(key.hash() >> 28) % shard_count];
+        std::lock_guard lock(s.m_mutex);
+        return s.m_table.take(key, now_ns);
+    }
+};
+
+// open connections of every loop; accept loops wait here while the cap is
+// reached. resume runs on whichever thread closed a connection, so it only
+// hands over to the waiting loop (event_loop::post).
+// full() only pauses accepting: loops check it before they accept, so
+// several can pass it at once, and a steered connection is counted on
+// another loop later. The cap itself is held by try_open.
+struct connection_limiter {
+    size_t m_max;
+    std::atomic<size_t> m_open{0};
+    std::atomic<size_t> m_waiters{0};
+    std::mutex m_mutex;
+    std::vector<callback<>> m_waiting;
+
+    explicit connection_limiter(size_t max) : m_max(max) {}
+
+    [[nodiscard]] bool full() const {
+        return m_open.load(std::memory_order_relaxed) >= m_max;
+    }
+
+    void wait(callback<> resume) {
+        {
+            std::lock_guard lock(m_mutex);
+            m_waiting.push_back(std::move(resume));
+            m_waiters.store(m_waiting.size());
+        }
+        // a close between the caller's full() and here saw no waiters
+        if (!full()) {
+            _resume_all();
+        }
+    }
+
+    [[nodiscard]] bool try_open() {
+        size_t open = m_open.load(std::memory_order_relaxed);
+        do {
+            if (open >= m_max) {
+                return false;
+            }
+        } while (!m_open.compare_exchange_weak(open, open + 1, std::memory_order_relaxed));
+        return true;
+    }
+
+    void closed() {
+        m_open.fetch_sub(1);
+        if (m_waiters.load() != 0) {
+            _resume_all();
+        }
+    }
+
+    // each waiter checks the cap again before it accepts
+    void _resume_all() {
+        std::vector<callback<>> waiting;
+        {
+            std::lock_guard lock(m_mutex);
+            waiting.swap(m_waiting);
+            m_waiters.store(0);
+        }
+        for (auto &resume : waiting) {
+            resume();
+        }
+    }
+};
+
+// CoDel (RFC 8289) over request queue delay: once the delay has stayed
+// above target for a whole interval one request is shed, then one each
+// interval/sqrt(count) while it stays above, so the shedding rate climbs
+// until the queue drains instead of refusing every request; it stops at
+// the first sample below target
+struct load_shedder {
+    uint64_t m_target_ns;
+    uint64_t m_interval_ns;
+    uint64_t m_first_above_ns = 0; // end of the first interval above target, 0 while under
+    uint64_t m_drop_next_ns = 0;
+    uint32_t m_count = 0;      // shed since shedding started
+    uint32_t m_last_count = 0; // m_count when it started
+    bool m_shedding = false;
+
+    load_shedder(uint64_t target_ns, uint64_t interval_ns)
+        : m_target_ns(target_ns), m_interval_ns(interval_ns) {}
+
+    [[nodiscard]] bool update(uint64_t delay_ns, uint64_t now_ns) {
+        if (m_target_ns == 0 || delay_ns < m_target_ns) {
+            m_first_above_ns = 0;
+            m_shedding = false;
+            return false;
+        }
+        if (m_first_above_ns == 0) {
+            m_first_above_ns = now_ns + m_interval_ns;
+            return false;
+        }
+        if (now_ns < m_first_above_ns) {
+            return false;
+        }
+        if (m_shedding) {
+            if (now_ns < m_drop_next_ns) {
+                return false;
+            }
+            ++m_count;
+            m_drop_next_ns = _control_law(m_drop_next_ns);
+            return true;
+        }
+        // above target again soon after it stopped: resume near the rate it had
+        uint32_t delta = m_count - m_last_count;
+        m_count = delta > 1 && now_ns < m_drop_next_ns + 16 * m_interval_ns ? delta : 1;
+        m_last_count = m_count;
+        m_shedding = true;
+        m_drop_next_ns = _control_law(now_ns);
+        return true;
+    }
+
+    uint64_t _control_law(uint64_t t_ns) const {
+        return t_ns + uint64_t(double(m_interval_ns) / std::sqrt(double(m_count)));
+    }
+};
+
+struct admission_options {
+    size_t max_connections = 10000;
+    double per_ip_rate = 2000; // connections plus requests per second, 0 turns it off
+    double per_ip_burst = 4000;
+    size_t ip_table_slots = 4096;
+    uint64_t shed_target_ns = 20 * 1000000;    // queue delay above this ...
+    uint64_t shed_interval_ns = 100 * 1000000; // ... this long turns shedding on
+};
+
+// written by the loop's thread only, read by a /metrics scrape on any
+struct admission_stats {
+    std::atomic<uint64_t> m_admitted{0};
+    std::atomic<uint64_t> m_rate_limited{0};
+    std::atomic<uint64_t> m_shed{0};
+    std::atomic<uint64_t> m_accept_pauses{0};
+    std::atomic<uint64_t> m_over_cap{0}; // accepted, then refused by try_open
+    std::atomic<uint64_t> m_max_queue_delay_ns{0};
+    std::atomic<bool> m_shedding{false};
+};
+
+// what the loops share
+struct admission_shared {
+    sharded_token_buckets m_buckets;
+    connection_limiter m_conns;
+
+    explicit admission_shared(admission_options const &opts = {})
+        : m_buckets(opts.ip_table_slots, opts.per_ip_rate, opts.per_ip_burst),
+          m_conns(opts.max_connections) {}
+
+    std::string metrics() const {
+        return fmt::format("admission_open_connections {}\n", m_conns.m_open.load());
+    }
+};
+
+// one per loop
+struct admission_control {
+    sharded_token_buckets &m_buckets;
+    connection_limiter &m_conns;
+    load_shedder m_shedder;
+    admission_stats m_stats;
+    std::atomic<size_t> m_open{0}; // this loop's part of m_conns
+
+    admission_control(admission_shared &shared, admission_options const &opts)
+        : m_buckets(shared.m_buckets), m_conns(shared.m_conns),
+          m_shedder(opts.shed_target_ns, opts.shed_interval_ns) {}
+
+    [[nodiscard]] bool try_open() {
+        if (!m_conns.try_open()) {
+            ++m_stats.m_over_cap;
+            return false;
+        }
+        ++m_open;
+        return true;
+    }
+
+    void closed() {
+        --m_open;
+        m_conns.closed();
+    }
+
+    enum class verdict {
+        admit,
+        rate_limited, // 429
+        overloaded,   // 503
+    };
+
+    // a new request, before any of it is parsed
+    verdict admit_request(ip_key const &peer, uint64_t queue_delay_ns) {
+        uint64_t now = monotonic_ns();
+        if (queue_delay_ns > m_stats.m_max_queue_delay_ns.load(std::memory_order_relaxed)) {
+            m_stats.m_max_queue_delay_ns.store(queue_delay_ns, std::memory_order_relaxed);
+        }
+        bool shed = m_shedder.update(queue_delay_ns, now);
+        m_stats.m_shedding.store(m_shedder.m_shedding, std::memory_order_relaxed);
+        if (shed) {
+            ++m_stats.m_shed;
+            return verdict::overloaded;
+        }
+        return _take(peer, now);
+    }
+
+    verdict admit_connection(ip_key const &peer) {
+        return _take(peer, monotonic_ns());
+    }
+
+    verdict _take(ip_key const &peer, uint64_t now) {
+        // the zero key is a unix socket peer, local and not worth limiting
+        if (!(peer == ip_key{}) && !m_buckets.take(peer, now)) {
+            ++m_stats.m_rate_limited;
+            return verdict::rate_limited;
+        }
+        ++m_stats.m_admitted;
+        return verdict::admit;
+    }
+
+    // this loop's series, labels e.g. {loop="0"} on each; safe from any
+    // thread (the process-wide ones are admission_shared::metrics)
+    std::string metrics(std::string_view labels = {}) const {
+        auto &s = m_stats;
+        return fmt::format("admission_admitted_total{l} {}\n"
+                           "admission_rate_limited_total{l} {}\n"
+                           "admission_shed_total{l} {}\n"
+                           "admission_accept_pauses_total{l} {}\n"
+                           "admission_over_cap_total{l} {}\n"
+                           "admission_loop_open_connections{l} {}\n"
+                           "admission_shedding{l} {}\n"
+                           "admission_max_queue_delay_ns{l} {}\n",
+                           s.m_admitted.load(), s.m_rate_limited.load(), s.m_shed.load(),
+                           s.m_accept_pauses.load(), s.m_over_cap.load(), m_open.load(),
+                           int(s.m_shedding.load()), s.m_max_queue_delay_ns.load(),
+                           fmt::arg("l", labels));
+    }
+};
@@ -0,0 +1,323 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <fmt/format.h>
+#include <zlib.h>
+
+// Response compression: Accept-Encoding negotiation, gzip/deflate through
+// one reused zlib context per coding and thread, and a cache of encoded
+// variants so a hot cacheable body is compressed once. Cacheable bodies come
+// with a key, their path and validator, so a lookup neither hashes nor
+// compares the body.
+
+enum class content_coding : uint8_t {
+    identity,
+    gzip,
+    deflate, // the zlib format, as HTTP defines it
+};
+
+inline std::string_view content_coding_name(content_coding coding) {
+    switch (coding) {
+    case content_coding::gzip:
+        return "gzip";
+    case content_coding::deflate:
+        return "deflate";
+    default:
+        return "identity";
+    }
+}
+
+inline bool _coding_iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if ((a[i] | 0x20) != (b[i] | 0x20)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline std::string_view _coding_trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// highest q wins, gzip before deflate on a tie; q=0 rules a coding out
+inline content_coding negotiate_content_coding(std::string_view accept_encoding) {
+    double gzip_q = -1, deflate_q = -1, any_q = -1;
+    while (!accept_encoding.empty()) {
+        size_t comma = accept_encoding.find(',');
+        auto item = accept_encoding.substr(0, comma);
+        accept_encoding.remove_prefix(comma == std::string_view::npos
+                                          ? accept_encoding.size()
+                                          : comma + 1);
+        double q = 1;
+        size_t semi = item.find(';');
+        if (semi != std::string_view::npos) {
+            auto param = _coding_trim(item.substr(semi + 1));
+            if (param.size() > 2 && (param[0] | 0x20) == 'q' && param[1] == '=') {
+                q = std::strtod(std::string(param.substr(2)).c_str(), nullptr);
+            }
+            item = item.substr(0, semi);
+        }
+        item = _coding_trim(item);
+        if (_coding_iequals(item, "gzip") || _coding_iequals(item, "x-gzip")) {
+            gzip_q = q;
+        } else if (_coding_iequals(item, "deflate")) {
+            deflate_q = q;
+        } else if (item == "*") {
+            any_q = q;
+        }
+    }
+    if (gzip_q < 0) {
+        gzip_q = any_q;
+    }
+    if (deflate_q < 0) {
+        deflate_q = any_q;
+    }
+    if (gzip_q > 0 && gzip_q >= deflate_q) {
+        return content_coding::gzip;
+    }
+    if (deflate_q > 0) {
+        return content_coding::deflate;
+    }
+    return content_coding::identity;
+}
+
+// deflateReset() between bodies keeps the ~256 KB of zlib state allocated
+struct zlib_compressor {
+    z_stream m_streams[2] = {};
+    bool m_ready[2] = {};
+    int m_level;
+
+    explicit zlib_compressor(int level = 6) : m_level(level) {}
+
+    zlib_compressor(zlib_compressor const &) = delete;
+    zlib_compressor &operator=(zlib_compressor const &) = delete;
+
+    ~zlib_compressor() {
+        for (int i = 0; i < 2; ++i) {
+            if (m_ready[i]) {
+                deflateEnd(&m_streams[i]);
+            }
+        }
+    }
+
+    z_stream &_stream(content_coding coding) {
+        int i = coding == content_coding::gzip ? 0 : 1;
+        if (!m_ready[i]) {
+            int window_bits = coding == content_coding::gzip ? 15 + 16 : 15;
+            if (deflateInit2(&m_streams[i], m_level, Z_DEFLATED, window_bits, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::runtime_error("deflateInit2 failed");
+            }
+            m_ready[i] = true;
+        }
+        return m_streams[i];
+    }
+
+    void compress(content_coding coding, std::string_view in, std::string &out) {
+        z_stream &zs = _stream(coding);
+        out.resize(deflateBound(&zs, in.size()));
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+        zs.avail_in = static_cast<uInt>(in.size());
+        zs.next_out = reinterpret_cast<Bytef *>(out.data());
+        zs.avail_out = static_cast<uInt>(out.size());
+        int ret = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateReset(&zs);
+        if (ret != Z_STREAM_END) {
+            throw std::runtime_error("deflate failed");
+        }
+    }
+};
+
+// encoded variants by coding and cache key, least recently used goes
+// first; a changed validator makes a new key, the old entry ages out
+struct compressed_cache {
+    struct entry {
+        content_coding m_coding;
+        std::string m_key;
+        std::string m_encoded; // empty: known not to be worth compressing
+    };
+
+    size_t m_max_bytes;
+    size_t m_bytes = 0;
+    std::list<entry> m_lru; // most recent first
+    // per coding, keyed by views of the entries' m_key (list nodes stay put)
+    std::unordered_map<std::string_view, std::list<entry>::iterator> m_index[3];
+
+    explicit compressed_cache(size_t max_bytes) : m_max_bytes(max_bytes) {}
+
+    entry const *find(content_coding coding, std::string_view key) {
+        auto &index = m_index[size_t(coding)];
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        return &*it->second;
+    }
+
+    void insert(content_coding coding, std::string_view key, std::string encoded) {
+        size_t size = key.size() + encoded.size();
+        if (size > m_max_bytes / 4) {
+            return; // one big body should not flush everything else
+        }
+        auto &index = m_index[size_t(coding)];
+        auto it = index.find(key);
+        if (it != index.end()) {
+            _erase(it->second);
+        }
+        m_lru.push_front({coding, std::string(key), std::move(encoded)});
+        index[m_lru.front().m_key] = m_lru.begin();
+        m_bytes += size;
+        while (m_bytes > m_max_bytes) {
+            _erase(std::prev(m_lru.end()));
+        }
+    }
+
+    void _erase(std::list<entry>::iterator it) {
+        m_bytes -= it->m_key.size() + it->m_encoded.size();
+        m_index[size_t(it->m_coding)].erase(it->m_key);
+        m_lru.erase(it);
+    }
+};
+
+struct compression_options {
+    size_t min_size = 256;       // smaller bodies go out as they are
+    double max_ratio = 0.9;      // keep the encoding only if it saves 10%
+    int level = 6;
+    size_t cache_bytes = 8 << 20; // per thread
+};
+
+// written by the compressor's thread only, read by a /metrics scrape on any
+struct compression_stats {
+    std::atomic<uint64_t> m_compressed{0}; // bodies run through deflate
+    std::atomic<uint64_t> m_cpu_ns{0};     // thread CPU time spent in deflate
+    std::atomic<uint64_t> m_bytes_in{0};
+    std::atomic<uint64_t> m_bytes_out{0};
+    std::atomic<uint64_t> m_cache_hits{0};
+    std::atomic<uint64_t> m_cache_misses{0};
+    std::atomic<uint64_t> m_skipped_small{0};
+    std::atomic<uint64_t> m_skipped_incompressible{0};
+    std::atomic<uint64_t> m_cache_bytes{0}; // the cache's size after the last insert
+};
+
+struct response_compressor {
+    compression_options m_opts;
+    zlib_compressor m_zlib;
+    compressed_cache m_cache;
+    compression_stats m_stats;
+
+    explicit response_compressor(compression_options opts = {})
+        : m_opts(opts), m_zlib(opts.level), m_cache(opts.cache_bytes) {}
+
+    static bool compressible_type(std::string_view content_type) {
+        return content_type.substr(0, 5) == "text/" ||
+               content_type.find("json") != std::string_view::npos ||
+               content_type.find("javascript") != std::string_view::npos ||
+               content_type.find("xml") != std::string_view::npos;
+    }
+
+    static uint64_t _cpu_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+    }
+
+    // identity if the body is not worth encoding, otherwise out holds it;
+    // a body with a cache_key is looked up and stored under it
+    content_coding encode(content_coding coding, std::string_view body,
+                          std::string_view cache_key, std::string &out) {
+        bool cacheable = !cache_key.empty();
+        if (coding == content_coding::identity) {
+            return coding;
+        }
+        if (body.size() < m_opts.min_size) {
+            ++m_stats.m_skipped_small;
+            return content_coding::identity;
+        }
+        if (cacheable) {
+            if (auto hit = m_cache.find(coding, cache_key)) {
+                ++m_stats.m_cache_hits;
+                if (hit->m_encoded.empty()) {
+                    return content_coding::identity;
+                }
+                out = hit->m_encoded;
+                return coding;
+            }
+            ++m_stats.m_cache_misses;
+        }
+
+        uint64_t start = _cpu_ns();
+        m_zlib.compress(coding, body, out);
+        m_stats.m_cpu_ns += _cpu_ns() - start;
+        ++m_stats.m_compressed;
+        m_stats.m_bytes_in += body.size();
+        m_stats.m_bytes_out += out.size();
+
+        bool worth = out.size() <= body.size() * m_opts.max_ratio;
+        if (!worth) {
+            ++m_stats.m_skipped_incompressible;
+            out.clear();
+        }
+        if (cacheable) {
+            m_cache.insert(coding, cache_key, out);
+            m_stats.m_cache_bytes.store(m_cache.m_bytes, std::memory_order_relaxed);
+        }
+        return worth ? coding : content_coding::identity;
+    }
+
+    // labels, e.g. {loop="0"}, go on every series; safe from any thread
+    std::string metrics(std::string_view labels = {}) const {
+        auto &s = m_stats;
+        uint64_t compressed = s.m_compressed.load(std::memory_order_relaxed);
+        uint64_t cpu_ns = s.m_cpu_ns.load(std::memory_order_relaxed);
+        uint64_t hits = s.m_cache_hits.load(std::memory_order_relaxed);
+        uint64_t misses = s.m_cache_misses.load(std::memory_order_relaxed);
+        return fmt::format(
+            "compression_responses_total{l} {}\n"
+            "compression_cpu_ns_total{l} {}\n"
+            "compression_cpu_ns_per_response{l} {}\n"
+            "compression_bytes_in_total{l} {}\n"
+            "compression_bytes_out_total{l} {}\n"
+            "compression_skipped_small_total{l} {}\n"
+            "compression_skipped_incompressible_total{l} {}\n"
+            "compression_cache_hits_total{l} {}\n"
+            "compression_cache_misses_total{l} {}\n"
+            "compression_cache_hit_ratio{l} {:.3f}\n"
+            "compression_cache_bytes{l} {}\n",
+            compressed, cpu_ns, compressed ? cpu_ns / compressed : 0,
+            s.m_bytes_in.load(std::memory_order_relaxed),
+            s.m_bytes_out.load(std::memory_order_relaxed),
+            s.m_skipped_small.load(std::memory_order_relaxed),
+            s.m_skipped_incompressible.load(std::memory_order_relaxed), hits, misses,
+            hits + misses ? double(hits) / double(hits + misses) : 0.0,
+            s.m_cache_bytes.load(std::memory_order_relaxed), fmt::arg("l", labels));
+    }
+};
+
+inline compression_options compression_opts;
+
+// one context per thread, built on first use
+inline response_compressor &thread_response_compressor() {
+    thread_local response_compressor compressor(compression_opts);
+    return compressor;
+}
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/format.h>
+
+// Startup configuration: how many event loops to run and what they listen
+// on. A config file holds one directive per line, and the same listener
+// specs can be given on the command line:
+//
+//   loops 4
+//   cpus 0-3                        # loop i pinned to the i-th cpu, or "auto"
+//   trace 100                       # trace one request in 100
+//   log debug                       # a line per connection, read and request
+//   max_events 64                   # per epoll_wait
+//   work_budget 16                  # IO completed inline per fd and iteration
+//   busy_poll_spins 0               # epoll_wait(0) tries before blocking
+//   busy_poll_usec 0                # SO_BUSY_POLL on accepted sockets
+//   static_dir /srv/www             # served at /static/
+//   max_connections 10000           # open connections of every loop together
+//   shed_target_ms 20               # 503 once queue delay stays above this, 0: never
+//   per_ip_rate 2000                # connections plus requests per second, 0: no limit
+//   per_ip_burst 4000               # what a client may spend at once, 0: per_ip_rate
+//   listen tcp 127.0.0.1:8080 loops=0,1 backlog=1024 nodelay
+//   listen tcp *:8081 incoming_cpu  # hand connections to the loop on that cpu
+//   listen tcp [::]:8080 v6only reuseport rcvbuf=262144
+//   listen tcp *:8443 cert=cert.pem key=key.pem
+//   listen unix /run/co_http.sock mode=0660
+//   listen unix @co_http            # abstract namespace
+//
+//   server --loops 4 --cpus auto --listen "unix @co_http" --listen "tcp 127.0.0.1:8080"
+
+struct config_error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+enum class log_level : uint8_t {
+    info,
+    debug,
+};
+
+inline log_level parse_log_level(std::string_view name) {
+    if (name == "info") {
+        return log_level::info;
+    }
+    if (name == "debug") {
+        return log_level::debug;
+    }
+    throw config_error(fmt::format("log: unknown level '{}'", name));
+}
+
+enum class listener_kind : uint8_t {
+    tcp,
+    unix_stream,
+};
+
+struct listener_config {
+    listener_kind m_kind = listener_kind::tcp;
+    std::string m_host; // tcp: empty for every local address
+    std::string m_port;
+    std::string m_path;          // unix: a filesystem path, or "@name"
+    std::vector<size_t> m_loops; // empty: every loop accepts
+    int m_backlog = 511;
+    bool m_reuseaddr = true;
+    bool m_reuseport = false;
+    bool m_nodelay = false;
+    int m_v6only = -1; // -1: only when the name also resolves to IPv4
+    int m_rcvbuf = 0;  // 0 keeps the system default
+    int m_sndbuf = 0;
+    int m_defer_accept = 0; // seconds
+    int m_fastopen = 0;     // queue length
+    int m_mode = -1;        // permissions of a unix socket file
+    bool m_incoming_cpu = false; // steer by SO_INCOMING_CPU, needs pinned loops
+    std::string m_cert;     // with m_key: TLS
+    std::string m_key;
+
+    bool tls() const {
+        return !m_cert.empty() && !m_key.empty();
+    }
+
+    std::string describe() const {
+        if (m_kind == listener_kind::unix_stream) {
+            return "unix " + m_path;
+        }
+        return fmt::format("{} {}:{}", tls() ? "tls" : "tcp",
+                           m_host.empty() ? "*" : m_host, m_port);
+    }
+};
+
+struct server_config {
+    size_t m_loops = 1;
+    std::string m_cpus; // a cpu list or "auto", empty leaves loops unpinned
+    uint32_t m_trace_every = 0; // sample one request in N, 0 turns tracing off
+    log_level m_log = log_level::info;
+    // per loop, see event_loop_options
+    size_t m_max_events = 64;
+    size_t m_work_budget = 16;
+    int m_busy_poll_spins = 0;
+    int m_busy_poll_usec = 0;
+    std::string m_static_dir; // served at /static/, empty turns it off
+    // see admission_options
+    size_t m_max_connections = 10000;
+    int m_shed_target_ms = 20;
+    int m_per_ip_rate = 2000;
+    int m_per_ip_burst = 4000;
+    std::vector<listener_config> m_listeners;
+};
+
+inline std::vector<std::string_view> _config_words(std::string_view line) {
+    std::vector<std::string_view> words;
+    size_t i = 0;
+    while (i < line.size()) {
+        if (line[i] == ' ' || line[i] == '\t' || line[i] == '\r') {
+            ++i;
+            continue;
+        }
+        if (line[i] == '#') {
+            break;
+        }
+        size_t j = i;
+        while (j < line.size() && line[j] != ' ' && line[j] != '\t' && line[j] != '\r') {
+            ++j;
+        }
+        words.push_back(line.substr(i, j - i));
+        i = j;
+    }
+    return words;
+}
+
+inline int _config_int(std::string_view what, std::string_view value, int base = 10) {
+    try {
+        size_t used = 0;
+        std::string s(value);
+        long n = std::stol(s, &used, base);
+        if (used == s.size() && n >= 0 && n <= INT32_MAX) {
+            return int(n);
+        }
+    } catch (std::exception const &) {
+    }
+    throw config_error(fmt::format("{}: bad number '{}'", what, value));
+}
+
+// "tcp 127.0.0.1:8080 backlog=1024 ..." or "unix /path ..."
+inline listener_config parse_listener(std::string_view spec) {
+    auto words = _config_words(spec);
+    if (words.size() < 2) {
+        throw config_error(fmt::format("listen: expected 'tcp|unix ADDRESS', got '{}'", spec));
+    }
+    listener_config l;
+    std::string_view addr = words[1];
+    if (words[0] == "unix") {
+        l.m_kind = listener_kind::unix_stream;
+        l.m_path = std::string(addr);
+    } else if (words[0] == "tcp") {
+        size_t colon = addr.rfind(':');
+        if (colon == std::string_view::npos) {
+            throw config_error(fmt::format("listen: '{}' has no port", addr));
+        }
+        auto host = addr.substr(0, colon);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        l.m_host = host == "*" ? "" : std::string(host);
+        l.m_port = std::string(addr.substr(colon + 1));
+    } else {
+        throw config_error(fmt::format("listen: unknown kind '{}'", words[0]));
+    }
+
+    for (size_t i = 2; i < words.size(); ++i) {
+        auto opt = words[i];
+        size_t eq = opt.find('=');
+        auto name = opt.substr(0, eq);
+        auto value = eq == std::string_view::npos ? std::string_view{} : opt.substr(eq + 1);
+        bool flag = value.empty() || value != "0";
+        if (name == "loops") {
+            while (!value.empty()) {
+                size_t comma = value.find(',');
+                l.m_loops.push_back(size_t(_config_int(name, value.substr(0, comma))));
+                value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+            }
+        } else if (name == "backlog") {
+            l.m_backlog = _config_int(name, value);
+        } else if (name == "reuseaddr") {
+            l.m_reuseaddr = flag;
+        } else if (name == "reuseport") {
+            l.m_reuseport = flag;
+        } else if (name == "nodelay") {
+            l.m_nodelay = flag;
+        } else if (name == "v6only") {
+            l.m_v6only = flag;
+        } else if (name == "rcvbuf") {
+            l.m_rcvbuf = _config_int(name, value);
+        } else if (name == "sndbuf") {
+            l.m_sndbuf = _config_int(name, value);
+        } else if (name == "defer_accept") {
+            l.m_defer_accept = _config_int(name, value);
+        } else if (name == "fastopen") {
+            l.m_fastopen = _config_int(name, value);
+        } else if (name == "mode") {
+            l.m_mode = _config_int(name, value, 8);
+        } else if (name == "incoming_cpu") {
+            l.m_incoming_cpu = flag;
+        } else if (name == "cert") {
+            l.m_cert = std::string(value);
+        } else if (name == "key") {
+            l.m_key = std::string(value);
+        } else {
+            throw config_error(fmt::format("listen {}: unknown option '{}'", addr, name));
+        }
+    }
+    if (l.m_cert.empty() != l.m_key.empty()) {
+        throw config_error(fmt::format("listen {}: cert and key go together", addr));
+    }
+    return l;
+}
+
+inline void validate_config(server_config const &cfg) {
+    if (cfg.m_loops == 0) {
+        throw config_error("loops: at least one");
+    }
+    if (cfg.m_max_events == 0) {
+        throw config_error("max_events: at least one");
+    }
+    if (cfg.m_work_budget == 0) {
+        throw config_error("work_budget: at least one");
+    }
+    for (auto &l : cfg.m_listeners) {
+        if (l.m_incoming_cpu && cfg.m_cpus.empty()) {
+            throw config_error(fmt::format("listen {}: incoming_cpu needs pinned loops (cpus)", l.describe()));
+        }
+        for (size_t loop : l.m_loops) {
+            if (loop >= cfg.m_loops) {
+                throw config_error(fmt::format("listen {}: there is no loop {}", l.describe(), loop));
+            }
+        }
+    }
+}
+
+inline void parse_config_line(server_config &cfg, std::string_view line) {
+    auto words = _config_words(line);
+    if (words.empty()) {
+        return;
+    }
+    if (words[0] == "loops" && words.size() == 2) {
+        cfg.m_loops = size_t(_config_int("loops", words[1]));
+    } else if (words[0] == "cpus" && words.size() == 2) {
+        cfg.m_cpus = std::string(words[1]);
+    } else if (words[0] == "trace" && words.size() == 2) {
+        cfg.m_trace_every = uint32_t(_config_int("trace", words[1]));
+    } else if (words[0] == "log" && words.size() == 2) {
+        cfg.m_log = parse_log_level(words[1]);
+    } else if (words[0] == "max_events" && words.size() == 2) {
+        cfg.m_max_events = size_t(_config_int("max_events", words[1]));
+    } else if (words[0] == "work_budget" && words.size() == 2) {
+        cfg.m_work_budget = size_t(_config_int("work_budget", words[1]));
+    } else if (words[0] == "busy_poll_spins" && words.size() == 2) {
+        cfg.m_busy_poll_spins = _config_int("busy_poll_spins", words[1]);
+    } else if (words[0] == "busy_poll_usec" && words.size() == 2) {
+        cfg.m_busy_poll_usec = _config_int("busy_poll_usec", words[1]);
+    } else if (words[0] == "static_dir" && words.size() == 2) {
+        cfg.m_static_dir = std::string(words[1]);
+    } else if (words[0] == "max_connections" && words.size() == 2) {
+        cfg.m_max_connections = size_t(_config_int("max_connections", words[1]));
+    } else if (words[0] == "shed_target_ms" && words.size() == 2) {
+        cfg.m_shed_target_ms = _config_int("shed_target_ms", words[1]);
+    } else if (words[0] == "per_ip_rate" && words.size() == 2) {
+        cfg.m_per_ip_rate = _config_int("per_ip_rate", words[1]);
+    } else if (words[0] == "per_ip_burst" && words.size() == 2) {
+        cfg.m_per_ip_burst = _config_int("per_ip_burst", words[1]);
+    } else if (words[0] == "listen") {
+        size_t start = line.find("listen") + 6;
+        cfg.m_listeners.push_back(parse_listener(line.substr(start)));
+    } else {
+        throw config_error(fmt::format("unknown directive '{}'", line));
+    }
+}
+
+inline void load_config_file(server_config &cfg, std::string const &path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw config_error(fmt::format("cannot open config file {}", path));
+    }
+    std::string line;
+    for (size_t lineno = 1; std::getline(in, line); ++lineno) {
+        try {
+            parse_config_line(cfg, line);
+        } catch (config_error const &e) {
+            throw config_error(fmt::format("{}:{}: {}", path, lineno, e.what()));
+        }
+    }
+}
+
+// --config FILE, --loops N, --cpus LIST, --trace N, --log LEVEL, --max-events N,
+// --work-budget N, --busy-poll-spins N, --busy-poll-usec N, --static-dir DIR,
+// --max-connections N, --shed-target-ms N, --per-ip-rate N, --per-ip-burst N
+// and --listen SPEC, in any order;
+// listeners from both places add up
+inline server_config parse_command_line(int argc, char **argv) {
+    server_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 >= argc) {
+            throw config_error(fmt::format("{}: missing value", arg));
+        }
+        std::string_view value = argv[++i];
+        if (arg == "--config" || arg == "-c") {
+            load_config_file(cfg, std::string(value));
+        } else if (arg == "--loops") {
+            cfg.m_loops = size_t(_config_int("--loops", value));
+        } else if (arg == "--cpus") {
+            cfg.m_cpus = std::string(value);
+        } else if (arg == "--trace") {
+            cfg.m_trace_every = uint32_t(_config_int("--trace", value));
+        } else if (arg == "--log") {
+            cfg.m_log = parse_log_level(value);
+        } else if (arg == "--max-events") {
+            cfg.m_max_events = size_t(_config_int("--max-events", value));
+        } else if (arg == "--work-budget") {
+            cfg.m_work_budget = size_t(_config_int("--work-budget", value));
+        } else if (arg == "--busy-poll-spins") {
+            cfg.m_busy_poll_spins = _config_int("--busy-poll-spins", value);
+        } else if (arg == "--busy-poll-usec") {
+            cfg.m_busy_poll_usec = _config_int("--busy-poll-usec", value);
+        } else if (arg == "--static-dir") {
+            cfg.m_static_dir = std::string(value);
+        } else if (arg == "--max-connections") {
+            cfg.m_max_connections = size_t(_config_int("--max-connections", value));
+        } else if (arg == "--shed-target-ms") {
+            cfg.m_shed_target_ms = _config_int("--shed-target-ms", value);
+        } else if (arg == "--per-ip-rate") {
+            cfg.m_per_ip_rate = _config_int("--per-ip-rate", value);
+        } else if (arg == "--per-ip-burst") {
+            cfg.m_per_ip_burst = _config_int("--per-ip-burst", value);
+        } else if (arg == "--listen") {
+            cfg.m_listeners.push_back(parse_listener(value));
+        } else {
+            throw config_error(fmt::format("unknown option {}", arg));
+        }
+    }
+    return cfg;
+}
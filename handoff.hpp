@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Listening sockets handed from a running server to the one replacing it,
+// over a unix socket: the names go in the payload, the fds as SCM_RIGHTS.
+// The replacement sends one byte back once it holds them, and only then
+// does the old server stop accepting; the old server waits for that byte
+// in its event loop (graceful_reload::_hand_over), not here.
+
+struct handoff_listener {
+    std::string m_name; // what the listener was configured as, e.g. "127.0.0.1:8080"
+    int m_fd;
+};
+
+inline constexpr size_t handoff_max_listeners = 64; // below SCM_MAX_FD
+
+inline std::system_error _handoff_error(char const *what) {
+    return std::system_error(errno, std::system_category(), what);
+}
+
+// a leading '@' names the abstract namespace, nothing is left in the filesystem
+inline socklen_t unix_address(std::string const &path, struct sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        throw _handoff_error("handoff socket path");
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    }
+    return socklen_t(offsetof(struct sockaddr_un, sun_path) + path.size());
+}
+
+inline void _handoff_timeout(int sock, int ms) {
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// one message: names separated by '\n', fds in the same order
+inline void handoff_send(int sock, std::vector<handoff_listener> const &listeners) {
+    if (listeners.empty() || listeners.size() > handoff_max_listeners) {
+        errno = EINVAL;
+        throw _handoff_error("handoff_send");
+    }
+    std::string names;
+    std::vector<int> fds;
+    for (auto &l : listeners) {
+        names += l.m_name;
+        names += '\n';
+        fds.push_back(l.m_fd);
+    }
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    struct iovec iov = {names.data(), names.size()};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != ssize_t(names.size())) {
+        throw _handoff_error("handoff sendmsg");
+    }
+}
+
+inline std::vector<handoff_listener> handoff_receive(int sock) {
+    char names[4096];
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * handoff_max_listeners)];
+    struct iovec iov = {names, sizeof(names)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        if (n == 0) {
+            errno = ECONNRESET;
+        }
+        throw _handoff_error("handoff recvmsg");
+    }
+
+    std::vector<int> fds;
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            fds.resize(count);
+            memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
+        }
+    }
+    std::vector<handoff_listener> listeners;
+    std::string_view rest(names, size_t(n));
+    for (int fd : fds) {
+        size_t nl = rest.find('\n');
+        listeners.push_back({std::string(rest.substr(0, nl)), fd});
+        rest.remove_prefix(nl == std::string_view::npos ? rest.size() : nl + 1);
+    }
+    if ((msg.msg_flags & (MSG_CTRUNC | MSG_TRUNC)) || !rest.empty()) {
+        for (auto &l : listeners) {
+            close(l.m_fd);
+        }
+        errno = EPROTO;
+        throw _handoff_error("handoff recvmsg");
+    }
+    return listeners;
+}
+
+// the new server, before its event loop starts; empty when nothing is
+// listening on path, i.e. there is no server to replace
+inline std::vector<handoff_listener> handoff_take_over(std::string const &path, int timeout_ms) {
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(path, addr);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        throw _handoff_error("handoff socket");
+    }
+    if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), len) == -1) {
+        int e = errno;
+        close(sock);
+        if (e == ECONNREFUSED || e == ENOENT) {
+            return {};
+        }
+        errno = e;
+        throw _handoff_error("handoff connect");
+    }
+    _handoff_timeout(sock, timeout_ms);
+    try {
+        auto listeners = handoff_receive(sock);
+        char ack = 1;
+        if (write(sock, &ack, 1) != 1) {
+            for (auto &l : listeners) {
+                close(l.m_fd);
+            }
+            throw _handoff_error("handoff ack");
+        }
+        close(sock);
+        return listeners;
+    } catch (...) {
+        close(sock);
+        throw;
+    }
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// HTTP header storage without allocation: well-known names land in fixed
+// slots found through a perfect hash generated at compile time, the rest go
+// to a small flat list. Names and values are views into the parser's raw
+// header bytes and stay valid until the parser is reset.
+
+enum class http_header_id : uint8_t {
+    content_length,
+    host,
+    connection,
+    transfer_encoding,
+    content_type,
+    upgrade,
+    http2_settings,
+    sec_websocket_key,
+    sec_websocket_version,
+    accept_encoding,
+    accept,
+    user_agent,
+    expect,
+    cookie,
+    authorization,
+    origin,
+    te,
+    keep_alive,
+    cache_control,
+    range,
+    referer,
+    if_none_match,
+    if_modified_since,
+    x_forwarded_for,
+    count,
+    unknown = 0xff,
+};
+
+inline constexpr size_t http_header_count = size_t(http_header_id::count);
+
+inline constexpr std::array<std::string_view, http_header_count> http_header_names = {
+    "content-length",
+    "host",
+    "connection",
+    "transfer-encoding",
+    "content-type",
+    "upgrade",
+    "http2-settings",
+    "sec-websocket-key",
+    "sec-websocket-version",
+    "accept-encoding",
+    "accept",
+    "user-agent",
+    "expect",
+    "cookie",
+    "authorization",
+    "origin",
+    "te",
+    "keep-alive",
+    "cache-control",
+    "range",
+    "referer",
+    "if-none-match",
+    "if-modified-since",
+    "x-forwarded-for",
+};
+
+constexpr char _header_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+constexpr bool header_name_equals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (_header_lower(a[i]) != _header_lower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// case-insensitive FNV-1a
+constexpr uint32_t _header_hash(std::string_view name, uint32_t seed) {
+    uint32_t h = seed ^ 2166136261u;
+    for (char c : name) {
+        h ^= static_cast<uint8_t>(_header_lower(c));
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+struct _header_phf {
+    static constexpr size_t slot_count = 64;
+
+    uint32_t m_seed;
+    std::array<uint8_t, slot_count> m_slots;
+};
+
+// first seed that maps every known name to its own slot
+constexpr _header_phf _build_header_phf() {
+    for (uint32_t seed = 0;; ++seed) {
+        _header_phf phf{seed, {}};
+        for (auto &slot : phf.m_slots) {
+            slot = uint8_t(http_header_id::unknown);
+        }
+        bool ok = true;
+        for (size_t i = 0; i < http_header_count && ok; ++i) {
+            auto &slot = phf.m_slots[_header_hash(http_header_names[i], seed) &
+                                     (_header_phf::slot_count - 1)];
+            ok = slot == uint8_t(http_header_id::unknown);
+            slot = static_cast<uint8_t>(i);
+        }
+        if (ok) {
+            return phf;
+        }
+    }
+}
+
+inline constexpr _header_phf header_phf = _build_header_phf();
+
+constexpr http_header_id http_header_lookup(std::string_view name) {
+    uint8_t slot = header_phf.m_slots[_header_hash(name, header_phf.m_seed) &
+                                      (_header_phf::slot_count - 1)];
+    if (slot == uint8_t(http_header_id::unknown) ||
+        !header_name_equals(name, http_header_names[slot])) {
+        return http_header_id::unknown;
+    }
+    return http_header_id(slot);
+}
+
+static_assert(http_header_lookup("Content-Length") == http_header_id::content_length);
+static_assert(http_header_lookup("x-unknown") == http_header_id::unknown);
+
+struct http_header_table {
+    using entry = std::pair<std::string_view, std::string_view>;
+
+    static constexpr size_t inline_other = 16;
+
+    std::array<std::string_view, http_header_count> m_known;
+    uint32_t m_present = 0;
+    std::array<entry, inline_other> m_other;
+    size_t m_other_count = 0;
+    std::vector<entry> m_other_overflow; // only past inline_other unknown headers
+
+    static_assert(http_header_count <= 32);
+
+    void clear() {
+        m_present = 0;
+        m_other_count = 0;
+        m_other_overflow.clear();
+    }
+
+    // headers that frame or route the message: two different values mean
+    // two parties may read two different requests (RFC 9112 6.3), and a
+    // second Transfer-Encoding would apply chunked twice
+    static constexpr uint32_t single_valued =
+        (uint32_t(1) << size_t(http_header_id::content_length)) |
+        (uint32_t(1) << size_t(http_header_id::host)) |
+        (uint32_t(1) << size_t(http_header_id::transfer_encoding));
+
+    // a repeated header keeps its last value; false, and nothing stored, if
+    // it is one of single_valued and repeats with another value (any repeat
+    // for Transfer-Encoding)
+    [[nodiscard]] bool add(std::string_view name, std::string_view value) {
+        auto id = http_header_lookup(name);
+        if (id != http_header_id::unknown) {
+            uint32_t bit = uint32_t(1) << size_t(id);
+            if ((m_present & bit & single_valued) &&
+                (id == http_header_id::transfer_encoding || m_known[size_t(id)] != value)) {
+                return false;
+            }
+            m_known[size_t(id)] = value;
+            m_present |= bit;
+        } else if (m_other_count < inline_other) {
+            m_other[m_other_count++] = {name, value};
+        } else {
+            m_other_overflow.emplace_back(name, value);
+        }
+        return true;
+    }
+
+    [[nodiscard]] bool has(http_header_id id) const {
+        return m_present & (uint32_t(1) << size_t(id));
+    }
+
+    // empty view if absent
+    std::string_view get(http_header_id id) const {
+        return has(id) ? m_known[size_t(id)] : std::string_view{};
+    }
+
+    [[nodiscard]] bool has(std::string_view name) const {
+        return _find(name) != nullptr;
+    }
+
+    std::string_view get(std::string_view name) const {
+        auto value = _find(name);
+        return value ? *value : std::string_view{};
+    }
+
+    std::string_view const *_find(std::string_view name) const {
+        auto id = http_header_lookup(name);
+        if (id != http_header_id::unknown) {
+            return has(id) ? &m_known[size_t(id)] : nullptr;
+        }
+        // 后出现的同名头优先, 与 known 头一致
+        for (size_t i = m_other_overflow.size(); i-- > 0;) {
+            if (header_name_equals(m_other_overflow[i].first, name)) {
+                return &m_other_overflow[i].second;
+            }
+        }
+        for (size_t i = m_other_count; i-- > 0;) {
+            if (header_name_equals(m_other[i].first, name)) {
+                return &m_other[i].second;
+            }
+        }
+        return nullptr;
+    }
+
+    template <class F>
+    void for_each(F &&f) const {
+        for (size_t i = 0; i < http_header_count; ++i) {
+            if (has(http_header_id(i))) {
+                f(http_header_names[i], m_known[i]);
+            }
+        }
+        for (size_t i = 0; i < m_other_count; ++i) {
+            f(m_other[i].first, m_other[i].second);
+        }
+        for (auto &[name, value] : m_other_overflow) {
+            f(name, value);
+        }
+    }
+};
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// HPACK header compression for HTTP/2 (RFC 7541)
+
+struct hpack_error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+using hpack_header_list = std::vector<std::pair<std::string, std::string>>;
+
+struct hpack_huffman_code {
+    uint32_t m_code;
+    uint8_t m_bits;
+};
+
+// RFC 7541 Appendix B, index 256 is EOS
+inline constexpr hpack_huffman_code hpack_huffman_table[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+struct _hpack_huffman_tree {
+    struct node {
+        int16_t m_child[2] = {-1, -1};
+        int16_t m_sym = -1;
+    };
+
+    std::vector<node> m_nodes;
+
+    _hpack_huffman_tree() {
+        m_nodes.emplace_back();
+        for (int sym = 0; sym < 257; ++sym) {
+            auto code = hpack_huffman_table[sym];
+            int cur = 0;
+            for (int i = code.m_bits - 1; i >= 0; --i) {
+                int bit = (code.m_code >> i) & 1;
+                if (m_nodes[cur].m_child[bit] == -1) {
+                    m_nodes[cur].m_child[bit] = static_cast<int16_t>(m_nodes.size());
+                    m_nodes.emplace_back();
+                }
+                cur = m_nodes[cur].m_child[bit];
+            }
+            m_nodes[cur].m_sym = static_cast<int16_t>(sym);
+        }
+    }
+
+    static _hpack_huffman_tree const &instance() {
+        static _hpack_huffman_tree tree;
+        return tree;
+    }
+};
+
+inline void hpack_huffman_decode(std::string_view in, std::string &out) {
+    auto &nodes = _hpack_huffman_tree::instance().m_nodes;
+    int cur = 0;
+    int depth = 0;
+    bool all_ones = true;
+    for (unsigned char c : in) {
+        for (int i = 7; i >= 0; --i) {
+            int bit = (c >> i) & 1;
+            cur = nodes[cur].m_child[bit];
+            if (cur == -1) {
+                throw hpack_error("hpack: invalid huffman code");
+            }
+            ++depth;
+            all_ones = all_ones && bit;
+            int sym = nodes[cur].m_sym;
+            if (sym != -1) {
+                if (sym == 256) {
+                    throw hpack_error("hpack: EOS in huffman string");
+                }
+                out.push_back(static_cast<char>(sym));
+                cur = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+    // 末尾只允许不超过 7 位的 EOS 前缀作为填充
+    if (depth > 7 || !all_ones) {
+        throw hpack_error("hpack: invalid huffman padding");
+    }
+}
+
+inline size_t hpack_huffman_length(std::string_view in) {
+    size_t bits = 0;
+    for (unsigned char c : in) {
+        bits += hpack_huffman_table[c].m_bits;
+    }
+    return (bits + 7) / 8;
+}
+
+inline void hpack_huffman_encode(std::string_view in, std::string &out) {
+    uint64_t acc = 0;
+    int nbits = 0;
+    for (unsigned char c : in) {
+        auto code = hpack_huffman_table[c];
+        acc = (acc << code.m_bits) | code.m_code;
+        nbits += code.m_bits;
+        while (nbits >= 8) {
+            nbits -= 8;
+            out.push_back(static_cast<char>(acc >> nbits));
+        }
+    }
+    if (nbits > 0) {
+        acc = (acc << (8 - nbits)) | ((1u << (8 - nbits)) - 1);
+        out.push_back(static_cast<char>(acc));
+    }
+}
+
+// RFC 7541 Appendix A, 1-based
+inline constexpr std::pair<std::string_view, std::string_view> hpack_static_table[61] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+    {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""},
+    {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+    {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+    {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+    {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+    {"via", ""}, {"www-authenticate", ""},
+};
+
+inline constexpr size_t hpack_static_table_size = 61;
+
+struct hpack_dynamic_table {
+    std::deque<std::pair<std::string, std::string>> m_entries; // newest first
+    size_t m_size = 0;
+    size_t m_max_size = 4096;
+
+    static size_t entry_size(std::string_view name, std::string_view value) {
+        return name.size() + value.size() + 32;
+    }
+
+    void _evict_to(size_t limit) {
+        while (m_size > limit && !m_entries.empty()) {
+            auto &back = m_entries.back();
+            m_size -= entry_size(back.first, back.second);
+            m_entries.pop_back();
+        }
+    }
+
+    void insert(std::string name, std::string value) {
+        size_t size = entry_size(name, value);
+        if (size > m_max_size) {
+            _evict_to(0);
+            return;
+        }
+        _evict_to(m_max_size - size);
+        m_entries.emplace_front(std::move(name), std::move(value));
+        m_size += size;
+    }
+
+    void set_max_size(size_t max_size) {
+        m_max_size = max_size;
+        _evict_to(max_size);
+    }
+};
+
+struct hpack_decoder {
+    hpack_dynamic_table m_table;
+    size_t m_max_table_size = 4096; // SETTINGS_HEADER_TABLE_SIZE we advertised
+    size_t m_max_list_size = SIZE_MAX; // SETTINGS_MAX_HEADER_LIST_SIZE we advertised
+
+    static uint64_t _decode_int(char const *&p, char const *end, int prefix) {
+        if (p == end) {
+            throw hpack_error("hpack: truncated integer");
+        }
+        uint64_t mask = (1u << prefix) - 1;
+        uint64_t value = static_cast<unsigned char>(*p++) & mask;
+        if (value < mask) {
+            return value;
+        }
+        for (int shift = 0;; shift += 7) {
+            if (p == end || shift > 28) {
+                throw hpack_error("hpack: bad integer");
+            }
+            unsigned char b = static_cast<unsigned char>(*p++);
+            value += static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return value;
+            }
+        }
+    }
+
+    static std::string _decode_string(char const *&p, char const *end) {
+        if (p == end) {
+            throw hpack_error("hpack: truncated string");
+        }
+        bool huffman = static_cast<unsigned char>(*p) & 0x80;
+        uint64_t len = _decode_int(p, end, 7);
+        if (len > static_cast<uint64_t>(end - p)) {
+            throw hpack_error("hpack: string length overflow");
+        }
+        std::string s;
+        if (huffman) {
+            hpack_huffman_decode({p, len}, s);
+        } else {
+            s.assign(p, len);
+        }
+        p += len;
+        return s;
+    }
+
+    std::pair<std::string_view, std::string_view> _lookup(uint64_t index) const {
+        if (index == 0) {
+            throw hpack_error("hpack: index 0");
+        }
+        if (index <= hpack_static_table_size) {
+            return hpack_static_table[index - 1];
+        }
+        index -= hpack_static_table_size + 1;
+        if (index >= m_table.m_entries.size()) {
+            throw hpack_error("hpack: index out of range");
+        }
+        auto &entry = m_table.m_entries[index];
+        return {entry.first, entry.second};
+    }
+
+    // the list size counts 32 bytes per field on top of name and value (RFC
+    // 9113 6.5.2); checked as fields are added, since a one-byte index can
+    // stand for a whole dynamic table entry
+    void _check_list_size(size_t &list_size, hpack_header_list const &out) const {
+        auto &[name, value] = out.back();
+        list_size += name.size() + value.size() + 32;
+        if (list_size > m_max_list_size) {
+            throw hpack_error("hpack: header list too large");
+        }
+    }
+
+    void decode(std::string_view block, hpack_header_list &out) {
+        char const *p = block.data();
+        char const *end = p + block.size();
+        size_t list_size = 0;
+        while (p != end) {
+            unsigned char b = static_cast<unsigned char>(*p);
+            if (b & 0x80) { // indexed header field
+                auto [name, value] = _lookup(_decode_int(p, end, 7));
+                out.emplace_back(name, value);
+                _check_list_size(list_size, out);
+            } else if ((b & 0xe0) == 0x20) { // dynamic table size update
+                uint64_t size = _decode_int(p, end, 5);
+                if (size > m_max_table_size) {
+                    throw hpack_error("hpack: table size too large");
+                }
+                m_table.set_max_size(size);
+            } else {
+                // literal: 01 incremental indexing, 0000 without, 0001 never
+                bool indexing = (b & 0xc0) == 0x40;
+                uint64_t index = _decode_int(p, end, indexing ? 6 : 4);
+                std::string name = index ? std::string(_lookup(index).first)
+                                         : _decode_string(p, end);
+                std::string value = _decode_string(p, end);
+                if (indexing) {
+                    m_table.insert(name, value);
+                }
+                out.emplace_back(std::move(name), std::move(value));
+                _check_list_size(list_size, out);
+            }
+        }
+    }
+};
+
+// stateless encoder: static-table references and literals, never indexes
+struct hpack_encoder {
+    static void _encode_int(std::string &out, uint64_t value, int prefix,
+                            uint8_t flags) {
+        uint64_t mask = (1u << prefix) - 1;
+        if (value < mask) {
+            out.push_back(static_cast<char>(flags | value));
+            return;
+        }
+        out.push_back(static_cast<char>(flags | mask));
+        value -= mask;
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static void _encode_string(std::string &out, std::string_view s) {
+        size_t hlen = hpack_huffman_length(s);
+        if (hlen < s.size()) {
+            _encode_int(out, hlen, 7, 0x80);
+            hpack_huffman_encode(s, out);
+        } else {
+            _encode_int(out, s.size(), 7, 0);
+            out.append(s);
+        }
+    }
+
+    void encode(std::string_view name, std::string_view value,
+                std::string &out) const {
+        size_t name_index = 0;
+        for (size_t i = 0; i < hpack_static_table_size; ++i) {
+            auto &entry = hpack_static_table[i];
+            if (entry.first != name) {
+                continue;
+            }
+            if (entry.second == value) {
+                _encode_int(out, i + 1, 7, 0x80);
+                return;
+            }
+            if (!name_index) {
+                name_index = i + 1;
+            }
+        }
+        _encode_int(out, name_index, 4, 0);
+        if (!name_index) {
+            _encode_string(out, name);
+        }
+        _encode_string(out, value);
+    }
+};
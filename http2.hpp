@@ -0,0 +1,870 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "bytes_buffer.hpp"
+#include "callback.hpp"
+#include "hpack.hpp"
+
+// HTTP/2 over cleartext (RFC 9113): frame codec and server-side connection
+
+enum class http2_errc : uint32_t {
+    no_error = 0x0,
+    protocol_error = 0x1,
+    internal_error = 0x2,
+    flow_control_error = 0x3,
+    settings_timeout = 0x4,
+    stream_closed = 0x5,
+    frame_size_error = 0x6,
+    refused_stream = 0x7,
+    cancel = 0x8,
+    compression_error = 0x9,
+    connect_error = 0xa,
+    enhance_your_calm = 0xb,
+};
+
+struct http2_error : std::runtime_error {
+    http2_errc m_code;
+
+    http2_error(http2_errc code, char const *what)
+        : std::runtime_error(what), m_code(code) {}
+};
+
+enum class http2_frame_type : uint8_t {
+    data = 0x0,
+    headers = 0x1,
+    priority = 0x2,
+    rst_stream = 0x3,
+    settings = 0x4,
+    push_promise = 0x5,
+    ping = 0x6,
+    goaway = 0x7,
+    window_update = 0x8,
+    continuation = 0x9,
+};
+
+namespace http2_flags {
+inline constexpr uint8_t end_stream = 0x1;
+inline constexpr uint8_t ack = 0x1;
+inline constexpr uint8_t end_headers = 0x4;
+inline constexpr uint8_t padded = 0x8;
+inline constexpr uint8_t priority = 0x20;
+} // namespace http2_flags
+
+enum class http2_setting : uint16_t {
+    header_table_size = 0x1,
+    enable_push = 0x2,
+    max_concurrent_streams = 0x3,
+    initial_window_size = 0x4,
+    max_frame_size = 0x5,
+    max_header_list_size = 0x6,
+};
+
+inline uint32_t _http2_read_u32(char const *p) {
+    auto u = reinterpret_cast<unsigned char const *>(p);
+    return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) |
+           (uint32_t(u[2]) << 8) | uint32_t(u[3]);
+}
+
+inline void _http2_append_u32(bytes_buffer &out, uint32_t v) {
+    char b[4] = {char(v >> 24), char(v >> 16), char(v >> 8), char(v)};
+    out.append(std::string_view{b, 4});
+}
+
+struct http2_frame_header {
+    static constexpr size_t size = 9;
+
+    uint32_t m_length;
+    http2_frame_type m_type;
+    uint8_t m_flags;
+    uint32_t m_stream_id;
+
+    static http2_frame_header parse(char const *p) {
+        auto u = reinterpret_cast<unsigned char const *>(p);
+        return {(uint32_t(u[0]) << 16) | (uint32_t(u[1]) << 8) | uint32_t(u[2]),
+                http2_frame_type(u[3]), u[4],
+                _http2_read_u32(p + 5) & 0x7fffffff};
+    }
+
+    void write(bytes_buffer &out) const {
+        char b[size] = {char(m_length >> 16), char(m_length >> 8),
+                        char(m_length),       char(m_type),
+                        char(m_flags),        char(m_stream_id >> 24),
+                        char(m_stream_id >> 16), char(m_stream_id >> 8),
+                        char(m_stream_id)};
+        out.append(std::string_view{b, size});
+    }
+};
+
+// appends frames to a shared output buffer, so frames of many streams leave
+// in one write
+struct http2_frame_writer {
+    bytes_buffer *m_out;
+
+    void frame(http2_frame_type type, uint8_t flags, uint32_t stream_id,
+               std::string_view payload) {
+        http2_frame_header{uint32_t(payload.size()), type, flags, stream_id}
+            .write(*m_out);
+        m_out->append(payload);
+    }
+
+    void settings(std::vector<std::pair<http2_setting, uint32_t>> const &values) {
+        http2_frame_header{uint32_t(values.size() * 6),
+                           http2_frame_type::settings, 0, 0}
+            .write(*m_out);
+        for (auto [id, value] : values) {
+            char b[2] = {char(uint16_t(id) >> 8), char(id)};
+            m_out->append(std::string_view{b, 2});
+            _http2_append_u32(*m_out, value);
+        }
+    }
+
+    void settings_ack() {
+        frame(http2_frame_type::settings, http2_flags::ack, 0, {});
+    }
+
+    void ping_ack(std::string_view opaque) {
+        frame(http2_frame_type::ping, http2_flags::ack, 0, opaque);
+    }
+
+    void goaway(uint32_t last_stream_id, http2_errc code) {
+        http2_frame_header{8, http2_frame_type::goaway, 0, 0}.write(*m_out);
+        _http2_append_u32(*m_out, last_stream_id);
+        _http2_append_u32(*m_out, uint32_t(code));
+    }
+
+    void rst_stream(uint32_t stream_id, http2_errc code) {
+        http2_frame_header{4, http2_frame_type::rst_stream, 0, stream_id}
+            .write(*m_out);
+        _http2_append_u32(*m_out, uint32_t(code));
+    }
+
+    void window_update(uint32_t stream_id, uint32_t increment) {
+        http2_frame_header{4, http2_frame_type::window_update, 0, stream_id}
+            .write(*m_out);
+        _http2_append_u32(*m_out, increment);
+    }
+
+    // splits the header block into HEADERS + CONTINUATION frames
+    void headers(uint32_t stream_id, std::string_view block, bool end_stream,
+                 size_t max_frame_size) {
+        auto type = http2_frame_type::headers;
+        uint8_t flags = end_stream ? http2_flags::end_stream : 0;
+        do {
+            auto part = block.substr(0, max_frame_size);
+            block.remove_prefix(part.size());
+            frame(type, flags | (block.empty() ? http2_flags::end_headers : 0),
+                  stream_id, part);
+            type = http2_frame_type::continuation;
+            flags = 0;
+        } while (!block.empty());
+    }
+
+    void data(uint32_t stream_id, std::string_view payload, bool end_stream) {
+        frame(http2_frame_type::data, end_stream ? http2_flags::end_stream : 0,
+              stream_id, payload);
+    }
+};
+
+// where a request body goes as its DATA frames arrive
+struct http2_body_sink {
+    virtual void write(std::string_view data) = 0;
+    virtual size_t size() const = 0;
+    virtual ~http2_body_sink() = default;
+};
+
+// unless the connection's m_on_open gives the request another sink
+struct http2_memory_body final : http2_body_sink {
+    std::string m_data;
+
+    void write(std::string_view data) override {
+        m_data.append(data);
+    }
+
+    size_t size() const override {
+        return m_data.size();
+    }
+};
+
+struct http2_request {
+    uint32_t m_stream_id = 0;
+    hpack_header_list m_headers;
+    std::unique_ptr<http2_body_sink> m_body;
+
+    std::string_view header(std::string_view name) const {
+        for (auto &[key, value] : m_headers) {
+            if (key == name) {
+                return value;
+            }
+        }
+        return {};
+    }
+
+    std::string_view method() const {
+        return header(":method");
+    }
+
+    std::string_view path() const {
+        return header(":path");
+    }
+};
+
+struct http2_connection {
+    static constexpr std::string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    static constexpr uint32_t local_max_frame_size = 16384;
+    static constexpr int64_t local_initial_window = 65535;
+    static constexpr uint32_t local_max_concurrent_streams = 100;
+    static constexpr uint32_t local_max_header_list_size = 64 * 1024;
+    static constexpr int64_t max_window = 0x7fffffff;
+    // body sources are not pulled while this much output is unwritten
+    static constexpr size_t output_high_water = 64 * 1024;
+
+    using handler_type = callback<http2_connection &, http2_request &>;
+
+    struct stream {
+        http2_request m_req;
+        int64_t m_send_window;
+        int64_t m_recv_window = local_initial_window;
+        int64_t m_recv_credit = 0; // consumed, not yet given back by WINDOW_UPDATE
+        std::string m_pending; // response body not yet covered by the window
+        size_t m_pending_off = 0;
+        // the rest of a streamed body, pulled a piece at a time once m_pending
+        // is sent; an empty piece ends it
+        callback<std::string &> m_source;
+        bool m_remote_closed = false;
+        bool m_responded = false;
+    };
+
+    http2_frame_writer m_writer;
+    handler_type m_handler;
+    callback<http2_request &> m_on_open; // headers are in, may set m_body
+    size_t m_max_body_size = SIZE_MAX;   // larger bodies get 413 and RST_STREAM
+    std::string m_in;
+    bool m_preface_received = false;
+    bool m_closing = false;
+    bool m_failed = false;
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+    std::map<uint32_t, stream> m_streams;
+    uint32_t m_last_stream_id = 0;
+    uint32_t m_continuation_stream = 0; // != 0 while a header block is open
+    bool m_continuation_end_stream = false;
+    std::string m_header_block;
+    uint32_t m_peer_max_frame_size = 16384;
+    int64_t m_peer_initial_window = 65535;
+    int64_t m_conn_send_window = 65535;
+    int64_t m_conn_recv_window = local_initial_window;
+    int64_t m_conn_recv_credit = 0;
+    bool m_output_held = false; // a body source waits for output_high_water
+
+    http2_connection(bytes_buffer &out, handler_type handler)
+        : m_writer{&out}, m_handler(std::move(handler)) {
+        m_decoder.m_max_list_size = local_max_header_list_size;
+    }
+
+    http2_connection(http2_connection const &) = delete;
+    http2_connection &operator=(http2_connection const &) = delete;
+
+    // prior knowledge: the client preface is the first thing on the wire
+    void start() {
+        _send_settings();
+    }
+
+    // h2c upgrade: the HTTP/1.1 request becomes stream 1, already half-closed
+    void start_upgraded(http2_request req, std::string_view settings_payload) {
+        try {
+            _apply_settings(settings_payload);
+        } catch (http2_error const &e) {
+            _fail(e.m_code);
+            return;
+        }
+        _send_settings();
+        req.m_stream_id = 1;
+        m_last_stream_id = 1;
+        auto &st = _open_stream(1);
+        st.m_req = std::move(req);
+        _opened(st.m_req);
+        st.m_remote_closed = true;
+        _dispatch(1);
+    }
+
+    void push_chunk(std::string_view chunk) {
+        if (m_failed) {
+            return;
+        }
+        m_in.append(chunk);
+        try {
+            _process();
+        } catch (http2_error const &e) {
+            _fail(e.m_code);
+        } catch (hpack_error const &) {
+            _fail(http2_errc::compression_error); // the table is out of sync now
+        } catch (std::exception const &) {
+            _fail(http2_errc::internal_error);
+        }
+    }
+
+    // once the output is written: streams held back by output_high_water
+    // carry on; true if one was held back again
+    bool pump() {
+        m_output_held = false;
+        _resume_all();
+        return m_output_held;
+    }
+
+    [[nodiscard]] bool wants_close() const {
+        return m_failed || (m_closing && m_streams.empty());
+    }
+
+    // graceful close: open streams still complete, new ones are ignored
+    void go_away() {
+        if (!m_closing) {
+            m_writer.goaway(m_last_stream_id, http2_errc::no_error);
+            m_closing = true;
+        }
+    }
+
+    void submit_response(uint32_t stream_id, int status,
+                         hpack_header_list const &headers, std::string body) {
+        auto it = m_streams.find(stream_id);
+        if (it == m_streams.end() || it->second.m_responded) {
+            return;
+        }
+        auto &st = it->second;
+        st.m_responded = true;
+        std::string block;
+        m_encoder.encode(":status", std::to_string(status), block);
+        for (auto &[key, value] : headers) {
+            m_encoder.encode(key, value, block);
+        }
+        m_writer.headers(stream_id, block, body.empty(), m_peer_max_frame_size);
+        st.m_pending = std::move(body);
+        _send_pending(it);
+    }
+
+    // the body is pulled from source as the flow-control windows and the
+    // output allow, so it is never held whole
+    void submit_response(uint32_t stream_id, int status,
+                         hpack_header_list const &headers, callback<std::string &> source) {
+        auto it = m_streams.find(stream_id);
+        if (it == m_streams.end() || it->second.m_responded) {
+            return;
+        }
+        auto &st = it->second;
+        st.m_responded = true;
+        std::string block;
+        m_encoder.encode(":status", std::to_string(status), block);
+        for (auto &[key, value] : headers) {
+            m_encoder.encode(key, value, block);
+        }
+        m_writer.headers(stream_id, block, false, m_peer_max_frame_size);
+        st.m_source = std::move(source);
+        _send_pending(it);
+    }
+
+    void _send_settings() {
+        m_writer.settings({
+            {http2_setting::max_concurrent_streams, local_max_concurrent_streams},
+            {http2_setting::initial_window_size, uint32_t(local_initial_window)},
+            {http2_setting::max_frame_size, local_max_frame_size},
+            {http2_setting::max_header_list_size, local_max_header_list_size},
+            {http2_setting::enable_push, 0},
+        });
+    }
+
+    void _fail(http2_errc code) {
+        m_writer.goaway(m_last_stream_id, code);
+        m_failed = true;
+        m_closing = true;
+    }
+
+    stream &_open_stream(uint32_t stream_id) {
+        auto &st = m_streams[stream_id];
+        st.m_req.m_stream_id = stream_id;
+        st.m_send_window = m_peer_initial_window;
+        return st;
+    }
+
+    void _opened(http2_request &req) {
+        if (m_on_open) {
+            m_on_open(multishot_call, req);
+        }
+    }
+
+    // a failure of one stream, e.g. its body sink could not write: the
+    // connection and the other streams carry on
+    void _reset_stream(uint32_t stream_id, http2_errc code) {
+        m_writer.rst_stream(stream_id, code);
+        m_streams.erase(stream_id);
+    }
+
+    void _dispatch(uint32_t stream_id) {
+        // the handler may respond inline, which can erase the stream
+        auto req = std::move(m_streams.at(stream_id).m_req);
+        try {
+            m_handler(multishot_call, *this, req);
+        } catch (std::exception const &) {
+            if (m_streams.count(stream_id)) {
+                _reset_stream(stream_id, http2_errc::internal_error);
+            }
+        }
+    }
+
+    void _close_if_done(std::map<uint32_t, stream>::iterator it) {
+        auto &st = it->second;
+        if (st.m_remote_closed && st.m_responded && !st.m_source &&
+            st.m_pending_off == st.m_pending.size()) {
+            m_streams.erase(it);
+        }
+    }
+
+    // the next piece of a streamed body into m_pending; false if the
+    // stream was reset because the source failed
+    bool _pull(std::map<uint32_t, stream>::iterator it) {
+        auto &st = it->second;
+        st.m_pending.clear();
+        st.m_pending_off = 0;
+        try {
+            st.m_source(multishot_call, st.m_pending);
+        } catch (std::exception const &) {
+            _reset_stream(it->first, http2_errc::internal_error);
+            return false;
+        }
+        if (st.m_pending.empty()) {
+            st.m_source = nullptr;
+            m_writer.data(it->first, {}, true);
+        }
+        return true;
+    }
+
+    void _send_pending(std::map<uint32_t, stream>::iterator it) {
+        auto &st = it->second;
+        while (true) {
+            if (st.m_pending_off == st.m_pending.size()) {
+                if (!st.m_source) {
+                    break;
+                }
+                // a peer that does not open its window holds one piece at most
+                if (m_conn_send_window <= 0 || st.m_send_window <= 0) {
+                    return;
+                }
+                if (m_writer.m_out->size() >= output_high_water) {
+                    m_output_held = true;
+                    return;
+                }
+                if (!_pull(it)) {
+                    return;
+                }
+                continue;
+            }
+            int64_t n = std::min<int64_t>(
+                {int64_t(st.m_pending.size() - st.m_pending_off),
+                 m_conn_send_window, st.m_send_window,
+                 int64_t(m_peer_max_frame_size)});
+            if (n <= 0) {
+                return; // wait for WINDOW_UPDATE
+            }
+            bool last = !st.m_source && st.m_pending_off + n == st.m_pending.size();
+            m_writer.data(it->first,
+                          std::string_view{st.m_pending}.substr(st.m_pending_off, n),
+                          last);
+            st.m_pending_off += n;
+            m_conn_send_window -= n;
+            st.m_send_window -= n;
+        }
+        _close_if_done(it);
+    }
+
+    void _resume_all() {
+        for (auto it = m_streams.begin(); it != m_streams.end();) {
+            auto next = std::next(it);
+            if (it->second.m_responded) {
+                _send_pending(it);
+            }
+            it = next;
+        }
+    }
+
+    void _process() {
+        size_t off = 0;
+        if (!m_preface_received) {
+            size_t n = std::min(m_in.size(), preface.size());
+            if (std::string_view{m_in}.substr(0, n) != preface.substr(0, n)) {
+                throw http2_error(http2_errc::protocol_error, "http2: bad preface");
+            }
+            if (n < preface.size()) {
+                return;
+            }
+            m_preface_received = true;
+            off = preface.size();
+        }
+        while (!m_failed && m_in.size() - off >= http2_frame_header::size) {
+            auto hdr = http2_frame_header::parse(m_in.data() + off);
+            if (hdr.m_length > local_max_frame_size) {
+                throw http2_error(http2_errc::frame_size_error, "http2: frame too large");
+            }
+            if (m_in.size() - off < http2_frame_header::size + hdr.m_length) {
+                break;
+            }
+            std::string_view payload{m_in.data() + off + http2_frame_header::size,
+                                     hdr.m_length};
+            _on_frame(hdr, payload);
+            off += http2_frame_header::size + hdr.m_length;
+        }
+        m_in.erase(0, off);
+    }
+
+    static std::string_view _strip_padding(http2_frame_header const &hdr,
+                                           std::string_view payload) {
+        if (!(hdr.m_flags & http2_flags::padded)) {
+            return payload;
+        }
+        if (payload.empty()) {
+            throw http2_error(http2_errc::frame_size_error, "http2: missing pad length");
+        }
+        size_t pad = static_cast<unsigned char>(payload[0]);
+        if (pad >= payload.size()) {
+            throw http2_error(http2_errc::protocol_error, "http2: bad padding");
+        }
+        return payload.substr(1, payload.size() - 1 - pad);
+    }
+
+    void _on_frame(http2_frame_header const &hdr, std::string_view payload) {
+        if (m_continuation_stream != 0 &&
+            (hdr.m_type != http2_frame_type::continuation ||
+             hdr.m_stream_id != m_continuation_stream)) {
+            throw http2_error(http2_errc::protocol_error, "http2: expected CONTINUATION");
+        }
+        switch (hdr.m_type) {
+        case http2_frame_type::data:
+            _on_data(hdr, payload);
+            break;
+        case http2_frame_type::headers:
+            _on_headers(hdr, payload);
+            break;
+        case http2_frame_type::continuation:
+            _on_continuation(hdr, payload);
+            break;
+        case http2_frame_type::priority:
+            if (hdr.m_stream_id == 0) {
+                throw http2_error(http2_errc::protocol_error, "http2: PRIORITY on stream 0");
+            }
+            break;
+        case http2_frame_type::rst_stream:
+            if (hdr.m_stream_id == 0) {
+                throw http2_error(http2_errc::protocol_error, "http2: RST_STREAM on stream 0");
+            }
+            if (payload.size() != 4) {
+                throw http2_error(http2_errc::frame_size_error, "http2: bad RST_STREAM");
+            }
+            m_streams.erase(hdr.m_stream_id);
+            break;
+        case http2_frame_type::settings:
+            _on_settings(hdr, payload);
+            break;
+        case http2_frame_type::ping:
+            if (hdr.m_stream_id != 0) {
+                throw http2_error(http2_errc::protocol_error, "http2: PING on a stream");
+            }
+            if (payload.size() != 8) {
+                throw http2_error(http2_errc::frame_size_error, "http2: bad PING");
+            }
+            if (!(hdr.m_flags & http2_flags::ack)) {
+                m_writer.ping_ack(payload);
+            }
+            break;
+        case http2_frame_type::goaway:
+            m_closing = true;
+            break;
+        case http2_frame_type::window_update:
+            _on_window_update(hdr, payload);
+            break;
+        case http2_frame_type::push_promise:
+            throw http2_error(http2_errc::protocol_error, "http2: PUSH_PROMISE from client");
+        default:
+            break; // unknown frame types are ignored
+        }
+    }
+
+    void _on_data(http2_frame_header const &hdr, std::string_view payload) {
+        if (hdr.m_stream_id == 0) {
+            throw http2_error(http2_errc::protocol_error, "http2: DATA on stream 0");
+        }
+        // padding counts against flow control as well
+        m_conn_recv_window -= hdr.m_length;
+        if (m_conn_recv_window < 0) {
+            throw http2_error(http2_errc::flow_control_error, "http2: connection window exceeded");
+        }
+        auto data = _strip_padding(hdr, payload);
+        auto it = m_streams.find(hdr.m_stream_id);
+        if (it == m_streams.end() || it->second.m_remote_closed) {
+            m_writer.rst_stream(hdr.m_stream_id, http2_errc::stream_closed);
+            _credit_connection(hdr.m_length);
+            return;
+        }
+        auto &st = it->second;
+        st.m_recv_window -= hdr.m_length;
+        if (st.m_recv_window < 0) {
+            m_writer.rst_stream(hdr.m_stream_id, http2_errc::flow_control_error);
+            m_streams.erase(it);
+            _credit_connection(hdr.m_length);
+            return;
+        }
+        size_t received = st.m_req.m_body ? st.m_req.m_body->size() : 0;
+        if (received + data.size() > m_max_body_size) {
+            _refuse_body(it);
+            _credit_connection(hdr.m_length);
+            return;
+        }
+        if (!data.empty()) {
+            if (!st.m_req.m_body) {
+                st.m_req.m_body = std::make_unique<http2_memory_body>();
+            }
+            try {
+                st.m_req.m_body->write(data);
+            } catch (std::exception const &) {
+                // e.g. the spill file could not be written
+                _reset_stream(hdr.m_stream_id, http2_errc::internal_error);
+                _credit_connection(hdr.m_length);
+                return;
+            }
+        }
+        // the window opens again only for what the sink has taken
+        _credit_connection(hdr.m_length);
+        if (hdr.m_flags & http2_flags::end_stream) {
+            st.m_remote_closed = true;
+            _dispatch(hdr.m_stream_id);
+        } else {
+            _credit_stream(st, hdr.m_stream_id, hdr.m_length);
+        }
+    }
+
+    // WINDOW_UPDATE once half the window is consumed, not after every frame
+    void _credit_connection(int64_t n) {
+        m_conn_recv_credit += n;
+        if (m_conn_recv_credit >= local_initial_window / 2) {
+            m_writer.window_update(0, uint32_t(m_conn_recv_credit));
+            m_conn_recv_window += m_conn_recv_credit;
+            m_conn_recv_credit = 0;
+        }
+    }
+
+    void _credit_stream(stream &st, uint32_t stream_id, int64_t n) {
+        st.m_recv_credit += n;
+        if (st.m_recv_credit >= local_initial_window / 2) {
+            m_writer.window_update(stream_id, uint32_t(st.m_recv_credit));
+            st.m_recv_window += st.m_recv_credit;
+            st.m_recv_credit = 0;
+        }
+    }
+
+    // answer before the body is in and ask the client to stop sending it
+    // (RFC 9113 8.1)
+    void _refuse_body(std::map<uint32_t, stream>::iterator it) {
+        uint32_t stream_id = it->first;
+        submit_response(stream_id, 413, {}, std::string{});
+        m_writer.rst_stream(stream_id, http2_errc::no_error);
+        m_streams.erase(stream_id);
+    }
+
+    void _append_header_block(std::string_view block) {
+        if (m_header_block.size() + block.size() > local_max_header_list_size) {
+            throw http2_error(http2_errc::enhance_your_calm, "http2: header block too large");
+        }
+        m_header_block.append(block);
+    }
+
+    void _on_headers(http2_frame_header const &hdr, std::string_view payload) {
+        if (hdr.m_stream_id == 0 || hdr.m_stream_id % 2 == 0) {
+            throw http2_error(http2_errc::protocol_error, "http2: bad HEADERS stream id");
+        }
+        auto block = _strip_padding(hdr, payload);
+        if (hdr.m_flags & http2_flags::priority) {
+            if (block.size() < 5) {
+                throw http2_error(http2_errc::frame_size_error, "http2: bad HEADERS priority");
+            }
+            block.remove_prefix(5);
+        }
+        m_header_block.clear();
+        _append_header_block(block);
+        m_continuation_end_stream = hdr.m_flags & http2_flags::end_stream;
+        if (hdr.m_flags & http2_flags::end_headers) {
+            _on_header_block(hdr.m_stream_id);
+        } else {
+            m_continuation_stream = hdr.m_stream_id;
+        }
+    }
+
+    void _on_continuation(http2_frame_header const &hdr, std::string_view payload) {
+        if (m_continuation_stream == 0) {
+            throw http2_error(http2_errc::protocol_error, "http2: unexpected CONTINUATION");
+        }
+        _append_header_block(payload);
+        if (hdr.m_flags & http2_flags::end_headers) {
+            m_continuation_stream = 0;
+            _on_header_block(hdr.m_stream_id);
+        }
+    }
+
+    void _on_header_block(uint32_t stream_id) {
+        // always decode, the HPACK table must stay in sync with the peer
+        hpack_header_list headers;
+        m_decoder.decode(m_header_block, headers);
+        m_header_block.clear();
+
+        auto it = m_streams.find(stream_id);
+        if (it != m_streams.end()) {
+            // trailers: must end the stream
+            if (it->second.m_remote_closed || !m_continuation_end_stream) {
+                throw http2_error(http2_errc::protocol_error, "http2: unexpected HEADERS");
+            }
+            it->second.m_remote_closed = true;
+            _dispatch(stream_id);
+            return;
+        }
+        if (stream_id <= m_last_stream_id) {
+            throw http2_error(http2_errc::protocol_error, "http2: stream id not increasing");
+        }
+        m_last_stream_id = stream_id;
+        if (m_closing) {
+            return;
+        }
+        if (m_streams.size() >= local_max_concurrent_streams) {
+            m_writer.rst_stream(stream_id, http2_errc::refused_stream);
+            return;
+        }
+        auto &st = _open_stream(stream_id);
+        st.m_req.m_headers = std::move(headers);
+        _opened(st.m_req);
+        if (m_continuation_end_stream) {
+            st.m_remote_closed = true;
+            _dispatch(stream_id);
+        }
+    }
+
+    void _apply_settings(std::string_view payload) {
+        if (payload.size() % 6 != 0) {
+            throw http2_error(http2_errc::frame_size_error, "http2: bad SETTINGS");
+        }
+        for (size_t i = 0; i < payload.size(); i += 6) {
+            auto u = reinterpret_cast<unsigned char const *>(payload.data() + i);
+            auto id = http2_setting((u[0] << 8) | u[1]);
+            uint32_t value = _http2_read_u32(payload.data() + i + 2);
+            switch (id) {
+            case http2_setting::initial_window_size: {
+                if (value > max_window) {
+                    throw http2_error(http2_errc::flow_control_error, "http2: window too large");
+                }
+                int64_t delta = int64_t(value) - m_peer_initial_window;
+                m_peer_initial_window = value;
+                for (auto &[_, st] : m_streams) {
+                    st.m_send_window += delta;
+                }
+                break;
+            }
+            case http2_setting::max_frame_size:
+                if (value < 16384 || value > 16777215) {
+                    throw http2_error(http2_errc::protocol_error, "http2: bad max frame size");
+                }
+                m_peer_max_frame_size = value;
+                break;
+            case http2_setting::enable_push:
+                if (value > 1) {
+                    throw http2_error(http2_errc::protocol_error, "http2: bad enable push");
+                }
+                break;
+            default:
+                break; // the encoder never uses the dynamic table
+            }
+        }
+    }
+
+    void _on_settings(http2_frame_header const &hdr, std::string_view payload) {
+        if (hdr.m_stream_id != 0) {
+            throw http2_error(http2_errc::protocol_error, "http2: SETTINGS on a stream");
+        }
+        if (hdr.m_flags & http2_flags::ack) {
+            if (!payload.empty()) {
+                throw http2_error(http2_errc::frame_size_error, "http2: SETTINGS ack with payload");
+            }
+            return;
+        }
+        _apply_settings(payload);
+        m_writer.settings_ack();
+        _resume_all();
+    }
+
+    void _on_window_update(http2_frame_header const &hdr, std::string_view payload) {
+        if (payload.size() != 4) {
+            throw http2_error(http2_errc::frame_size_error, "http2: bad WINDOW_UPDATE");
+        }
+        int64_t increment = _http2_read_u32(payload.data()) & 0x7fffffff;
+        if (hdr.m_stream_id == 0) {
+            if (increment == 0) {
+                throw http2_error(http2_errc::protocol_error, "http2: zero WINDOW_UPDATE");
+            }
+            m_conn_send_window += increment;
+            if (m_conn_send_window > max_window) {
+                throw http2_error(http2_errc::flow_control_error, "http2: window overflow");
+            }
+            _resume_all();
+            return;
+        }
+        auto it = m_streams.find(hdr.m_stream_id);
+        if (it == m_streams.end()) {
+            return;
+        }
+        auto &st = it->second;
+        st.m_send_window += increment;
+        if (increment == 0 || st.m_send_window > max_window) {
+            m_writer.rst_stream(hdr.m_stream_id, increment == 0
+                                                     ? http2_errc::protocol_error
+                                                     : http2_errc::flow_control_error);
+            m_streams.erase(it);
+            return;
+        }
+        if (st.m_responded) {
+            _send_pending(it);
+        }
+    }
+};
+
+// HTTP2-Settings header of an h2c upgrade is base64url without padding
+inline std::string http2_decode_settings_header(std::string_view value) {
+    std::string out;
+    uint32_t acc = 0;
+    int nbits = 0;
+    for (char c : value) {
+        int v;
+        if (c >= 'A' && c <= 'Z') {
+            v = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            v = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            v = c - '0' + 52;
+        } else if (c == '-' || c == '+') {
+            v = 62;
+        } else if (c == '_' || c == '/') {
+            v = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            throw http2_error(http2_errc::protocol_error, "http2: bad HTTP2-Settings");
+        }
+        acc = (acc << 6) | v;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out.push_back(static_cast<char>(acc >> nbits));
+        }
+    }
+    return out;
+}
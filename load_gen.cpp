@@ -0,0 +1,762 @@
+// load_gen: an open-loop HTTP/1.1 load generator, for what admission
+// control promises under overload. Requests are due at a fixed rate
+// whether or not earlier ones have been answered, and a latency counts
+// from the time its request was due, so a server that falls behind is
+// charged for the queue it builds instead of slowing the generator down.
+// A due request waits in the generator until one of the connections is
+// free; requests still waiting when the run ends are reported as unsent.
+//
+//   load_gen --target SPEC [--rate N] [--duration SECS] [--connections N]
+//            [--source-ips N] [--path /] [--max-failed N] [--max-p99-ms N]
+//            [--server COMMAND [--reload-after SECS]]
+//
+// --target takes a listen spec (see config.hpp), e.g. "tcp 127.0.0.1:8080"
+// or "unix @co_http". --source-ips N binds the connections round robin to
+// 127.0.0.2 onwards, so the per-IP buckets see N clients (loopback only).
+// Responses must carry Content-Length.
+// A keep-alive connection the server closes before any of the response to
+// a request it was sent has arrived gets the request again on a new
+// connection, as RFC 9112 9.3.1 allows for idempotent requests; that is
+// counted as retried. Every response other than 2xx, a connection error,
+// a truncated response and an unsent request counts as failed.
+// Latency is reported for every response and for 2xx alone. Exits 1 when
+// failed is above --max-failed or the 2xx p99 above --max-p99-ms.
+//
+// --server runs COMMAND (with sh -c) first, starts the clock once the
+// target accepts, and stops the server with SIGTERM at the end.
+// --reload-after runs COMMAND a second time that far into the run: the new
+// server takes the listeners over (graceful_reload), and the old one has to
+// drain and exit before load_gen does, or the run fails. With
+// --max-failed 0 that checks a restart under load loses no request.
+
+#include "config.hpp"
+#include "handoff.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <fmt/format.h>
+
+struct load_options
+{
+    listener_config target;
+    double rate = 1000;   // requests per second
+    double duration = 5;  // seconds of scheduling, then up to load_grace_ns to finish
+    size_t connections = 64;
+    size_t source_ips = 0; // 0: let the kernel pick
+    std::string path = "/";
+    int64_t max_failed = -1; // -1: any number
+    double max_p99_ms = 0;   // 0: any
+    std::string server;      // started, and stopped at the end, by load_gen
+    double reload_after = 0; // seconds into the run, 0: no reload
+};
+
+constexpr uint64_t load_grace_ns = 5000000000;
+// how long a replaced server may take to drain: its drain_timeout_ms and more
+constexpr uint64_t load_drain_wait_ns = 15000000000;
+
+uint64_t load_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+struct load_stats
+{
+    uint64_t m_sent = 0;
+    uint64_t m_ok = 0;          // 2xx
+    uint64_t m_shed = 0;        // 503
+    uint64_t m_rate_limited = 0; // 429
+    uint64_t m_other_status = 0;
+    uint64_t m_errors = 0; // refused, reset, truncated, or unanswered at the end
+    uint64_t m_retried = 0;
+    uint64_t m_unsent = 0;
+    // due time to the last byte of the response
+    std::vector<uint64_t> m_latency_ns;    // every response
+    std::vector<uint64_t> m_ok_latency_ns; // 2xx only, what shedding is meant to protect
+
+    uint64_t failed() const
+    {
+        return m_shed + m_rate_limited + m_other_status + m_errors + m_unsent;
+    }
+};
+
+// nearest rank, in milliseconds
+double load_percentile_ms(std::vector<uint64_t> &latency_ns, double p)
+{
+    if (latency_ns.empty())
+    {
+        return 0;
+    }
+    size_t rank = std::min(size_t(p / 100 * double(latency_ns.size())), latency_ns.size() - 1);
+    std::nth_element(latency_ns.begin(), latency_ns.begin() + rank, latency_ns.end());
+    return double(latency_ns[rank]) / 1e6;
+}
+
+void load_print_latency(char const *what, std::vector<uint64_t> &latency_ns)
+{
+    fmt::println("{:<6} p50 {:.2f}ms p99 {:.2f}ms p99.9 {:.2f}ms max {:.2f}ms", what,
+                 load_percentile_ms(latency_ns, 50), load_percentile_ms(latency_ns, 99),
+                 load_percentile_ms(latency_ns, 99.9), load_percentile_ms(latency_ns, 100));
+}
+
+// "exec" so the pid is the server's own and SIGTERM reaches it
+pid_t load_spawn(std::string const &command)
+{
+    std::string line = "exec " + command;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execl("/bin/sh", "sh", "-c", line.c_str(), static_cast<char *>(nullptr));
+        _exit(127);
+    }
+    if (pid == -1)
+    {
+        throw std::system_error(errno, std::system_category(), "fork");
+    }
+    return pid;
+}
+
+struct load_connection
+{
+    int m_fd = -1;
+    size_t m_source = 0;     // index into the source addresses
+    bool m_connecting = false;
+    bool m_busy = false;     // a request is out, or waits for the connect
+    bool m_reused = false;   // has had a response, so the server may close it idle
+    uint64_t m_due_ns = 0;
+    std::string m_in;
+};
+
+struct load_generator
+{
+    load_options m_opts;
+    int m_epfd = -1;
+    struct sockaddr_storage m_addr = {};
+    socklen_t m_addr_len = 0;
+    std::vector<struct sockaddr_in> m_sources;
+    std::string m_request;
+    std::vector<load_connection> m_conns;
+    std::vector<load_connection *> m_idle;
+    std::deque<uint64_t> m_due; // due times of requests no connection has taken yet
+    load_stats m_stats;
+    pid_t m_server = -1;   // the one serving now
+    pid_t m_replaced = -1; // the one --reload-after replaced
+
+    explicit load_generator(load_options opts) : m_opts(std::move(opts))
+    {
+        _resolve();
+        m_request = fmt::format("GET {} HTTP/1.1\r\nHost: load_gen\r\n\r\n", m_opts.path);
+        for (size_t i = 0; i < m_opts.source_ips; ++i)
+        {
+            struct sockaddr_in src = {};
+            src.sin_family = AF_INET;
+            src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + uint32_t(i));
+            m_sources.push_back(src);
+        }
+        m_epfd = epoll_create1(EPOLL_CLOEXEC);
+        m_conns.resize(m_opts.connections);
+        for (size_t i = 0; i < m_conns.size(); ++i)
+        {
+            m_conns[i].m_source = i;
+            m_idle.push_back(&m_conns[i]);
+        }
+    }
+
+    void _resolve()
+    {
+        auto &t = m_opts.target;
+        if (t.m_kind == listener_kind::unix_stream)
+        {
+            struct sockaddr_un addr;
+            m_addr_len = unix_address(t.m_path, addr);
+            memcpy(&m_addr, &addr, m_addr_len);
+            return;
+        }
+        struct addrinfo hints = {};
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *res = nullptr;
+        std::string host = t.m_host.empty() ? "127.0.0.1" : t.m_host;
+        int err = getaddrinfo(host.c_str(), t.m_port.c_str(), &hints, &res);
+        if (err != 0)
+        {
+            throw config_error(fmt::format("--target {}: {}", t.describe(), gai_strerror(err)));
+        }
+        memcpy(&m_addr, res->ai_addr, res->ai_addrlen);
+        m_addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+
+    // every connection is opened before the clock starts, so the run
+    // measures requests rather than a burst of handshakes
+    void _open_all()
+    {
+        for (auto &conn : m_conns)
+        {
+            _connect(conn);
+        }
+        uint64_t deadline = load_now_ns() + load_grace_ns;
+        struct epoll_event events[256];
+        while (load_now_ns() < deadline &&
+               std::any_of(m_conns.begin(), m_conns.end(), [](load_connection const &c)
+                           { return c.m_connecting; }))
+        {
+            int n = epoll_wait(m_epfd, events, 256, 10);
+            for (int i = 0; i < n; ++i)
+            {
+                auto *conn = static_cast<load_connection *>(events[i].data.ptr);
+                if (conn->m_connecting)
+                {
+                    _on_connected(*conn, events[i].events);
+                }
+            }
+        }
+    }
+
+    // a blocking connect that is closed again, until one succeeds
+    bool _wait_listening()
+    {
+        uint64_t deadline = load_now_ns() + load_grace_ns;
+        while (load_now_ns() < deadline)
+        {
+            int fd = socket(m_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int ret = connect(fd, reinterpret_cast<struct sockaddr const *>(&m_addr), m_addr_len);
+            close(fd);
+            if (ret == 0)
+            {
+                return true;
+            }
+            usleep(20000);
+        }
+        return false;
+    }
+
+    void run()
+    {
+        if (!m_opts.server.empty())
+        {
+            m_server = load_spawn(m_opts.server);
+            if (!_wait_listening())
+            {
+                throw std::runtime_error(fmt::format("{} is not accepting", m_opts.target.describe()));
+            }
+        }
+        _open_all();
+        uint64_t interval = uint64_t(1e9 / m_opts.rate);
+        uint64_t start = load_now_ns();
+        uint64_t end = start + uint64_t(m_opts.duration * 1e9);
+        uint64_t next = start;
+        uint64_t reload_at = m_opts.reload_after > 0 ? start + uint64_t(m_opts.reload_after * 1e9) : 0;
+        struct epoll_event events[256];
+        while (true)
+        {
+            uint64_t now = load_now_ns();
+            if (reload_at != 0 && now >= reload_at)
+            {
+                reload_at = 0;
+                m_replaced = m_server;
+                m_server = load_spawn(m_opts.server);
+                fmt::println("reload: started a replacement for pid {}", m_replaced);
+            }
+            for (; next <= now && next < end; next += interval)
+            {
+                m_due.push_back(next);
+            }
+            _dispatch();
+            bool in_flight = m_idle.size() != m_conns.size();
+            if (now >= end && ((m_due.empty() && !in_flight) || now >= end + load_grace_ns))
+            {
+                break;
+            }
+            // due requests go out in batches of up to a millisecond rather
+            // than spinning beside a server that may share the cpu; their
+            // latency still counts from when they were due
+            int timeout_ms = 10;
+            if (next < end)
+            {
+                timeout_ms = std::max(1, int((next - now) / 1000000));
+            }
+            int n = epoll_wait(m_epfd, events, 256, timeout_ms);
+            for (int i = 0; i < n; ++i)
+            {
+                auto *conn = static_cast<load_connection *>(events[i].data.ptr);
+                if (conn->m_fd == -1)
+                {
+                    continue; // closed earlier in this batch
+                }
+                if (conn->m_connecting)
+                {
+                    _on_connected(*conn, events[i].events);
+                }
+                else
+                {
+                    _on_readable(*conn);
+                }
+            }
+        }
+        m_stats.m_unsent += m_due.size();
+        for (auto &conn : m_conns)
+        {
+            if (conn.m_busy)
+            {
+                ++m_stats.m_errors;
+            }
+            if (conn.m_fd != -1)
+            {
+                close(conn.m_fd);
+            }
+        }
+    }
+
+    // give due requests to free connections, oldest first
+    void _dispatch()
+    {
+        while (!m_due.empty() && !m_idle.empty())
+        {
+            load_connection *conn = m_idle.back();
+            m_idle.pop_back();
+            conn->m_busy = true;
+            conn->m_due_ns = m_due.front();
+            m_due.pop_front();
+            if (conn->m_fd == -1)
+            {
+                _connect(*conn);
+            }
+            else if (!conn->m_connecting)
+            {
+                _send(*conn);
+            }
+        }
+    }
+
+    void _connect(load_connection &conn)
+    {
+        conn.m_fd = socket(m_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (conn.m_fd == -1)
+        {
+            _fail(conn);
+            return;
+        }
+        if (!m_sources.empty())
+        {
+            auto &src = m_sources[conn.m_source % m_sources.size()];
+            if (bind(conn.m_fd, reinterpret_cast<struct sockaddr const *>(&src), sizeof(src)) == -1)
+            {
+                _fail(conn);
+                return;
+            }
+        }
+        if (m_addr.ss_family != AF_UNIX)
+        {
+            int one = 1;
+            setsockopt(conn.m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        conn.m_in.clear();
+        conn.m_reused = false;
+        conn.m_connecting = true;
+        struct epoll_event ev = {};
+        ev.events = EPOLLOUT;
+        ev.data.ptr = &conn;
+        epoll_ctl(m_epfd, EPOLL_CTL_ADD, conn.m_fd, &ev);
+        if (connect(conn.m_fd, reinterpret_cast<struct sockaddr const *>(&m_addr), m_addr_len) == 0)
+        {
+            _on_connected(conn, EPOLLOUT);
+        }
+        else if (errno != EINPROGRESS)
+        {
+            _fail(conn);
+        }
+    }
+
+    void _on_connected(load_connection &conn, uint32_t events)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn.m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || (events & EPOLLERR))
+        {
+            _fail(conn);
+            return;
+        }
+        conn.m_connecting = false;
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conn;
+        epoll_ctl(m_epfd, EPOLL_CTL_MOD, conn.m_fd, &ev);
+        if (conn.m_busy)
+        {
+            _send(conn);
+        }
+    }
+
+    // one small request, a short write is as good as a failed one
+    void _send(load_connection &conn)
+    {
+        ssize_t n = send(conn.m_fd, m_request.data(), m_request.size(), MSG_NOSIGNAL);
+        if (n != ssize_t(m_request.size()))
+        {
+            _lost(conn);
+            return;
+        }
+        ++m_stats.m_sent;
+    }
+
+    void _on_readable(load_connection &conn)
+    {
+        char buf[16384];
+        bool broken = false;
+        while (true)
+        {
+            ssize_t n = read(conn.m_fd, buf, sizeof(buf));
+            if (n > 0)
+            {
+                conn.m_in.append(buf, size_t(n));
+                if (size_t(n) < sizeof(buf))
+                {
+                    break; // level triggered, whatever is left reports again
+                }
+                continue;
+            }
+            broken = n == 0 || errno != EAGAIN;
+            break;
+        }
+        if (conn.m_busy)
+        {
+            _parse(conn);
+        }
+        else if (!conn.m_in.empty())
+        {
+            // nothing was asked, nothing should come
+            ++m_stats.m_errors;
+            _close(conn);
+            return;
+        }
+        // a response followed by the close only has the close left here
+        if (broken && conn.m_fd != -1)
+        {
+            _lost(conn);
+        }
+    }
+
+    void _parse(load_connection &conn)
+    {
+        size_t head_end = conn.m_in.find("\r\n\r\n");
+        if (head_end == std::string::npos)
+        {
+            return;
+        }
+        std::string_view head(conn.m_in.data(), head_end);
+        int status = 0;
+        if (head.size() < 12 || head.substr(0, 5) != "HTTP/")
+        {
+            ++m_stats.m_errors;
+            _close(conn);
+            return;
+        }
+        status = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+        size_t length = std::string::npos;
+        bool close_after = false;
+        size_t pos = head.find("\r\n");
+        while (pos != std::string_view::npos && pos < head.size())
+        {
+            size_t eol = head.find("\r\n", pos + 2);
+            auto line = head.substr(pos + 2, (eol == std::string_view::npos ? head.size() : eol) - pos - 2);
+            size_t colon = line.find(':');
+            if (colon != std::string_view::npos)
+            {
+                std::string name(line.substr(0, colon));
+                std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c)
+                               { return char(std::tolower(c)); });
+                auto value = line.substr(colon + 1);
+                while (!value.empty() && value.front() == ' ')
+                {
+                    value.remove_prefix(1);
+                }
+                if (name == "content-length")
+                {
+                    length = size_t(std::stoull(std::string(value)));
+                }
+                else if (name == "connection" && (value == "close" || value == "Close"))
+                {
+                    close_after = true;
+                }
+            }
+            pos = eol;
+        }
+        if (length == std::string::npos)
+        {
+            ++m_stats.m_errors;
+            _close(conn);
+            return;
+        }
+        if (conn.m_in.size() < head_end + 4 + length)
+        {
+            return;
+        }
+
+        uint64_t latency = load_now_ns() - conn.m_due_ns;
+        m_stats.m_latency_ns.push_back(latency);
+        if (status / 100 == 2)
+        {
+            ++m_stats.m_ok;
+            m_stats.m_ok_latency_ns.push_back(latency);
+        }
+        else if (status == 503)
+        {
+            ++m_stats.m_shed;
+        }
+        else if (status == 429)
+        {
+            ++m_stats.m_rate_limited;
+        }
+        else
+        {
+            ++m_stats.m_other_status;
+        }
+        conn.m_in.erase(0, head_end + 4 + length);
+        conn.m_busy = false;
+        conn.m_reused = true;
+        if (close_after || !conn.m_in.empty())
+        {
+            _close(conn);
+        }
+        m_idle.push_back(&conn);
+    }
+
+    // the connection broke: the request goes again if the server closed a
+    // keep-alive connection before answering, otherwise it failed
+    void _lost(load_connection &conn)
+    {
+        bool busy = conn.m_busy;
+        bool retry = busy && conn.m_reused && conn.m_in.empty();
+        _close(conn);
+        if (!busy)
+        {
+            return; // closed while idle, the next request opens a new one
+        }
+        if (retry)
+        {
+            ++m_stats.m_retried;
+            m_due.push_front(conn.m_due_ns);
+        }
+        else
+        {
+            ++m_stats.m_errors;
+        }
+        conn.m_busy = false;
+        m_idle.push_back(&conn);
+    }
+
+    // opening the connection failed; one opened ahead of a request is
+    // tried again by the next request it takes
+    void _fail(load_connection &conn)
+    {
+        _close(conn);
+        if (!conn.m_busy)
+        {
+            return;
+        }
+        ++m_stats.m_errors;
+        conn.m_busy = false;
+        m_idle.push_back(&conn);
+    }
+
+    void _close(load_connection &conn)
+    {
+        if (conn.m_fd != -1)
+        {
+            close(conn.m_fd);
+            conn.m_fd = -1;
+        }
+        conn.m_connecting = false;
+        conn.m_reused = false;
+        conn.m_in.clear();
+    }
+};
+
+// false if it is still running after timeout_ns
+bool load_wait_exit(pid_t pid, uint64_t timeout_ns, int &status)
+{
+    uint64_t deadline = load_now_ns() + timeout_ns;
+    while (waitpid(pid, &status, WNOHANG) == 0)
+    {
+        if (load_now_ns() >= deadline)
+        {
+            return false;
+        }
+        usleep(20000);
+    }
+    return true;
+}
+
+// the replaced server has to be gone, then the current one is stopped
+bool load_stop_servers(load_generator &gen)
+{
+    bool ok = true;
+    int status = 0;
+    if (gen.m_replaced != -1)
+    {
+        uint64_t started = load_now_ns();
+        if (load_wait_exit(gen.m_replaced, load_drain_wait_ns, status))
+        {
+            fmt::println("reload: replaced server exited with status {}, {} ms after the run",
+                         WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+                         (load_now_ns() - started) / 1000000);
+        }
+        else
+        {
+            fmt::println("FAIL: the replaced server is still running");
+            kill(gen.m_replaced, SIGKILL);
+            waitpid(gen.m_replaced, &status, 0);
+            ok = false;
+        }
+    }
+    if (gen.m_server != -1)
+    {
+        kill(gen.m_server, SIGTERM);
+        waitpid(gen.m_server, &status, 0);
+    }
+    return ok;
+}
+
+void _load_raise_nofile(size_t connections)
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < connections + 64)
+    {
+        lim.rlim_cur = std::min<rlim_t>(lim.rlim_max, connections + 64);
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    load_options opts;
+    bool have_target = false;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string_view arg = argv[i];
+            if (i + 1 >= argc)
+            {
+                throw config_error(fmt::format("{}: missing value", arg));
+            }
+            std::string_view value = argv[++i];
+            if (arg == "--target")
+            {
+                opts.target = parse_listener(value);
+                have_target = true;
+            }
+            else if (arg == "--rate")
+            {
+                opts.rate = std::max(1, _config_int(arg, value));
+            }
+            else if (arg == "--duration")
+            {
+                opts.duration = std::max(1, _config_int(arg, value));
+            }
+            else if (arg == "--connections")
+            {
+                opts.connections = size_t(std::max(1, _config_int(arg, value)));
+            }
+            else if (arg == "--source-ips")
+            {
+                opts.source_ips = size_t(_config_int(arg, value));
+            }
+            else if (arg == "--path")
+            {
+                opts.path = std::string(value);
+            }
+            else if (arg == "--max-failed")
+            {
+                opts.max_failed = _config_int(arg, value);
+            }
+            else if (arg == "--max-p99-ms")
+            {
+                opts.max_p99_ms = _config_int(arg, value);
+            }
+            else if (arg == "--server")
+            {
+                opts.server = std::string(value);
+            }
+            else if (arg == "--reload-after")
+            {
+                opts.reload_after = _config_int(arg, value);
+            }
+            else
+            {
+                throw config_error(fmt::format("unknown option {}", arg));
+            }
+        }
+        if (!have_target)
+        {
+            throw config_error("--target is required");
+        }
+        if (opts.reload_after > 0 && (opts.server.empty() || opts.reload_after >= opts.duration))
+        {
+            throw config_error("--reload-after needs --server and must fall within --duration");
+        }
+    }
+    catch (config_error const &e)
+    {
+        fmt::println(stderr, "load_gen: {}", e.what());
+        return 2;
+    }
+
+    _load_raise_nofile(opts.connections);
+    load_generator gen(opts);
+    try
+    {
+        gen.run();
+    }
+    catch (std::exception const &e)
+    {
+        fmt::println(stderr, "load_gen: {}", e.what());
+        load_stop_servers(gen);
+        return 1;
+    }
+    bool servers_ok = load_stop_servers(gen);
+
+    auto &s = gen.m_stats;
+    double p99_ms = load_percentile_ms(s.m_ok_latency_ns, 99);
+    fmt::println("offered {}/s for {}s over {} connections to {}", opts.rate, opts.duration,
+                 opts.connections, opts.target.describe());
+    fmt::println("sent {} 2xx {} 503 {} 429 {} other {} errors {} retried {} unsent {} failed {}",
+                 s.m_sent, s.m_ok, s.m_shed, s.m_rate_limited, s.m_other_status, s.m_errors,
+                 s.m_retried, s.m_unsent, s.failed());
+    load_print_latency("all", s.m_latency_ns);
+    load_print_latency("2xx", s.m_ok_latency_ns);
+    bool ok = servers_ok;
+    if (opts.max_failed >= 0 && s.failed() > uint64_t(opts.max_failed))
+    {
+        fmt::println("FAIL: {} failed requests, at most {} allowed", s.failed(), opts.max_failed);
+        ok = false;
+    }
+    if (opts.max_p99_ms > 0 && p99_ms > opts.max_p99_ms)
+    {
+        fmt::println("FAIL: 2xx p99 {:.1f}ms above {}ms", p99_ms, opts.max_p99_ms);
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,1807 @@
+// loop_bench: the event loop, async_file, callback<> and the HTTP/1.1
+// handler measured without a network. Each connection is a socketpair (or
+// a loopback TCP connection) whose server end goes through start_connection
+// like an accepted socket; the client end, in the same thread, replays a
+// corpus of requests cut into chunks, and after every chunk the loop runs
+// until nothing is ready.
+// The same input thus takes the same path on every run, and what the
+// loop costs per request is reported as TSC ticks, syscalls and operator
+// new calls, while every response is checked against the corpus. "rtt ns"
+// also counts the client's writes and reads, which is where a loopback TCP
+// connection (--transport tcp) pays for the network stack.
+// --protocol h2 replays the same requests as HTTP/2 with prior knowledge:
+// one stream per request, every round's streams in one write, and the
+// responses read back off the frames.
+// --tls user,ktls puts TLS 1.3 under either, with a throwaway certificate:
+// "user" keeps the records in OpenSSL, "ktls" hands transmit to the kernel
+// where it can (TCP only). Each mode also runs a KeyUpdate check, see
+// bench_tls_key_update.
+//
+//   loop_bench [--corpus FILE] [--case NAME] [--split whole,bytes,crlf,random]
+//              [--transport unix,tcp] [--protocol h1,h2] [--tls user,ktls]
+//              [--requests N] [--seed N] [--gap-us N] [--log debug]
+//   loop_bench --idle N
+//   loop_bench --fanout N [--requests N] [--payload BYTES]
+//   loop_bench --static-cache N
+//   loop_bench --inflight N,M [--transport unix,tcp] [--protocol h1,h2] [--requests N]
+//
+// /static/bench.html is served from a directory made for the run.
+// Syscalls are counted by wrapping the libc entry points the loop uses at
+// link time (see CMakeLists.txt), only while the loop runs.
+
+#define CO_HTTP_NO_MAIN
+#include "server.cpp"
+
+#include <cstdarg>
+#include <chrono>
+#include <random>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+
+struct bench_counters
+{
+    uint64_t m_ticks = 0;
+    uint64_t m_syscalls = 0;
+    uint64_t m_allocs = 0;
+    uint64_t m_alloc_bytes = 0;
+};
+
+// single-threaded: the loop and the client share the main thread
+bool bench_counting = false;
+bench_counters bench_totals;
+
+void *operator new(std::size_t size)
+{
+    if (bench_counting)
+    {
+        ++bench_totals.m_allocs;
+        bench_totals.m_alloc_bytes += size;
+    }
+    if (void *p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+// -Wl,--wrap=NAME sends calls to NAME here, __real_NAME is libc's
+#define BENCH_WRAP(ret, name, params, args)                 \
+    extern "C" ret __real_##name params;                    \
+    extern "C" ret __wrap_##name params                     \
+    {                                                       \
+        bench_totals.m_syscalls += bench_counting;          \
+        return __real_##name args;                          \
+    }
+
+BENCH_WRAP(ssize_t, read, (int fd, void *buf, size_t n), (fd, buf, n))
+BENCH_WRAP(ssize_t, write, (int fd, void const *buf, size_t n), (fd, buf, n))
+BENCH_WRAP(ssize_t, writev, (int fd, struct iovec const *iov, int n), (fd, iov, n))
+BENCH_WRAP(ssize_t, pread, (int fd, void *buf, size_t n, off_t off), (fd, buf, n, off))
+BENCH_WRAP(ssize_t, send, (int fd, void const *buf, size_t n, int flags), (fd, buf, n, flags))
+BENCH_WRAP(ssize_t, recvmsg, (int fd, struct msghdr *msg, int flags), (fd, msg, flags))
+BENCH_WRAP(ssize_t, sendmsg, (int fd, struct msghdr const *msg, int flags), (fd, msg, flags))
+BENCH_WRAP(ssize_t, sendfile, (int out, int in, off_t *off, size_t n), (out, in, off, n))
+BENCH_WRAP(int, epoll_wait, (int epfd, struct epoll_event *events, int max, int timeout), (epfd, events, max, timeout))
+BENCH_WRAP(int, epoll_ctl, (int epfd, int op, int fd, struct epoll_event *event), (epfd, op, fd, event))
+BENCH_WRAP(int, close, (int fd), (fd))
+BENCH_WRAP(int, shutdown, (int fd, int how), (fd, how))
+BENCH_WRAP(int, setsockopt, (int fd, int level, int name, void const *value, socklen_t len), (fd, level, name, value, len))
+BENCH_WRAP(int, getsockopt, (int fd, int level, int name, void *value, socklen_t *len), (fd, level, name, value, len))
+BENCH_WRAP(int, getpeername, (int fd, struct sockaddr *addr, socklen_t *len), (fd, addr, len))
+
+extern "C" int __real_fcntl(int fd, int cmd, ...);
+extern "C" int __wrap_fcntl(int fd, int cmd, ...)
+{
+    bench_totals.m_syscalls += bench_counting;
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void *); // what glibc reads too, whether cmd takes one or not
+    va_end(ap);
+    return __real_fcntl(fd, cmd, arg);
+}
+
+// one expected response: its status, and a piece of its (decoded) body
+struct bench_expect
+{
+    int m_status;
+    std::string m_body; // empty matches any body
+};
+
+// one request of a case, as HTTP/2 sends it
+struct bench_h2_request
+{
+    std::string m_block; // HPACK without indexing, so every round can send it again
+    std::string m_body;
+};
+
+struct bench_case
+{
+    std::string m_name;
+    std::string m_request; // what one round sends, may hold several pipelined requests
+    std::vector<bench_expect> m_expect;
+    std::vector<bench_h2_request> m_h2; // m_request for --protocol h2
+};
+
+// the corpus format: each case starts with "=== name", then one
+// "expect STATUS [BODY PART]" line per response, then the request lines;
+// every line goes on the wire followed by CRLF, so the empty line ends the
+// headers. \r \n \t \\ \xHH are escapes, in expected bodies too, and a
+// backslash at the end of a line drops its CRLF (a body without one).
+// Lines starting with # outside a case are comments.
+constexpr std::string_view bench_builtin_corpus = R"(# the built-in corpus, one case per handler path
+=== get
+expect 200 your request is empty
+GET / HTTP/1.1
+Host: bench
+
+=== post-length
+expect 200 <p>hello</p>
+POST /echo HTTP/1.1
+Host: bench
+Content-Length: 5
+
+hello\
+=== post-chunked
+expect 200 <p>hello world</p>
+POST /echo HTTP/1.1
+Host: bench
+Transfer-Encoding: chunked
+
+5
+hello
+6
+ world
+0
+
+=== discard
+expect 200 discarded 11 bytes
+POST /discard HTTP/1.1
+Host: bench
+Content-Length: 11
+
+hello world\
+=== pipelined
+expect 200 your request is empty
+expect 200 <p>abc</p>
+expect 200 your request is empty
+GET /a HTTP/1.1
+Host: bench
+
+POST /b HTTP/1.1
+Host: bench
+Content-Length: 3
+
+abc\
+GET /c HTTP/1.1
+Host: bench
+
+=== stream
+expect 200 <p>chunk 15</p>
+GET /stream HTTP/1.1
+Host: bench
+
+=== gzip
+expect 200 your request is empty
+GET / HTTP/1.1
+Host: bench
+Accept-Encoding: gzip, deflate
+
+=== static
+expect 200 <p>static line 199 of the bench page</p>
+GET /static/bench.html HTTP/1.1
+Host: bench
+
+=== static-gzip
+expect 200 \x1f\x8b\x08
+GET /static/bench.html HTTP/1.1
+Host: bench
+Accept-Encoding: gzip, deflate
+
+=== many-headers
+expect 200 your request is empty
+GET /a/somewhat/longer/path?with=query&and=more HTTP/1.1
+Host: bench
+User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36
+Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8
+Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8
+Cache-Control: no-cache
+Pragma: no-cache
+Referer: http://bench/index.html
+Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; lang=en
+X-Request-Id: 3f2a9c1e-7b4d-4e8a-9f0c-1d2e3f4a5b6c
+X-Forwarded-For: 192.0.2.1, 198.51.100.2
+Sec-Fetch-Dest: document
+Sec-Fetch-Mode: navigate
+Sec-Fetch-Site: same-origin
+
+)";
+
+std::string _bench_unescape(std::string_view line, bool &newline)
+{
+    std::string out;
+    newline = true;
+    for (size_t i = 0; i < line.size(); ++i)
+    {
+        if (line[i] != '\\')
+        {
+            out += line[i];
+            continue;
+        }
+        if (i + 1 == line.size())
+        {
+            newline = false;
+            break;
+        }
+        char c = line[++i];
+        if (c == 'r')
+        {
+            out += '\r';
+        }
+        else if (c == 'n')
+        {
+            out += '\n';
+        }
+        else if (c == 't')
+        {
+            out += '\t';
+        }
+        else if (c == 'x' && i + 2 < line.size())
+        {
+            out += char(_config_int("\\x", line.substr(i + 1, 2), 16));
+            i += 2;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::vector<bench_case> parse_bench_corpus(std::string_view text, std::string const &origin)
+{
+    std::vector<bench_case> cases;
+    bool in_request = false;
+    for (size_t lineno = 1; !text.empty(); ++lineno)
+    {
+        size_t nl = text.find('\n');
+        auto line = text.substr(0, nl);
+        text.remove_prefix(nl == std::string_view::npos ? text.size() : nl + 1);
+        try
+        {
+            if (line.substr(0, 4) == "=== ")
+            {
+                cases.push_back({std::string(line.substr(4)), {}, {}, {}});
+                in_request = false;
+            }
+            else if (cases.empty())
+            {
+                if (!line.empty() && line[0] != '#')
+                {
+                    throw config_error("expected '=== name'");
+                }
+            }
+            else if (!in_request && line.substr(0, 7) == "expect ")
+            {
+                auto rest = line.substr(7);
+                size_t space = rest.find(' ');
+                int status = _config_int("expect", rest.substr(0, space));
+                auto body = space == std::string_view::npos ? std::string_view{} : rest.substr(space + 1);
+                bool newline;
+                cases.back().m_expect.push_back({status, _bench_unescape(body, newline)});
+            }
+            else
+            {
+                in_request = true;
+                bool newline;
+                cases.back().m_request += _bench_unescape(line, newline);
+                if (newline)
+                {
+                    cases.back().m_request += "\r\n";
+                }
+            }
+        }
+        catch (config_error const &e)
+        {
+            throw config_error(fmt::format("{}:{}: {}", origin, lineno, e.what()));
+        }
+    }
+    for (auto &c : cases)
+    {
+        if (c.m_expect.empty() || c.m_request.empty())
+        {
+            throw config_error(fmt::format("{}: case {} needs expect lines and a request", origin, c.m_name));
+        }
+    }
+    return cases;
+}
+
+// the HTTP/1.1 requests of a case turned into h2 header blocks and bodies;
+// the hop-by-hop headers go, Host becomes :authority
+std::vector<bench_h2_request> bench_h2_requests(std::string_view text)
+{
+    constexpr std::string_view hop_by_hop[] = {"connection", "keep-alive", "proxy-connection",
+                                               "transfer-encoding", "upgrade"};
+    std::vector<bench_h2_request> out;
+    hpack_encoder encoder;
+    http_request_parser<> parser;
+    std::string data(text);
+    while (!data.empty())
+    {
+        parser.push_chunk(data);
+        if (!parser.request_finished())
+        {
+            throw config_error("request is cut short");
+        }
+        bench_h2_request req;
+        std::string authority;
+        hpack_header_list fields;
+        std::string_view head = data;
+        head = head.substr(0, head.find("\r\n\r\n"));
+        size_t eol = head.find("\r\n");
+        while (eol != std::string_view::npos)
+        {
+            head.remove_prefix(eol + 2);
+            eol = head.find("\r\n");
+            auto line = head.substr(0, eol);
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos)
+            {
+                throw config_error(fmt::format("header line without a colon: {}", line));
+            }
+            std::string name(line.substr(0, colon));
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char ch)
+                           { return char(std::tolower(ch)); });
+            auto value = line.substr(colon + 1);
+            value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+            if (name == "host")
+            {
+                authority = std::string(value);
+            }
+            else if (std::find(std::begin(hop_by_hop), std::end(hop_by_hop), name) == std::end(hop_by_hop))
+            {
+                fields.emplace_back(std::move(name), std::string(value));
+            }
+        }
+        encoder.encode(":method", parser.method(), req.m_block);
+        encoder.encode(":scheme", "http", req.m_block);
+        encoder.encode(":path", parser.url(), req.m_block);
+        encoder.encode(":authority", authority, req.m_block);
+        for (auto &[name, value] : fields)
+        {
+            encoder.encode(name, value, req.m_block);
+        }
+        req.m_body = std::move(parser.body());
+        out.push_back(std::move(req));
+        data = std::move(parser.leftover());
+        parser.reset();
+    }
+    return out;
+}
+
+// how each round's bytes are cut before they reach the socket
+enum class bench_split
+{
+    whole,  // one write
+    bytes,  // one byte per write
+    crlf,   // between every CR and its LF
+    random, // 1 to 16 bytes per write, from --seed
+};
+
+bench_split parse_bench_split(std::string_view name)
+{
+    if (name == "whole")
+    {
+        return bench_split::whole;
+    }
+    if (name == "bytes")
+    {
+        return bench_split::bytes;
+    }
+    if (name == "crlf")
+    {
+        return bench_split::crlf;
+    }
+    if (name == "random")
+    {
+        return bench_split::random;
+    }
+    throw config_error(fmt::format("--split: unknown '{}'", name));
+}
+
+std::string_view bench_split_name(bench_split split)
+{
+    switch (split)
+    {
+    case bench_split::whole:
+        return "whole";
+    case bench_split::bytes:
+        return "bytes";
+    case bench_split::crlf:
+        return "crlf";
+    case bench_split::random:
+        return "random";
+    }
+    return "?";
+}
+
+std::vector<std::string_view> bench_chunks(std::string_view data, bench_split split, std::mt19937 &rng)
+{
+    std::vector<std::string_view> chunks;
+    size_t start = 0;
+    for (size_t i = 1; i <= data.size(); ++i)
+    {
+        bool cut = i == data.size();
+        if (split == bench_split::bytes)
+        {
+            cut = true;
+        }
+        else if (split == bench_split::crlf)
+        {
+            cut = cut || (data[i - 1] == '\r' && data[i] == '\n');
+        }
+        else if (split == bench_split::random)
+        {
+            cut = cut || i - start >= 1 + rng() % 16;
+        }
+        if (cut)
+        {
+            chunks.push_back(data.substr(start, i - start));
+            start = i;
+        }
+    }
+    return chunks;
+}
+
+// what the client end is connected over
+enum class bench_transport
+{
+    unix_pair,    // socketpair(AF_UNIX)
+    tcp_loopback, // 127.0.0.1, TCP_NODELAY on both ends
+};
+
+bench_transport parse_bench_transport(std::string_view name)
+{
+    if (name == "unix")
+    {
+        return bench_transport::unix_pair;
+    }
+    if (name == "tcp")
+    {
+        return bench_transport::tcp_loopback;
+    }
+    throw config_error(fmt::format("--transport: unknown '{}'", name));
+}
+
+std::string_view bench_transport_name(bench_transport transport)
+{
+    return transport == bench_transport::tcp_loopback ? "tcp" : "unix";
+}
+
+// what the client end speaks
+enum class bench_protocol
+{
+    h1,
+    h2, // prior knowledge, no upgrade
+};
+
+bench_protocol parse_bench_protocol(std::string_view name)
+{
+    if (name == "h1")
+    {
+        return bench_protocol::h1;
+    }
+    if (name == "h2")
+    {
+        return bench_protocol::h2;
+    }
+    throw config_error(fmt::format("--protocol: unknown '{}'", name));
+}
+
+// a self-signed P-256 certificate for "bench", loaded into a tls_context
+// per mode and removed again
+struct bench_tls_contexts
+{
+    std::unique_ptr<tls_context> m_user;
+    std::unique_ptr<tls_context> m_ktls;
+
+    bench_tls_contexts()
+    {
+        EVP_PKEY *key = EVP_EC_gen("P-256");
+        X509 *cert = X509_new();
+        if (!key || !cert)
+        {
+            throw tls_error(_tls_last_error("bench certificate"));
+        }
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+        X509_set_pubkey(cert, key);
+        X509_NAME *name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<unsigned char const *>("bench"), -1,
+                                   -1, 0);
+        X509_set_issuer_name(cert, name);
+        X509_sign(cert, key, EVP_sha256());
+        auto cert_file = fmt::format("/tmp/loop_bench-{}-cert.pem", getpid());
+        auto key_file = fmt::format("/tmp/loop_bench-{}-key.pem", getpid());
+        FILE *f = fopen(cert_file.c_str(), "w");
+        bool ok = f && PEM_write_X509(f, cert);
+        if (f)
+        {
+            fclose(f);
+        }
+        f = fopen(key_file.c_str(), "w");
+        ok = ok && f && PEM_write_PrivateKey(f, key, nullptr, nullptr, 0, nullptr, nullptr);
+        if (f)
+        {
+            fclose(f);
+        }
+        X509_free(cert);
+        EVP_PKEY_free(key);
+        try
+        {
+            if (!ok)
+            {
+                throw tls_error("bench certificate: cannot write to /tmp");
+            }
+            m_user = std::make_unique<tls_context>(cert_file, key_file);
+            m_user->m_ktls = false;
+            m_ktls = std::make_unique<tls_context>(cert_file, key_file);
+        }
+        catch (...)
+        {
+            unlink(cert_file.c_str());
+            unlink(key_file.c_str());
+            throw;
+        }
+        unlink(cert_file.c_str());
+        unlink(key_file.c_str());
+    }
+};
+
+// the client side of TLS, on memory BIOs as tls_session is; certificates
+// are not verified
+struct bench_tls_client
+{
+    SSL *m_ssl = nullptr;
+    BIO *m_in = nullptr;
+    BIO *m_out = nullptr;
+    bool m_failed = false; // a record did not decrypt, or an alert came
+
+    static SSL_CTX *context()
+    {
+        static SSL_CTX *ctx = []
+        {
+            SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+            SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION); // kTLS takes 1.3 only
+            return ctx;
+        }();
+        return ctx;
+    }
+
+    bench_tls_client()
+    {
+        m_ssl = SSL_new(context());
+        m_in = BIO_new(BIO_s_mem());
+        m_out = BIO_new(BIO_s_mem());
+        BIO_set_mem_eof_return(m_in, -1);
+        SSL_set_bio(m_ssl, m_in, m_out);
+        SSL_set_connect_state(m_ssl);
+    }
+
+    bench_tls_client(bench_tls_client const &) = delete;
+    bench_tls_client &operator=(bench_tls_client const &) = delete;
+
+    ~bench_tls_client()
+    {
+        SSL_free(m_ssl);
+    }
+
+    // true once done, throws if it failed
+    bool handshake()
+    {
+        ERR_clear_error();
+        int ret = SSL_do_handshake(m_ssl);
+        if (ret == 1)
+        {
+            return true;
+        }
+        if (SSL_get_error(m_ssl, ret) != SSL_ERROR_WANT_READ)
+        {
+            throw tls_error(_tls_last_error("bench handshake"));
+        }
+        return false;
+    }
+
+    void feed(char const *data, size_t n)
+    {
+        BIO_write(m_in, data, int(n));
+    }
+
+    // the plaintext of what was fed, while the handshake is not done it
+    // only moves the handshake on
+    void read(std::string &plain)
+    {
+        if (!SSL_is_init_finished(m_ssl))
+        {
+            return;
+        }
+        char buf[16 * 1024];
+        while (true)
+        {
+            ERR_clear_error();
+            int n = SSL_read(m_ssl, buf, sizeof(buf));
+            if (n > 0)
+            {
+                plain.append(buf, size_t(n));
+                continue;
+            }
+            int err = SSL_get_error(m_ssl, n);
+            m_failed = m_failed || (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_ZERO_RETURN);
+            return;
+        }
+    }
+
+    void write(std::string_view plain)
+    {
+        if (!plain.empty() && SSL_write(m_ssl, plain.data(), int(plain.size())) <= 0)
+        {
+            throw tls_error(_tls_last_error("bench SSL_write"));
+        }
+    }
+
+    // ciphertext for the socket
+    std::string take_output()
+    {
+        char *data;
+        long n = BIO_get_mem_data(m_out, &data);
+        std::string out(data, size_t(n));
+        (void)BIO_reset(m_out);
+        return out;
+    }
+};
+
+// server end first, as accept() would return it
+std::pair<int, int> bench_socket_pair(bench_transport transport)
+{
+    if (transport == bench_transport::unix_pair)
+    {
+        int sv[2];
+        CHECK_CALL(socketpair, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+        return {sv[0], sv[1]};
+    }
+    int listenfd = CHECK_CALL(socket, AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    CHECK_CALL(bind, listenfd, reinterpret_cast<struct sockaddr *>(&addr), len);
+    CHECK_CALL(listen, listenfd, 1);
+    CHECK_CALL(getsockname, listenfd, reinterpret_cast<struct sockaddr *>(&addr), &len);
+    int client = CHECK_CALL(socket, AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK_CALL(connect, client, reinterpret_cast<struct sockaddr *>(&addr), len);
+    int server = CHECK_CALL(accept4, listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+    close(listenfd);
+    int one = 1;
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return {server, client};
+}
+
+struct bench_options
+{
+    size_t requests = 2000; // per case and split, rounded up to whole rounds
+    size_t warmup_rounds = 1;
+    uint32_t seed = 1;
+    int gap_us = 0; // sleep between chunks, outside the measurement
+    bench_transport transport = bench_transport::unix_pair;
+    bench_protocol protocol = bench_protocol::h1;
+    tls_context *tls = nullptr;
+};
+
+struct bench_result
+{
+    bench_counters m_counters;
+    uint64_t m_round_ticks = 0; // client writes, loop and client reads, all of it
+    size_t m_requests = 0;
+    size_t m_failures = 0;
+    std::string m_first_failure;
+};
+
+// the loop until nothing is ready, counted into c if given
+void bench_run_loop(event_loop &loop, bench_counters *c)
+{
+    auto before = bench_totals;
+    uint64_t start = trace_now();
+    bench_counting = c != nullptr;
+    while (loop.run_once(0))
+    {
+    }
+    bench_counting = false;
+    if (c)
+    {
+        c->m_ticks += trace_now() - start;
+        c->m_syscalls += bench_totals.m_syscalls - before.m_syscalls;
+        c->m_allocs += bench_totals.m_allocs - before.m_allocs;
+        c->m_alloc_bytes += bench_totals.m_alloc_bytes - before.m_alloc_bytes;
+    }
+}
+
+// the client end of one connection; the server end belongs to a handler on m_loop
+struct bench_connection
+{
+    event_loop &m_loop;
+    int m_client = -1;
+    http_response_parser<> m_parser;
+    std::string m_received; // read off the socket, not parsed yet
+
+    // the client half of an h2 connection
+    struct h2_stream
+    {
+        int m_status = 0;
+        std::string m_body;
+        bool m_end_stream = false; // seen on HEADERS, effective once the block ends
+        bool m_done = false;
+    };
+    bench_protocol m_protocol;
+    int m_server = -1; // the handler's end, while it is open
+    bool m_eof = false;
+    std::unique_ptr<bench_tls_client> m_tls;
+    bool m_h2_started = false;
+    uint32_t m_next_stream = 1;
+    hpack_decoder m_h2_decoder;
+    std::string m_h2_block;                     // a header block until its END_HEADERS
+    bytes_buffer m_h2_control;                  // SETTINGS ACKs and WINDOW_UPDATEs for the next round
+    std::map<uint32_t, h2_stream> m_h2_streams; // sent and not answered yet
+
+    explicit bench_connection(event_loop &loop, bench_transport transport = bench_transport::unix_pair,
+                              bench_protocol protocol = bench_protocol::h1, tls_context *tls = nullptr)
+        : m_loop(loop), m_protocol(protocol)
+    {
+        auto [server, client] = bench_socket_pair(transport);
+        m_client = client;
+        m_server = server;
+        int flags = CHECK_CALL(fcntl, m_client, F_GETFL);
+        CHECK_CALL(fcntl, m_client, F_SETFL, flags | O_NONBLOCK);
+        http_connection_acceptor::start_connection(m_loop, server, ip_key{}, tls);
+        run(nullptr);
+        if (tls)
+        {
+            m_tls = std::make_unique<bench_tls_client>();
+            while (!m_tls->handshake())
+            {
+                _send(m_tls->take_output(), nullptr);
+                if (!_receive() && m_eof)
+                {
+                    throw tls_error("bench handshake: eof");
+                }
+            }
+            _send(m_tls->take_output(), nullptr); // the client's Finished
+        }
+    }
+
+    bench_connection(bench_connection const &) = delete;
+    bench_connection &operator=(bench_connection const &) = delete;
+
+    // the handler sees eof and closes its end
+    ~bench_connection()
+    {
+        close(m_client);
+        run(nullptr);
+    }
+
+    void run(bench_counters *c)
+    {
+        bench_run_loop(m_loop, c);
+    }
+
+    // whether the server end has moved transmit into the kernel
+    bool server_ktls() const
+    {
+        char ulp[16] = {};
+        socklen_t len = sizeof(ulp);
+        return getsockopt(m_server, SOL_TCP, TCP_ULP, ulp, &len) == 0 && std::string_view(ulp) == "tls";
+    }
+
+    void deliver(std::string_view chunk, bench_counters *c)
+    {
+        if (!m_tls)
+        {
+            _send(chunk, c);
+            return;
+        }
+        m_tls->write(chunk);
+        _send(m_tls->take_output(), c);
+    }
+
+    // a handler whose socket is full waits for EPOLLOUT and stops reading,
+    // so when the request stops going in the responses are read off first
+    void _send(std::string_view chunk, bench_counters *c)
+    {
+        while (!chunk.empty())
+        {
+            ssize_t n = write(m_client, chunk.data(), chunk.size());
+            if (n == -1 && errno != EAGAIN)
+            {
+                throw std::system_error(errno, std::system_category(), "bench write");
+            }
+            if (n > 0)
+            {
+                chunk.remove_prefix(size_t(n));
+            }
+            else
+            {
+                _receive();
+            }
+            run(c);
+        }
+    }
+
+    bool _receive()
+    {
+        char buf[64 * 1024];
+        ssize_t n;
+        bool got = false;
+        while ((n = read(m_client, buf, sizeof(buf))) > 0)
+        {
+            if (m_tls)
+            {
+                m_tls->feed(buf, size_t(n));
+            }
+            else
+            {
+                m_received.append(buf, size_t(n));
+            }
+            got = true;
+        }
+        m_eof = m_eof || n == 0;
+        if (got && m_tls)
+        {
+            m_tls->read(m_received);
+        }
+        return got;
+    }
+
+    // what one h2 round sends: the preface first, then one stream per request
+    std::string h2_round(std::vector<bench_h2_request> const &requests)
+    {
+        constexpr size_t frame_size = 16384; // SETTINGS_MAX_FRAME_SIZE's initial value
+        bytes_buffer out;
+        http2_frame_writer writer{&out};
+        if (!m_h2_started)
+        {
+            // the window is given back as the DATA is read, never in the way
+            out.append(http2_connection::preface);
+            writer.settings({{http2_setting::initial_window_size, 0x7fffffff}});
+            writer.window_update(0, 0x7fffffff - 65535);
+            m_h2_started = true;
+        }
+        out.append(std::string_view(m_h2_control));
+        m_h2_control.clear();
+        for (auto &req : requests)
+        {
+            uint32_t id = m_next_stream;
+            m_next_stream += 2;
+            m_h2_streams[id];
+            writer.headers(id, req.m_block, req.m_body.empty(), frame_size);
+            std::string_view body = req.m_body;
+            while (!body.empty())
+            {
+                auto part = body.substr(0, frame_size);
+                body.remove_prefix(part.size());
+                writer.data(id, part, body.empty());
+            }
+        }
+        return std::string(std::string_view(out));
+    }
+
+    // takes the complete frames off m_received; RST_STREAM answers with status -1
+    void _h2_frames()
+    {
+        http2_frame_writer writer{&m_h2_control};
+        size_t off = 0;
+        size_t data_bytes = 0;
+        while (m_received.size() - off >= http2_frame_header::size)
+        {
+            auto hdr = http2_frame_header::parse(m_received.data() + off);
+            if (m_received.size() - off - http2_frame_header::size < hdr.m_length)
+            {
+                break;
+            }
+            std::string_view payload(m_received.data() + off + http2_frame_header::size, hdr.m_length);
+            off += http2_frame_header::size + hdr.m_length;
+            auto it = m_h2_streams.find(hdr.m_stream_id);
+            bool known = hdr.m_stream_id != 0 && it != m_h2_streams.end();
+            switch (hdr.m_type)
+            {
+            case http2_frame_type::settings:
+                if (!(hdr.m_flags & http2_flags::ack))
+                {
+                    writer.settings_ack();
+                }
+                break;
+            case http2_frame_type::headers:
+            case http2_frame_type::continuation:
+                if (hdr.m_type == http2_frame_type::headers && known)
+                {
+                    it->second.m_end_stream = hdr.m_flags & http2_flags::end_stream;
+                }
+                m_h2_block.append(payload);
+                if (hdr.m_flags & http2_flags::end_headers)
+                {
+                    hpack_header_list fields;
+                    m_h2_decoder.decode(m_h2_block, fields);
+                    m_h2_block.clear();
+                    for (auto &[name, value] : fields)
+                    {
+                        if (name == ":status" && known)
+                        {
+                            it->second.m_status = std::atoi(value.c_str());
+                        }
+                    }
+                    if (known)
+                    {
+                        it->second.m_done = it->second.m_end_stream;
+                    }
+                }
+                break;
+            case http2_frame_type::data:
+                data_bytes += payload.size();
+                if (known)
+                {
+                    it->second.m_body.append(payload);
+                    it->second.m_done = hdr.m_flags & http2_flags::end_stream;
+                }
+                break;
+            case http2_frame_type::rst_stream:
+                if (known && !it->second.m_done)
+                {
+                    it->second.m_status = -1;
+                    it->second.m_done = true;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        m_received.erase(0, off);
+        if (data_bytes)
+        {
+            writer.window_update(0, uint32_t(data_bytes));
+        }
+    }
+
+    // every complete response that has arrived, as status and decoded body
+    std::vector<std::pair<int, std::string>> responses()
+    {
+        std::vector<std::pair<int, std::string>> out;
+        while (_receive())
+        {
+            run(nullptr); // what did not fit in the socket goes out on EPOLLOUT
+        }
+        if (m_protocol == bench_protocol::h2)
+        {
+            _h2_frames();
+            for (auto it = m_h2_streams.begin(); it != m_h2_streams.end();)
+            {
+                if (!it->second.m_done)
+                {
+                    ++it;
+                    continue;
+                }
+                out.emplace_back(it->second.m_status, std::move(it->second.m_body));
+                it = m_h2_streams.erase(it);
+            }
+            return out;
+        }
+        std::string data = std::move(m_received);
+        m_received.clear();
+        while (!data.empty())
+        {
+            m_parser.push_chunk(data);
+            data.clear();
+            if (!m_parser.request_finished())
+            {
+                break;
+            }
+            out.emplace_back(m_parser.status(), std::move(m_parser.body()));
+            data = std::move(m_parser.leftover());
+            m_parser.reset();
+        }
+        return out;
+    }
+};
+
+bench_result run_bench_case(event_loop &loop, bench_case const &c, bench_split split, bench_options const &opts)
+{
+    bench_result result;
+    std::mt19937 rng(opts.seed);
+    size_t per_round = c.m_expect.size();
+    size_t rounds = (opts.requests + per_round - 1) / per_round;
+    auto conn = std::make_unique<bench_connection>(loop, opts.transport, opts.protocol, opts.tls);
+    for (size_t round = 0; round < opts.warmup_rounds + rounds; ++round)
+    {
+        bool counted = round >= opts.warmup_rounds;
+        // h2 stream ids go up, so every round is framed again
+        std::string request = opts.protocol == bench_protocol::h2 ? conn->h2_round(c.m_h2) : c.m_request;
+        uint64_t round_start = trace_now();
+        uint64_t slept = 0;
+        for (auto chunk : bench_chunks(request, split, rng))
+        {
+            if (opts.gap_us)
+            {
+                uint64_t before = trace_now();
+                usleep(opts.gap_us);
+                slept += trace_now() - before;
+            }
+            conn->deliver(chunk, counted ? &result.m_counters : nullptr);
+        }
+        auto got = conn->responses();
+        if (counted)
+        {
+            result.m_round_ticks += trace_now() - round_start - slept;
+        }
+        std::string failure;
+        for (size_t i = 0; i < per_round && failure.empty(); ++i)
+        {
+            auto &want = c.m_expect[i];
+            if (i >= got.size())
+            {
+                failure = fmt::format("response {} missing", i + 1);
+            }
+            else if (got[i].first != want.m_status)
+            {
+                failure = fmt::format("response {}: status {}, want {}", i + 1, got[i].first, want.m_status);
+            }
+            else if (got[i].second.find(want.m_body) == std::string::npos)
+            {
+                failure = fmt::format("response {}: body lacks '{}'", i + 1, want.m_body);
+            }
+        }
+        if (failure.empty() && got.size() > per_round)
+        {
+            failure = fmt::format("{} responses, want {}", got.size(), per_round);
+        }
+        if (counted)
+        {
+            result.m_requests += per_round;
+        }
+        if (!failure.empty())
+        {
+            if (result.m_failures++ == 0)
+            {
+                result.m_first_failure = fmt::format("round {}: {}", round, failure);
+            }
+            // start over on a connection in a known state
+            conn = std::make_unique<bench_connection>(loop, opts.transport, opts.protocol, opts.tls);
+        }
+    }
+    return result;
+}
+
+// a KeyUpdate from the client that asks for the server's too. OpenSSL
+// answers it in userspace; with kTLS the kernel holds the transmit key, so
+// the server must close instead of sending a record the client cannot
+// read. Empty if the connection behaved, with ktls set to what the server
+// end was using.
+std::string bench_tls_key_update(event_loop &loop, bench_options const &opts, bool &ktls)
+{
+    constexpr std::string_view request = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+    bench_connection conn(loop, opts.transport, bench_protocol::h1, opts.tls);
+    conn.deliver(request, nullptr);
+    auto before = conn.responses();
+    if (before.size() != 1 || before[0].first != 200)
+    {
+        return "no answer before the KeyUpdate";
+    }
+    ktls = conn.server_ktls();
+    SSL_key_update(conn.m_tls->m_ssl, SSL_KEY_UPDATE_REQUESTED);
+    conn.deliver(request, nullptr);
+    auto after = conn.responses();
+    if (conn.m_tls->m_failed)
+    {
+        return "a record after the KeyUpdate did not decrypt";
+    }
+    if (ktls)
+    {
+        return after.empty() && conn.m_eof ? "" : "kTLS connection answered or stayed open";
+    }
+    return after.size() == 1 && after[0].first == 200 ? "" : "no answer after the KeyUpdate";
+}
+
+// --idle N: what a parked keep-alive connection costs in user space. Each
+// of N connections answers one request and parks; the resident set should
+// grow by far less than idle_budget_bytes per connection, since a parked
+// fd keeps no handler (kernel socket buffers are not counted here).
+constexpr size_t idle_budget_bytes = 256;
+constexpr size_t idle_warmup = 256; // fill the handler pool and malloc's arenas first
+
+size_t bench_resident_bytes()
+{
+    long size = 0;
+    long resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return size_t(resident) * size_t(sysconf(_SC_PAGESIZE));
+}
+
+// the client end, or -1 if the response was not a 200
+int _bench_idle_connection(event_loop &loop)
+{
+    constexpr std::string_view request = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+    int sv[2];
+    CHECK_CALL(socketpair, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+    http_connection_acceptor::start_connection(loop, sv[0], ip_key{}, nullptr);
+    CHECK_CALL(write, sv[1], request.data(), request.size());
+    while (loop.run_once(0))
+    {
+    }
+    char response[512];
+    ssize_t n = read(sv[1], response, sizeof(response));
+    if (n < 12 || std::string_view(response, 12) != "HTTP/1.1 200")
+    {
+        close(sv[1]);
+        return -1;
+    }
+    return sv[1];
+}
+
+void _bench_raise_nofile();
+
+int run_idle_check(event_loop &loop, size_t count)
+{
+    _bench_raise_nofile();
+    std::vector<int> clients;
+    clients.reserve(idle_warmup + count);
+    size_t failed = 0;
+    size_t before = 0;
+    for (size_t i = 0; i < idle_warmup + count; ++i)
+    {
+        if (i == idle_warmup)
+        {
+            before = bench_resident_bytes();
+        }
+        int fd = _bench_idle_connection(loop);
+        if (fd == -1)
+        {
+            ++failed;
+            continue;
+        }
+        clients.push_back(fd);
+    }
+    size_t after = bench_resident_bytes();
+    size_t parked = loop.m_parked;
+    double per_connection = double(after > before ? after - before : 0) / double(count);
+    bool ok = failed == 0 && parked == clients.size() && per_connection < double(idle_budget_bytes);
+    fmt::println("idle: {} connections parked of {}, resident +{} bytes, {:.1f} bytes per connection (budget {}), {}",
+                 parked, clients.size(), after > before ? after - before : 0, per_connection, idle_budget_bytes,
+                 ok ? "ok" : "FAILED");
+    for (int fd : clients)
+    {
+        close(fd);
+    }
+    while (loop.run_once(0))
+    {
+    }
+    return ok ? 0 : 1;
+}
+
+// --fanout N: websocket broadcast. N members join the hub, plus one that
+// never reads; each round one member sends a message and the loop runs
+// until it is idle, then every member reads what it got. Reported per
+// delivered frame. The member that does not read must be dropped once
+// fanout_queue_bytes pile up for it, and no other member may miss a frame.
+constexpr size_t fanout_queue_bytes = 64 * 1024;
+
+void _bench_raise_nofile()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// the client end after the 101, non-blocking, or -1
+int _bench_ws_member(event_loop &loop)
+{
+    constexpr std::string_view upgrade = "GET /ws HTTP/1.1\r\nHost: bench\r\nUpgrade: websocket\r\n"
+                                         "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                         "Sec-WebSocket-Version: 13\r\n\r\n";
+    int sv[2];
+    CHECK_CALL(socketpair, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+    http_connection_acceptor::start_connection(loop, sv[0], ip_key{}, nullptr);
+    CHECK_CALL(write, sv[1], upgrade.data(), upgrade.size());
+    bench_run_loop(loop, nullptr);
+    std::string response;
+    char c;
+    while (response.size() < 4 || response.compare(response.size() - 4, 4, "\r\n\r\n") != 0)
+    {
+        if (read(sv[1], &c, 1) != 1)
+        {
+            break;
+        }
+        response += c;
+    }
+    if (response.compare(0, 12, "HTTP/1.1 101") != 0)
+    {
+        close(sv[1]);
+        return -1;
+    }
+    int flags = CHECK_CALL(fcntl, sv[1], F_GETFL);
+    CHECK_CALL(fcntl, sv[1], F_SETFL, flags | O_NONBLOCK);
+    return sv[1];
+}
+
+// a client frame: masked, with a zero key so the payload goes as is
+std::string bench_ws_client_frame(std::string_view payload)
+{
+    bytes_buffer out;
+    websocket_write_frame(out, websocket_opcode::text, payload);
+    std::string frame = std::string(std::string_view(out));
+    size_t header = frame.size() - payload.size();
+    frame[1] = char(frame[1] | 0x80);
+    frame.insert(header, 4, '\0');
+    return frame;
+}
+
+// whole server frames in buf, taken off it; a partial one stays
+size_t bench_ws_count_frames(std::string &buf, size_t payload)
+{
+    size_t frames = 0;
+    size_t off = 0;
+    while (buf.size() - off >= 2)
+    {
+        auto u = reinterpret_cast<unsigned char const *>(buf.data() + off);
+        size_t header = 2;
+        uint64_t len = u[1] & 0x7f;
+        if (len == 126)
+        {
+            header = 4;
+        }
+        else if (len == 127)
+        {
+            header = 10;
+        }
+        if (buf.size() - off < header)
+        {
+            break;
+        }
+        if (header > 2)
+        {
+            len = 0;
+            for (size_t i = 2; i < header; ++i)
+            {
+                len = (len << 8) | u[i];
+            }
+        }
+        if (buf.size() - off - header < len)
+        {
+            break;
+        }
+        frames += len == payload;
+        off += header + len;
+    }
+    buf.erase(0, off);
+    return frames;
+}
+
+int run_fanout(event_loop &loop, size_t members, size_t rounds, size_t payload)
+{
+    _bench_raise_nofile();
+    ws_limits.max_queued_bytes = fanout_queue_bytes;
+    std::vector<int> clients;
+    for (size_t i = 0; i < members + 1; ++i)
+    {
+        int fd = _bench_ws_member(loop);
+        if (fd == -1)
+        {
+            fmt::println("fanout: member {} got no 101, FAILED", i);
+            return 1;
+        }
+        clients.push_back(fd);
+    }
+    int slow = clients.back();
+    clients.pop_back();
+    std::string frame = bench_ws_client_frame(std::string(payload, 'x'));
+    std::vector<std::string> pending(members);
+    std::vector<size_t> got(members);
+    bench_counters counters;
+    uint64_t dropped_before = ws_hub.m_dropped;
+    char buf[64 * 1024];
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        int sender = clients[round % members];
+        CHECK_CALL(write, sender, frame.data(), frame.size());
+        bench_run_loop(loop, &counters);
+        for (size_t i = 0; i < members; ++i)
+        {
+            ssize_t n;
+            while ((n = read(clients[i], buf, sizeof(buf))) > 0)
+            {
+                pending[i].append(buf, size_t(n));
+            }
+            got[i] += bench_ws_count_frames(pending[i], payload);
+        }
+        bench_run_loop(loop, nullptr); // a member whose socket was full is writable again
+    }
+    size_t missing = 0;
+    for (size_t i = 0; i < members; ++i)
+    {
+        missing += rounds - std::min(rounds, got[i]);
+    }
+    // shutdown() made its read see eof, so it has closed and left the hub
+    bool dropped = ws_hub.m_dropped > dropped_before && ws_hub.m_members.size() == members;
+    double n = double(std::max<size_t>(rounds * members, 1));
+    bool ok = missing == 0 && dropped;
+    fmt::println("fanout: {} members, {} messages of {} bytes, {:.0f} ticks/frame, {:.2f} sys/frame, "
+                 "{:.2f} alloc/frame, {} frames missing, member that does not read {}, {}",
+                 members, rounds, payload, double(counters.m_ticks) / n, double(counters.m_syscalls) / n,
+                 double(counters.m_allocs) / n, missing, dropped ? "dropped" : "NOT dropped",
+                 ok ? "ok" : "FAILED");
+    for (int fd : clients)
+    {
+        close(fd);
+    }
+    close(slow);
+    bench_run_loop(loop, nullptr);
+    return ok ? 0 : 1;
+}
+
+// the page behind /static/bench.html, in a directory of its own
+struct bench_static_dir
+{
+    std::string m_dir;
+
+    bench_static_dir()
+    {
+        char dir[] = "/tmp/loop_bench-static-XXXXXX";
+        if (!mkdtemp(dir))
+        {
+            throw std::system_error(errno, std::system_category(), "mkdtemp");
+        }
+        m_dir = dir;
+        write_page({});
+        static_files.root = m_dir;
+    }
+
+    bench_static_dir(bench_static_dir const &) = delete;
+    bench_static_dir &operator=(bench_static_dir const &) = delete;
+
+    ~bench_static_dir()
+    {
+        unlink(page().c_str());
+        rmdir(m_dir.c_str());
+    }
+
+    std::string page() const
+    {
+        return m_dir + "/bench.html";
+    }
+
+    // about 8 KiB of text, worth compressing
+    void write_page(std::string_view extra)
+    {
+        std::string text = "<html><head><title>loop_bench</title></head><body>\n";
+        for (int i = 0; i < 200; ++i)
+        {
+            text += fmt::format("<p>static line {} of the bench page</p>\n", i);
+        }
+        text += extra;
+        text += "</body></html>\n";
+        std::ofstream(page(), std::ios::binary | std::ios::trunc) << text;
+    }
+};
+
+// --static-cache N: N gzip requests for the static page compress it once
+// and hit the cache after; once the file changes, its new validator misses
+int run_static_cache_check(event_loop &loop, bench_static_dir &dir, size_t count)
+{
+    constexpr std::string_view request = "GET /static/bench.html HTTP/1.1\r\nHost: bench\r\n"
+                                         "Accept-Encoding: gzip\r\n\r\n";
+    auto &stats = thread_response_compressor().m_stats;
+    uint64_t hits_before = stats.m_cache_hits;
+    uint64_t compressed_before = stats.m_compressed;
+    bench_connection conn(loop);
+    std::string first;
+    size_t bad = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        conn.deliver(request, nullptr);
+        auto got = conn.responses();
+        if (got.size() != 1 || got[0].first != 200 || got[0].second.compare(0, 2, "\x1f\x8b") != 0 ||
+            (i && got[0].second != first))
+        {
+            ++bad;
+        }
+        else if (i == 0)
+        {
+            first = got[0].second;
+        }
+    }
+    uint64_t hits = stats.m_cache_hits - hits_before;
+    uint64_t compressed = stats.m_compressed - compressed_before;
+    dir.write_page("<p>changed</p>\n");
+    conn.deliver(request, nullptr);
+    auto got = conn.responses();
+    bool changed = got.size() == 1 && got[0].first == 200 && got[0].second != first &&
+                   stats.m_compressed - compressed_before == compressed + 1;
+    bool ok = bad == 0 && compressed == 1 && hits == count - 1 && changed;
+    fmt::println("static-cache: {} requests, {} compressed, {} cache hits, {} bad; after the file changed {}, {}",
+                 count, compressed, hits, bad, changed ? "compressed again" : "NOT compressed again",
+                 ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+// ns per TSC tick, against CLOCK_MONOTONIC over a short sleep
+double bench_ns_per_tick()
+{
+    uint64_t ns0 = _trace_monotonic_ns();
+    uint64_t t0 = trace_now();
+    usleep(50000);
+    uint64_t ns1 = _trace_monotonic_ns();
+    uint64_t t1 = trace_now();
+    return t1 == t0 ? 1.0 : double(ns1 - ns0) / double(t1 - t0);
+}
+
+// --inflight N,M: N connections with M requests in flight on each, all
+// written before the loop runs: HTTP/1.1 pipelines them, HTTP/2 sends M
+// streams. Unlike the corpus rows, which measure one connection's requests
+// as they trickle in, this compares the protocols under concurrency; req/s
+// is client and loop together, on this one thread.
+int run_inflight(event_loop &loop, size_t connections, size_t inflight, size_t requests,
+                 bench_transport transport, bench_protocol protocol, double ns_per_tick)
+{
+    constexpr std::string_view request = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+    _bench_raise_nofile();
+    std::string h1_round;
+    for (size_t i = 0; i < inflight; ++i)
+    {
+        h1_round += request;
+    }
+    auto h2_requests = bench_h2_requests(h1_round);
+    std::vector<std::unique_ptr<bench_connection>> conns;
+    for (size_t i = 0; i < connections; ++i)
+    {
+        conns.push_back(std::make_unique<bench_connection>(loop, transport, protocol));
+    }
+    size_t per_round = connections * inflight;
+    size_t rounds = (requests + per_round - 1) / per_round;
+    bench_counters counters;
+    uint64_t wall_ticks = 0;
+    size_t bad = 0;
+    for (size_t round = 0; round < 1 + rounds; ++round)
+    {
+        bool counted = round > 0; // the first round warms up
+        uint64_t start = trace_now();
+        for (auto &conn : conns)
+        {
+            std::string bytes = protocol == bench_protocol::h2 ? conn->h2_round(h2_requests) : h1_round;
+            ssize_t n = write(conn->m_client, bytes.data(), bytes.size());
+            if (n < ssize_t(bytes.size()))
+            {
+                conn->deliver(std::string_view(bytes).substr(size_t(std::max<ssize_t>(n, 0))), nullptr);
+            }
+        }
+        bench_run_loop(loop, counted ? &counters : nullptr);
+        for (auto &conn : conns)
+        {
+            size_t ok = 0;
+            size_t got = 0;
+            // what did not fit in the socket comes after a read makes room
+            for (size_t tries = 0; got < inflight && tries < 16; ++tries)
+            {
+                for (auto &[status, body] : conn->responses())
+                {
+                    ++got;
+                    ok += status == 200;
+                }
+            }
+            bad += inflight - ok;
+        }
+        if (counted)
+        {
+            wall_ticks += trace_now() - start;
+        }
+    }
+    double n = double(std::max<size_t>(rounds * per_round, 1));
+    double wall_ns = double(wall_ticks) * ns_per_tick / n;
+    fmt::println("inflight via {}{}: {} connections x {} in flight, {} reqs, {:.0f} loop ns/req, {:.2f} sys/req, "
+                 "{:.2f} alloc/req, {:.0f} wall ns/req, {:.0f} req/s, {}",
+                 bench_transport_name(transport), protocol == bench_protocol::h2 ? "+h2" : "", connections,
+                 inflight, rounds * per_round, double(counters.m_ticks) * ns_per_tick / n,
+                 double(counters.m_syscalls) / n, double(counters.m_allocs) / n, wall_ns,
+                 wall_ns > 0 ? 1e9 / wall_ns : 0.0,
+                 bad ? fmt::format("{} bad FAILED", bad) : "ok");
+    conns.clear();
+    return bad ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_options opts;
+    std::vector<bench_split> splits = {bench_split::whole, bench_split::bytes, bench_split::crlf, bench_split::random};
+    std::vector<bench_transport> transports = {bench_transport::unix_pair};
+    std::vector<bench_protocol> protocols = {bench_protocol::h1};
+    std::vector<std::string_view> tls_modes; // user, ktls; plain when empty
+    std::string corpus_path;
+    std::string only_case;
+    size_t idle = 0;
+    size_t fanout = 0;
+    size_t static_cache = 0;
+    size_t payload = 128;
+    size_t inflight_connections = 0; // --inflight N,M
+    size_t inflight = 0;
+    std::vector<bench_case> cases;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string_view arg = argv[i];
+            if (i + 1 >= argc)
+            {
+                throw config_error(fmt::format("{}: missing value", arg));
+            }
+            std::string_view value = argv[++i];
+            if (arg == "--corpus")
+            {
+                corpus_path = std::string(value);
+            }
+            else if (arg == "--case")
+            {
+                only_case = std::string(value);
+            }
+            else if (arg == "--split")
+            {
+                splits.clear();
+                while (!value.empty())
+                {
+                    size_t comma = value.find(',');
+                    splits.push_back(parse_bench_split(value.substr(0, comma)));
+                    value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+                }
+            }
+            else if (arg == "--transport")
+            {
+                transports.clear();
+                while (!value.empty())
+                {
+                    size_t comma = value.find(',');
+                    transports.push_back(parse_bench_transport(value.substr(0, comma)));
+                    value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+                }
+            }
+            else if (arg == "--protocol")
+            {
+                protocols.clear();
+                while (!value.empty())
+                {
+                    size_t comma = value.find(',');
+                    protocols.push_back(parse_bench_protocol(value.substr(0, comma)));
+                    value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+                }
+            }
+            else if (arg == "--tls")
+            {
+                while (!value.empty())
+                {
+                    size_t comma = value.find(',');
+                    auto mode = value.substr(0, comma);
+                    if (mode != "user" && mode != "ktls")
+                    {
+                        throw config_error(fmt::format("--tls: unknown '{}'", mode));
+                    }
+                    tls_modes.push_back(mode);
+                    value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+                }
+            }
+            else if (arg == "--requests")
+            {
+                opts.requests = size_t(std::max(1, _config_int(arg, value)));
+            }
+            else if (arg == "--seed")
+            {
+                opts.seed = uint32_t(_config_int(arg, value));
+            }
+            else if (arg == "--gap-us")
+            {
+                opts.gap_us = _config_int(arg, value);
+            }
+            else if (arg == "--idle")
+            {
+                idle = size_t(std::max(1, _config_int(arg, value)));
+            }
+            else if (arg == "--fanout")
+            {
+                fanout = size_t(std::max(1, _config_int(arg, value)));
+            }
+            else if (arg == "--static-cache")
+            {
+                static_cache = size_t(std::max(1, _config_int(arg, value)));
+            }
+            else if (arg == "--inflight")
+            {
+                size_t comma = value.find(',');
+                if (comma == std::string_view::npos)
+                {
+                    throw config_error("--inflight: want CONNECTIONS,IN_FLIGHT");
+                }
+                inflight_connections = size_t(std::max(1, _config_int(arg, value.substr(0, comma))));
+                inflight = size_t(std::max(1, _config_int(arg, value.substr(comma + 1))));
+            }
+            else if (arg == "--payload")
+            {
+                payload = size_t(std::max(0, _config_int(arg, value)));
+            }
+            else if (arg == "--log")
+            {
+                log_verbosity = parse_log_level(value);
+            }
+            else
+            {
+                throw config_error(fmt::format("unknown option {}", arg));
+            }
+        }
+        if (corpus_path.empty())
+        {
+            cases = parse_bench_corpus(bench_builtin_corpus, "built-in corpus");
+        }
+        else
+        {
+            std::ifstream in(corpus_path, std::ios::binary);
+            if (!in)
+            {
+                throw config_error(fmt::format("cannot open corpus {}", corpus_path));
+            }
+            std::stringstream text;
+            text << in.rdbuf();
+            cases = parse_bench_corpus(text.str(), corpus_path);
+        }
+        if (!only_case.empty())
+        {
+            cases.erase(std::remove_if(cases.begin(), cases.end(), [&](bench_case const &c)
+                                       { return c.m_name != only_case; }),
+                        cases.end());
+            if (cases.empty())
+            {
+                throw config_error(fmt::format("--case: no case named {}", only_case));
+            }
+        }
+        if (std::find(protocols.begin(), protocols.end(), bench_protocol::h2) != protocols.end())
+        {
+            for (auto &c : cases)
+            {
+                try
+                {
+                    c.m_h2 = bench_h2_requests(c.m_request);
+                }
+                catch (std::exception const &e)
+                {
+                    throw config_error(fmt::format("case {}: no h2 form: {}", c.m_name, e.what()));
+                }
+            }
+        }
+    }
+    catch (config_error const &e)
+    {
+        fmt::println(stderr, "loop_bench: {}", e.what());
+        return 2;
+    }
+
+    // a resumed connection looks its peer up again, so a loopback TCP client
+    // would run into the per-IP limit
+    admission_state.m_buckets.m_rate = 0;
+    bench_static_dir static_dir;
+    event_loop loop;
+    _place_loop(0, loop);
+    if (idle)
+    {
+        return run_idle_check(loop, idle);
+    }
+    if (fanout)
+    {
+        return run_fanout(loop, fanout, opts.requests, payload);
+    }
+    if (static_cache)
+    {
+        return run_static_cache_check(loop, static_dir, static_cache);
+    }
+    if (inflight)
+    {
+        double ns_per_tick = bench_ns_per_tick();
+        int status = 0;
+        for (auto transport : transports)
+        {
+            for (auto protocol : protocols)
+            {
+                status |= run_inflight(loop, inflight_connections, inflight, opts.requests, transport, protocol,
+                                       ns_per_tick);
+            }
+        }
+        return status;
+    }
+    std::unique_ptr<bench_tls_contexts> tls;
+    if (!tls_modes.empty())
+    {
+        tls = std::make_unique<bench_tls_contexts>();
+    }
+    else
+    {
+        tls_modes.push_back({});
+    }
+    double ns_per_tick = bench_ns_per_tick();
+    fmt::println("{:<16} {:<12} {:<7} {:>7} {:>10} {:>9} {:>9} {:>10} {:>11} {:>9}  {}",
+                 "case", "via", "split", "reqs", "ticks/req", "ns/req", "sys/req", "alloc/req", "bytes/req",
+                 "rtt ns", "check");
+    size_t failed = 0;
+    for (auto &c : cases)
+    {
+        for (auto transport : transports)
+        {
+            opts.transport = transport;
+            for (auto mode : tls_modes)
+            {
+                opts.tls = mode.empty() ? nullptr : mode == "user" ? tls->m_user.get() : tls->m_ktls.get();
+                for (auto protocol : protocols)
+                {
+                    opts.protocol = protocol;
+                    auto via = fmt::format("{}{}{}{}", bench_transport_name(transport), mode.empty() ? "" : "+",
+                                           mode == "user" ? "tls" : mode, protocol == bench_protocol::h2 ? "+h2" : "");
+                    for (auto split : splits)
+                    {
+                        auto r = run_bench_case(loop, c, split, opts);
+                        double n = double(std::max<size_t>(r.m_requests, 1));
+                        fmt::println("{:<16} {:<12} {:<7} {:>7} {:>10.0f} {:>9.0f} {:>9.2f} {:>10.2f} {:>11.0f} {:>9.0f}  {}",
+                                     c.m_name, via, bench_split_name(split), r.m_requests,
+                                     double(r.m_counters.m_ticks) / n, double(r.m_counters.m_ticks) * ns_per_tick / n,
+                                     double(r.m_counters.m_syscalls) / n, double(r.m_counters.m_allocs) / n,
+                                     double(r.m_counters.m_alloc_bytes) / n, double(r.m_round_ticks) * ns_per_tick / n,
+                                     r.m_failures ? fmt::format("{} FAILED, first: {}", r.m_failures, r.m_first_failure)
+                                                  : "ok");
+                        fflush(stdout);
+                        failed += r.m_failures;
+                    }
+                }
+            }
+        }
+    }
+    for (auto transport : transports)
+    {
+        opts.transport = transport;
+        for (auto mode : tls_modes)
+        {
+            if (mode.empty())
+            {
+                continue;
+            }
+            opts.tls = mode == "user" ? tls->m_user.get() : tls->m_ktls.get();
+            bool ktls = false;
+            auto failure = bench_tls_key_update(loop, opts, ktls);
+            fmt::println("key-update via {}+{}: transmit in {}, {}", bench_transport_name(transport),
+                         mode == "user" ? "tls" : mode, ktls ? "the kernel" : "OpenSSL",
+                         failure.empty() ? "ok" : "FAILED, " + failure);
+            failed += !failure.empty();
+        }
+    }
+    return failed ? 1 : 0;
+}
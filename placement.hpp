@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sched.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/format.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "config.hpp"
+
+// Where event loops run: CPU affinity from the config and the NUMA node
+// each CPU belongs to. A loop thread pins itself before allocating its
+// pools, and prefers its own node from then on, so first touch places its
+// buffers locally without mbind calls on every allocation.
+
+// "0-3,8,10-11"
+inline std::vector<int> parse_cpu_list(std::string_view list) {
+    std::vector<int> cpus;
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        auto range = list.substr(0, comma);
+        list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+        size_t dash = range.find('-');
+        int first = _config_int("cpu", range.substr(0, dash));
+        int last = dash == std::string_view::npos ? first : _config_int("cpu", range.substr(dash + 1));
+        if (last < first || last >= CPU_SETSIZE) {
+            throw config_error(fmt::format("bad cpu range '{}'", range));
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// what this process may run on, e.g. under taskset or a cgroup
+inline std::vector<int> allowed_cpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+// the nodeN link in the cpu's sysfs directory, 0 without NUMA
+inline int cpu_numa_node(int cpu) {
+    auto path = fmt::format("/sys/devices/system/cpu/cpu{}", cpu);
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+        return 0;
+    }
+    int node = 0;
+    while (auto ent = readdir(dir)) {
+        if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+inline int numa_node_count() {
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (!dir) {
+        return 1;
+    }
+    int count = 0;
+    while (auto ent = readdir(dir)) {
+        if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+            ++count;
+        }
+    }
+    closedir(dir);
+    return count ? count : 1;
+}
+
+// cpus of loop i: the i-th entry of the configured list, wrapping around
+// when there are more loops than cpus; "auto" takes the allowed set
+inline std::vector<int> loop_cpus(server_config const &cfg) {
+    if (cfg.m_cpus.empty()) {
+        return {};
+    }
+    auto pool = cfg.m_cpus == "auto" ? allowed_cpus() : parse_cpu_list(cfg.m_cpus);
+    if (pool.empty()) {
+        throw config_error("cpus: no cpu to run on");
+    }
+    std::vector<int> cpus;
+    for (size_t i = 0; i < cfg.m_loops; ++i) {
+        cpus.push_back(pool[i % pool.size()]);
+    }
+    return cpus;
+}
+
+[[nodiscard]] inline bool pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// MPOL_PREFERRED: local pages while the node has free memory, other
+// nodes after that rather than failing
+[[nodiscard]] inline bool prefer_numa_node(int node) {
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {};
+    if (node < 0 || size_t(node) >= sizeof(mask) * 8) {
+        return false;
+    }
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) == 0;
+}
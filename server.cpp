@@ -1,13 +1,22 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <string.h>
 #include <fmt/format.h>
 #include <thread>
+#include <mutex>
+#include <atomic>
 #include <vector>
 #include <algorithm>
 #include <map>
@@ -17,6 +26,18 @@
 #include "bytes_buffer.hpp"
 #include <deque>
 #include "callback.hpp"
+#include "http2.hpp"
+#include "websocket.hpp"
+#include "header_table.hpp"
+#include "tls.hpp"
+#include "compress.hpp"
+#include "admission.hpp"
+#include "handoff.hpp"
+#include "config.hpp"
+#include "placement.hpp"
+#include "trace.hpp"
+#include <charconv>
+#include <memory>
 
 int err;
 std::error_category *cat;
@@ -62,6 +83,18 @@ T check_error(const char *what, T res)
 #define CHECK_CALL_EXCEPT(except, func, ...) check_error<except>(SOURCE_INFO() #func, func(__VA_ARGS__))
 #define CHECK_CALL(func, ...) check_error(SOURCE_INFO() #func, func(__VA_ARGS__))
 
+// 每个连接、每次读、每个请求一行的输出只在 debug 级别打印, 它们比请求本身还贵
+log_level log_verbosity = log_level::info;
+
+#define LOG_DEBUG(...)                             \
+    do                                             \
+    {                                              \
+        if (log_verbosity >= log_level::debug)     \
+        {                                          \
+            fmt::println(__VA_ARGS__);             \
+        }                                          \
+    } while (0)
+
 struct address_resolver
 {
     struct socket_address_fatptr
@@ -95,6 +128,19 @@ struct address_resolver
             return {m_curr->ai_addr, m_curr->ai_addrlen};
         }
 
+        // numeric, "127.0.0.1:8080" or "[::1]:8080"
+        std::string describe() const
+        {
+            char host[NI_MAXHOST], serv[NI_MAXSERV];
+            if (getnameinfo(m_curr->ai_addr, m_curr->ai_addrlen, host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+            {
+                return "?";
+            }
+            return m_curr->ai_family == AF_INET6 ? fmt::format("[{}]:{}", host, serv)
+                                                 : fmt::format("{}:{}", host, serv);
+        }
+
         int create_socket() const
         {
             int sockfd = CHECK_CALL(socket, m_curr->ai_family, m_curr->ai_socktype, m_curr->ai_protocol);
@@ -122,9 +168,11 @@ struct address_resolver
 
     struct addrinfo *m_head = nullptr;
 
-    address_resolved_entry resolve(std::string const &name, std::string const &service)
+    // an empty name with AI_PASSIVE in hints means every local address
+    address_resolved_entry resolve(std::string const &name, std::string const &service,
+                                   struct addrinfo const *hints = nullptr)
     {
-        int err = getaddrinfo(name.c_str(), service.c_str(), NULL, &m_head);
+        int err = getaddrinfo(name.empty() ? nullptr : name.c_str(), service.c_str(), hints, &m_head);
         if (err != 0)
         {
             // fmt::println("getaddrinfo error:{},{}",gai_strerror(err),err);
@@ -155,13 +203,23 @@ struct address_resolver
     }
 };
 
-using StringMap = std::map<std::string, std::string>;
+// throws on anything but a plain decimal number
+inline size_t _parse_content_length(std::string_view value)
+{
+    size_t n = 0;
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), n);
+    if (ec != std::errc() || end != value.data() + value.size() || value.empty())
+    {
+        throw std::runtime_error("Invalid HTTP request: bad Content-Length");
+    }
+    return n;
+}
 
 struct http11_header_parser
 {
     std::string m_header;
     std::string m_heading_line; // GET / HTTP/1.1
-    StringMap m_header_keys;
+    http_header_table m_header_keys; // views into m_header
     std::string m_body;
     size_t content_length = 0;
     bool m_header_finished = false;
@@ -171,52 +229,64 @@ struct http11_header_parser
         return m_header_finished;
     }
 
-    void _extract_headers()
+    // ready for the next message; the strings keep their capacity
+    void reset()
     {
-        size_t pos = m_header.find("\r\n");
-        if (pos == std::string::npos)
+        m_header.clear();
+        m_heading_line.clear();
+        m_header_keys.clear();
+        m_body.clear();
+        content_length = 0;
+        m_header_finished = false;
+    }
+
+    static std::string_view _trim(std::string_view s)
+    {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
         {
-            throw std::runtime_error("Invalid HTTP request: no CRLF found");
+            s.remove_suffix(1);
         }
-        m_heading_line = m_header.substr(0, pos); // 截取第一行
+        return s;
+    }
+
+    void _extract_headers()
+    {
+        std::string_view header = m_header;
+        size_t pos = header.find("\r\n");
+        m_heading_line = header.substr(0, pos); // 截取第一行, 可能没有其他头
         // fmt::println("my heading line:{}",m_heading_line);
-        while (pos != std::string::npos)
+        while (pos != std::string_view::npos)
         {
             // skip \r\n
             pos += 2;
-            size_t next_pos = m_header.find("\r\n", pos);
-            size_t line_len = std::string::npos;
-            if (next_pos != std::string::npos)
+            size_t next_pos = header.find("\r\n", pos);
+            size_t line_len = std::string_view::npos;
+            if (next_pos != std::string_view::npos)
             {
                 line_len = next_pos - pos;
             }
 
             // goto next line
-            std::string line = m_header.substr(pos, line_len);
-            size_t colon = line.find(": ");
-            if (colon != std::string::npos)
-            {
-                std::string key = line.substr(0, colon);
-                std::string value = line.substr(colon + 2);
-                // turn the keys to lower case
-                std::transform(key.begin(), key.end(), key.begin(), [](char c)
-                               {
-                                   if (c >= 'A' && c <= 'Z')
-                                   {
-                                       return static_cast<char>(c - 'A' + 'a');
-                                   }
-                                   return static_cast<char>(c);
-                               });
-                m_header_keys[key] = value;
-                // fmt::println("found header:{}:{}",key,m_header_keys[key]);
-                if (key == "content-length")
+            std::string_view line = header.substr(pos, line_len);
+            size_t colon = line.find(':');
+            if (colon != std::string_view::npos)
+            {
+                // names are matched case-insensitively, no lowering copy
+                if (!m_header_keys.add(line.substr(0, colon), _trim(line.substr(colon + 1))))
                 {
-                    // fmt::println("found content length:{}",value);
-                    content_length = std::stoi(value);
+                    throw std::runtime_error("Invalid HTTP request: conflicting repeated header");
                 }
             }
             pos = next_pos;
         }
+        if (m_header_keys.has(http_header_id::content_length))
+        {
+            content_length = _parse_content_length(m_header_keys.get(http_header_id::content_length));
+        }
     }
 
     void push_chunk(std::string_view chunk)
@@ -239,14 +309,13 @@ struct http11_header_parser
         }
     }
 
-    StringMap &headers()
+    http_header_table &headers()
     {
         return m_header_keys;
     }
 
     std::string &headline()
     {
-        fmt::println("heading line:{}", m_heading_line);
         return m_heading_line;
     }
 
@@ -267,23 +336,84 @@ struct _http_base_parser
 {
     HeaderParser m_header_parser;
     size_t m_content_length = 0;
+    size_t m_body_received = 0;
     bool m_body_finished = false;
+    std::string m_leftover; // bytes past the end of this message (pipelined)
+
+    // Transfer-Encoding: chunked
+    enum class _chunk_state
+    {
+        size_line,
+        data,
+        data_crlf,
+        trailer,
+    };
+    bool m_chunked = false;
+    _chunk_state m_chunk_state = _chunk_state::size_line;
+    size_t m_chunk_remaining = 0;
+    std::string m_chunk_line;
+
+    callback<std::string_view> m_body_cb; // if set, body bytes go here instead of body()
+    callback<> m_header_cb;               // headers parsed, body not started yet
 
     [[nodiscard]] bool request_finished() const
     {
         return m_body_finished; // body is finished, no need more chunks
     }
 
+    [[nodiscard]] bool header_finished()
+    {
+        return m_header_parser.header_finished();
+    }
+
+    // no byte of the next message received yet
+    [[nodiscard]] bool idle() const
+    {
+        return !m_header_parser.m_header_finished && m_header_parser.m_header.empty();
+    }
+
+    void reset()
+    {
+        m_header_parser.reset();
+        m_content_length = 0;
+        m_body_received = 0;
+        m_body_finished = false;
+        m_leftover.clear();
+        m_chunked = false;
+        m_chunk_state = _chunk_state::size_line;
+        m_chunk_remaining = 0;
+        m_chunk_line.clear();
+        m_body_cb = nullptr;
+        m_header_cb = nullptr;
+    }
+
+    // deliver the body incrementally; must be set before the body starts
+    void on_body_chunk(callback<std::string_view> cb)
+    {
+        m_body_cb = std::move(cb);
+    }
+
+    // lets the caller pick where the body goes, or reject it, from the headers
+    void on_header_finished(callback<> cb)
+    {
+        m_header_cb = std::move(cb);
+    }
+
     std::string &body()
     {
         return m_header_parser.extra_body();
     }
 
-    std::string &headers()
+    http_header_table &headers()
     {
         return m_header_parser.headers();
     }
 
+    std::string &leftover()
+    {
+        return m_leftover;
+    }
+
     std::string &headers_raw()
     {
         return m_header_parser.headers_raw();
@@ -297,21 +427,30 @@ struct _http_base_parser
     size_t _extract_content_length()
     {
         auto &headers = m_header_parser.headers();
-        auto it = headers.find("content-length");
-        if (it == headers.end())
+        if (!headers.has(http_header_id::content_length))
         {
             // fmt::println("no content length header, assume 0");
             return 0;
         }
-        try
+        return _parse_content_length(headers.get(http_header_id::content_length));
+    }
+
+    // the only coding taken is chunked alone: without a final chunked the
+    // body has no end to find (RFC 9112 6.3), and other codings are not
+    // decoded here; falling back to Content-Length would let a proxy in
+    // front read a different message than this server does
+    bool _extract_chunked()
+    {
+        auto &headers = m_header_parser.headers();
+        if (!headers.has(http_header_id::transfer_encoding))
         {
-            // fmt::println("found content length:{}",it->second);
-            return std::stoi(it->second);
+            return false;
         }
-        catch (std::invalid_argument const &)
+        if (!header_name_equals(headers.get(http_header_id::transfer_encoding), "chunked"))
         {
-            return 0;
+            throw std::runtime_error("Invalid HTTP request: unsupported Transfer-Encoding");
         }
+        return true;
     }
 
     void push_chunk(std::string_view chunk)
@@ -322,24 +461,150 @@ struct _http_base_parser
             m_header_parser.push_chunk(chunk);
             if (m_header_parser.header_finished())
             {
-                m_content_length = _extract_content_length();
-                if (body().size() >= m_content_length)
+                // chunked wins over Content-Length
+                m_chunked = _extract_chunked();
+                m_content_length = m_chunked ? 0 : _extract_content_length();
+                m_body_finished = !m_chunked && m_content_length == 0;
+                if (m_header_cb)
                 {
-                    // fmt::println("body size {} >= content length {}",body().size(),m_content_length);
-                    m_body_finished = true;
-                    body().resize(m_content_length);
+                    m_header_cb(multishot_call);
                 }
+                std::string extra = std::move(body());
+                body().clear();
+                _push_body(extra);
             }
         }
         else
         {
-            body().append(chunk);
-            if (body().size() >= m_content_length)
+            _push_body(chunk);
+        }
+    }
+
+    void _emit_body(std::string_view data)
+    {
+        if (data.empty())
+        {
+            return;
+        }
+        if (m_body_cb)
+        {
+            m_body_cb(multishot_call, data);
+        }
+        else
+        {
+            body().append(data);
+        }
+    }
+
+    void _push_body(std::string_view data)
+    {
+        if (!m_body_finished)
+        {
+            if (m_chunked)
+            {
+                data = _push_chunked(data);
+            }
+            else
+            {
+                size_t n = std::min(data.size(), m_content_length - m_body_received);
+                _emit_body(data.substr(0, n));
+                m_body_received += n;
+                data.remove_prefix(n);
+                m_body_finished = m_body_received == m_content_length;
+            }
+        }
+        m_leftover.append(data);
+    }
+
+    // collects one CRLF-terminated line across chunks, true once complete
+    bool _take_line(std::string_view &data)
+    {
+        size_t nl = data.find('\n');
+        m_chunk_line.append(data.substr(0, nl));
+        if (m_chunk_line.size() > 4096)
+        {
+            throw std::runtime_error("Invalid HTTP request: chunk line too long");
+        }
+        if (nl == std::string_view::npos)
+        {
+            data = {};
+            return false;
+        }
+        data.remove_prefix(nl + 1);
+        if (!m_chunk_line.empty() && m_chunk_line.back() == '\r')
+        {
+            m_chunk_line.pop_back();
+        }
+        return true;
+    }
+
+    // returns what is left after the terminating chunk
+    std::string_view _push_chunked(std::string_view data)
+    {
+        while (!data.empty() && !m_body_finished)
+        {
+            switch (m_chunk_state)
+            {
+            case _chunk_state::size_line:
+            {
+                if (!_take_line(data))
+                {
+                    break;
+                }
+                // chunk-size [;chunk-ext]
+                size_t size = 0;
+                size_t i = 0;
+                for (; i < m_chunk_line.size() && isxdigit((unsigned char)m_chunk_line[i]); ++i)
+                {
+                    if (size >> 56)
+                    {
+                        throw std::runtime_error("Invalid HTTP request: chunk too large");
+                    }
+                    char c = m_chunk_line[i];
+                    size = size * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+                }
+                if (i == 0)
+                {
+                    throw std::runtime_error("Invalid HTTP request: bad chunk size");
+                }
+                m_chunk_line.clear();
+                m_chunk_remaining = size;
+                m_chunk_state = size ? _chunk_state::data : _chunk_state::trailer;
+                break;
+            }
+            case _chunk_state::data:
             {
-                m_body_finished = true;
-                body().resize(m_content_length);
+                size_t n = std::min(data.size(), m_chunk_remaining);
+                _emit_body(data.substr(0, n));
+                data.remove_prefix(n);
+                m_chunk_remaining -= n;
+                if (m_chunk_remaining == 0)
+                {
+                    m_chunk_state = _chunk_state::data_crlf;
+                }
+                break;
+            }
+            case _chunk_state::data_crlf:
+                if (_take_line(data))
+                {
+                    if (!m_chunk_line.empty())
+                    {
+                        throw std::runtime_error("Invalid HTTP request: missing CRLF after chunk");
+                    }
+                    m_chunk_state = _chunk_state::size_line;
+                }
+                break;
+            case _chunk_state::trailer:
+                // trailer fields are skipped up to the empty line
+                if (_take_line(data))
+                {
+                    m_body_finished = m_chunk_line.empty();
+                    m_chunk_line.clear();
+                }
+                break;
             }
         }
+        return data;
     }
 
     std::string _headline_first()
@@ -504,8 +769,42 @@ struct _http_base_writer
     {
         m_header_writer.buffer().append(body);
     }
+
+    // Transfer-Encoding: chunked, one call per piece of body as it is produced
+    void write_chunk(std::string_view chunk)
+    {
+        if (chunk.empty())
+        {
+            return; // a zero-size chunk would end the body
+        }
+        auto &buffer = m_header_writer.buffer();
+        buffer.append(fmt::format("{:x}\r\n", chunk.size()));
+        buffer.append(chunk);
+        buffer.append_literial("\r\n");
+    }
+
+    void end_chunked_body()
+    {
+        m_header_writer.buffer().append_literial("0\r\n\r\n");
+    }
 };
 
+inline std::string_view http_status_reason(int status)
+{
+    switch (status)
+    {
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 413: return "Payload Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
 template <class HeaderWriter = http11_header_writer>
 struct http_request_writer : _http_base_writer<HeaderWriter>
 {
@@ -520,7 +819,7 @@ struct http_response_writer : _http_base_writer<HeaderWriter>
 {
     void begin_header(int status)
     {
-        this->_begin_header("HTTP/1.1", std::to_string(status), "OK");
+        this->_begin_header("HTTP/1.1", std::to_string(status), http_status_reason(status));
     }
 };
 
@@ -528,222 +827,2705 @@ struct epoll_callback : callback<>{
 
 };
 
-int epollfd;
+struct event_loop_options
+{
+    size_t max_events = 64;  // epoll_wait 每次最多取回的事件数
+    size_t work_budget = 16; // 每个 fd 每轮最多内联完成的 IO 次数, 超出则放到下一轮
+    int busy_poll_spins = 0; // 阻塞前先用 timeout=0 轮询的次数
+    int busy_poll_usec = 0;  // SO_BUSY_POLL, 0 表示不开启
+};
 
-struct async_file
+// an fd whose epoll data is an object rather than a callback address, so
+// it can wait to read and to write at once and be armed again while armed
+struct epoll_waiter
 {
-    int m_fd;
-    callback<> m_resume;
+    virtual void on_ready(uint32_t events) = 0;
 
-    static async_file async_wrap(int fd)
-    {
-        int flags = CHECK_CALL(fcntl, fd, F_GETFL);
-        flags |= O_NONBLOCK;
-        CHECK_CALL(fcntl, fd, F_SETFL, flags);
+protected:
+    ~epoll_waiter() = default;
+};
 
-        struct epoll_event event;
-        event.events = EPOLLET;
-        epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+// per-fd accounting for the fairness budget
+struct loop_budget
+{
+    uint64_t m_iteration = 0;
+    size_t m_used = 0;
+};
 
-        return async_file{fd, {}};
+struct event_loop
+{
+    int m_epfd = -1;
+    event_loop_options m_opts;
+    std::vector<struct epoll_event> m_events;
+    std::deque<callback<>> m_deferred; // run at the end of the current iteration
+    std::deque<callback<>> m_requeued; // over budget, run in the next iteration
+    uint64_t m_iteration = 0;
+    callback<int> m_on_parked; // a parked fd became readable
+    size_t m_parked = 0;
+    std::vector<bool> m_parked_fds; // by fd number, for close_parked
+    bool m_stopped = false;
+    int m_post_fd = -1; // eventfd, wakes the loop for m_posted
+    std::mutex m_post_mutex;
+    std::vector<callback<>> m_posted; // from other threads
+
+    // epoll data of m_post_fd: not a callback address, not a parked fd
+    static constexpr uint64_t post_tag = 2;
+    // bit 1 of a waiter's address; post_tag is the only one without an address
+    static constexpr uint64_t waiter_tag = 2;
+
+    explicit event_loop(event_loop_options opts = {})
+        : m_opts(opts), m_events(std::max<size_t>(opts.max_events, 1))
+    {
+        m_epfd = CHECK_CALL(epoll_create1, 0);
+        m_post_fd = CHECK_CALL(eventfd, 0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = post_tag;
+        CHECK_CALL(epoll_ctl, m_epfd, EPOLL_CTL_ADD, m_post_fd, &event);
     }
 
-    ssize_t sync_read(bytes_view buf)
-    {
-        return CHECK_CALL( read, m_fd, buf.data(), buf.size());
+    event_loop(event_loop const &) = delete;
+    event_loop &operator=(event_loop const &) = delete;
 
+    ~event_loop()
+    {
+        close(m_post_fd);
+        close(m_epfd);
     }
 
-    void async_read(bytes_view buf, callback<ssize_t> cb)
+    void add(int fd, uint32_t events, void *ptr = nullptr)
     {
-        ssize_t ret = CHECK_CALL_EXCEPT(EAGAIN, read, m_fd, buf.data(), buf.size());
-        if(ret!=-1){
-            cb(ret);
-            return;
-        }
+        struct epoll_event event;
+        event.events = events;
+        event.data.ptr = ptr;
+        CHECK_CALL(epoll_ctl, m_epfd, EPOLL_CTL_ADD, fd, &event);
+    }
 
-        callback<> resume = [this,buf,cb = std::move(cb)]() mutable{
-            async_read(buf, std::move(cb));
-        };
-        
+    void modify(int fd, uint32_t events, void *ptr)
+    {
         struct epoll_event event;
-        event.events = EPOLLIN | EPOLLET |EPOLLONESHOT;
-        event.data.ptr = resume.leak_address();
-        epoll_ctl(epollfd, EPOLL_CTL_MOD ,m_fd, &event);
+        event.events = events;
+        event.data.ptr = ptr;
+        CHECK_CALL(epoll_ctl, m_epfd, EPOLL_CTL_MOD, fd, &event);
+    }
 
+    // the waiter must stay where it is until it is disarmed or removed
+    void watch(int fd, uint32_t events, epoll_waiter *waiter)
+    {
+        struct epoll_event event;
+        event.events = events;
+        event.data.u64 = reinterpret_cast<uint64_t>(waiter) | waiter_tag;
+        CHECK_CALL(epoll_ctl, m_epfd, EPOLL_CTL_MOD, fd, &event);
+    }
 
+    void remove(int fd)
+    {
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, nullptr);
     }
 
-    ssize_t sync_write(bytes_view buf)
+    // an idle fd waits with its own number as the epoll data instead of a
+    // heap callback; callback addresses are aligned, so bit 0 tells them apart
+    void park(int fd)
     {
-        ssize_t ret;
-        do
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        event.data.u64 = (uint64_t(fd) << 1) | 1;
+        CHECK_CALL(epoll_ctl, m_epfd, EPOLL_CTL_MOD, fd, &event);
+        ++m_parked;
+        if (size_t(fd) >= m_parked_fds.size())
         {
-            ret = CHECK_CALL_EXCEPT(EAGAIN, write, m_fd, buf.data(), buf.size());
-        } while (ret == -1);
-        return ret;
+            m_parked_fds.resize(size_t(fd) + 1);
+        }
+        m_parked_fds[fd] = true;
     }
 
-    void async_accept(address_resolver::address &addr, callback<int>cb)
+    // closes every parked fd and returns how many there were; from a
+    // deferred task, so no event of this iteration still names one
+    size_t close_parked()
     {
-        ssize_t ret = CHECK_CALL_EXCEPT(EAGAIN, accept, m_fd, &addr.m_addr, &addr.m_addrlen);
-        if(ret!=-1){
-            cb(ret);
-            return;
+        size_t closed = 0;
+        for (size_t fd = 0; fd < m_parked_fds.size(); ++fd)
+        {
+            if (m_parked_fds[fd])
+            {
+                m_parked_fds[fd] = false;
+                remove(int(fd));
+                close(int(fd));
+                ++closed;
+            }
         }
-
-        callback<> resume = [this,&addr,cb = std::move(cb)]() mutable{
-            async_accept(addr, std::move(cb));
-        };
-        
-        struct epoll_event event;
-        event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-        event.data.ptr = resume.leak_address();
-        epoll_ctl(epollfd, EPOLL_CTL_MOD ,m_fd, &event);
-
+        m_parked -= closed;
+        return closed;
     }
 
-    void close_file()
+    void on_parked(callback<int> cb)
     {
-        epoll_ctl(epollfd, EPOLL_CTL_DEL, m_fd, nullptr);
-        close(m_fd);
+        m_on_parked = std::move(cb);
     }
-};
-
-
-struct http_connection_handler 
-{
-
-    async_file m_conn;
-    bytes_buffer m_buf{1024};
-    http_request_parser<> m_req_parse;
 
-    void do_start(int connfd){
-        m_conn = async_file::async_wrap(connfd);
-        do_read();
+    void defer(callback<> cb)
+    {
+        m_deferred.push_back(std::move(cb));
     }
 
-    void do_read()
+    void requeue(callback<> cb)
     {
-        fmt::println("reading...");
-        m_conn.async_read(m_buf, [this](size_t n){
-            if(n==0){
-                //if eof is received
-                fmt::println("eof received from connid");
-                do_close();
-                return;
-            }
-            fmt::println("read bytes{} :{}",n,std::string_view{m_buf.data(),n});
-            //fmt::println("starting pushing chnk");
-            m_req_parse.push_chunk(m_buf.subspan(0,n));
-            if(!m_req_parse.request_finished()){
-                do_read();
-            }else{
-                do_write();
-            } });
+        m_requeued.push_back(std::move(cb));
     }
 
-    void do_write()
+    // the only member safe to call from another thread; cb runs on the loop's
+    void post(callback<> cb)
     {
-        std::string body = m_req_parse.body();
+        {
+            std::lock_guard lock(m_post_mutex);
+            m_posted.push_back(std::move(cb));
+        }
+        uint64_t one = 1;
+        (void)write(m_post_fd, &one, sizeof(one));
+    }
 
-        if(body.empty()){
-            body = "<html><body><h1>your request is empty</h1></body></html>";
+    void _run_posted()
+    {
+        uint64_t count;
+        (void)read(m_post_fd, &count, sizeof(count));
+        std::vector<callback<>> posted;
+        {
+            std::lock_guard lock(m_post_mutex);
+            posted.swap(m_posted);
         }
-        else{
-            body = "<html><body><h1>your request body is:</h1><p>" + body + "</p></body></html>";
+        for (auto &cb : posted)
+        {
+            cb();
         }
-
-        http_response_writer res_writer;
-        res_writer.begin_header(200);
-        res_writer.write_header("Server", "co_http");
-        res_writer.write_header("Content-Type", "text/html;charset=utf-8");
-        res_writer.write_header("Connection", "keep-alive");
-        res_writer.write_header("Content-length", std::to_string(body.size()));
-        res_writer.end_header();
-        res_writer.write_body(body);
-        auto &buffer = res_writer.buffer();
-
-        m_conn.sync_write(buffer);
-
-        fmt::println("handled request from connid");
-        do_read();
     }
 
-    void do_close()
+    // returns false once the fd has used up its budget for this iteration
+    [[nodiscard]] bool charge(loop_budget &budget)
     {
-        m_conn.close_file();
-        delete this;
+        if (budget.m_iteration != m_iteration)
+        {
+            budget.m_iteration = m_iteration;
+            budget.m_used = 0;
+        }
+        return ++budget.m_used <= m_opts.work_budget;
     }
 
-
-};
-
-struct http_connection_acceptor{
-    async_file m_listen;
-    address_resolver::address m_addr;
-
-    void do_start(std::string name, std::string port)
+    void apply_busy_poll(int fd)
     {
-        address_resolver resolver;
-        fmt::println("listening:{}:{}",name,port);
-        auto entry = resolver.resolve(name, port);
-        int listenfd = entry.create_socket_and_bind();
-
-        m_listen = async_file::async_wrap(listenfd);
-
-        do_accept();
+        if (m_opts.busy_poll_usec <= 0)
+        {
+            return;
+        }
+        int usec = m_opts.busy_poll_usec;
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1)
+        {
+            fmt::println(stderr, "SO_BUSY_POLL: {}", strerror(errno));
+        }
     }
 
-    void do_accept(){
-        //fmt::println("waiting for accept...");
-         CHECK_CALL( listen, m_listen.m_fd, 128);
-        m_listen.async_accept(m_addr, [this](int connfd){
-            fmt::println("accepted connid:{}", connfd);
-            auto conn_handler = new http_connection_handler{};
-            conn_handler->do_start(connfd);
-
-            do_accept();
-        });
+    int _wait(int timeout)
+    {
+        int ret = CHECK_CALL_EXCEPT(EINTR, epoll_wait, m_epfd, m_events.data(), (int)m_events.size(), timeout);
+        return ret == -1 ? 0 : ret;
     }
-};
-
-void server()
-{
-    epollfd = epoll_create1(0);
 
-    auto acceptor = new http_connection_acceptor;
-    acceptor->do_start("127.0.0.1","8080");
-
-    struct epoll_event events[10];
-
-    while (true){
-        int ret = epoll_wait(epollfd, events, 10, -1);
-        if(ret<0){
-            throw;
+    int _poll(int timeout)
+    {
+        if (!m_requeued.empty())
+        {
+            return _wait(0);
         }
-        for(int  i=0;i<ret;++i){
-            auto cb = callback<>::from_address(events[i].data.ptr);
-            cb();
+        for (int i = 0; timeout != 0 && i < m_opts.busy_poll_spins; ++i)
+        {
+            int ret = _wait(0);
+            if (ret != 0)
+            {
+                return ret;
+            }
         }
-
+        return _wait(timeout);
     }
-    fmt::println("all tasks done,exiting...");
-
-    close(epollfd);
-};
 
-int main()
-{
-    setlocale(LC_ALL, "zh_CN.UTF-8");
-    try
-    {
-        server();
-    }
-    catch (std::system_error const &e)
+    void _run_deferred()
     {
-        fmt::println("error:{}", e.what());
+        // tasks deferred by deferred tasks still run in this iteration
+        while (!m_deferred.empty())
+        {
+            auto cb = std::move(m_deferred.front());
+            m_deferred.pop_front();
+            cb();
+        }
     }
 
-    return 0;
-}
\ No newline at end of file
+    // timeout as for epoll_wait; false if there was nothing to run
+    bool run_once(int timeout = -1)
+    {
+        int ret;
+        trace_ring *ring = trace_opts.sample_every ? &thread_trace_ring() : nullptr;
+        if (ring && ring->m_active)
+        {
+            // only while a sampled request is open, so the ring holds requests, not idle waits
+            ring->record(trace_phase::poll_begin, 0, -1);
+            ret = _poll(timeout);
+            ring->record(trace_phase::poll_end, 0, -1);
+        }
+        else
+        {
+            ret = _poll(timeout);
+        }
+        ++m_iteration;
+        for (int i = 0; i < ret; ++i)
+        {
+            if (m_events[i].data.ptr == nullptr)
+            {
+                continue;
+            }
+            if (m_events[i].data.u64 == post_tag)
+            {
+                _run_posted();
+                continue;
+            }
+            if (m_events[i].data.u64 & 1)
+            {
+                int fd = int(m_events[i].data.u64 >> 1);
+                --m_parked;
+                m_parked_fds[fd] = false;
+                m_on_parked(multishot_call, fd);
+                continue;
+            }
+            if (m_events[i].data.u64 & waiter_tag)
+            {
+                auto waiter = reinterpret_cast<epoll_waiter *>(m_events[i].data.u64 & ~waiter_tag);
+                waiter->on_ready(m_events[i].events);
+                continue;
+            }
+            auto cb = callback<>::from_address(m_events[i].data.ptr);
+            cb();
+        }
+        auto ready = std::move(m_requeued);
+        m_requeued.clear();
+        for (auto &cb : ready)
+        {
+            cb();
+        }
+        bool ran = ret > 0 || !ready.empty() || !m_deferred.empty();
+        _run_deferred();
+        return ran;
+    }
+
+    // run() returns after the current iteration
+    void stop()
+    {
+        m_stopped = true;
+    }
+
+    void run()
+    {
+        while (!m_stopped)
+        {
+            run_once();
+        }
+    }
+};
+
+struct async_file : epoll_waiter
+{
+    event_loop *m_loop = nullptr;
+    int m_fd = -1;
+    callback<> m_resume;
+    callback<> m_on_readable; // a read or accept that would have blocked
+    callback<> m_on_writable; // a write that would have blocked
+    bool m_armed = false;
+    loop_budget m_budget;
+    std::unique_ptr<tls_session> m_tls; // reads and writes are plaintext when set
+    bool m_rx_stamps = false;           // SO_TIMESTAMPNS is on, reads use recvmsg
+    uint64_t m_rx_stamp_ns = 0;         // when the kernel received the last bytes read
+
+    static async_file async_wrap(event_loop &loop, int fd)
+    {
+        int flags = CHECK_CALL(fcntl, fd, F_GETFL);
+        flags |= O_NONBLOCK;
+        CHECK_CALL(fcntl, fd, F_SETFL, flags);
+
+        loop.add(fd, EPOLLET);
+
+        return adopt(loop, fd);
+    }
+
+    // fd is already nonblocking and in the loop's epoll set
+    static async_file adopt(event_loop &loop, int fd)
+    {
+        async_file file;
+        file.m_loop = &loop;
+        file.m_fd = fd;
+        return file;
+    }
+
+    // both directions share one ONESHOT registration of this object, so a
+    // file must not move while it waits
+    void _arm()
+    {
+        uint32_t events = EPOLLET | EPOLLONESHOT;
+        if (m_on_readable)
+        {
+            events |= EPOLLIN;
+        }
+        if (m_on_writable)
+        {
+            events |= EPOLLOUT;
+        }
+        m_loop->watch(m_fd, events, this);
+        m_armed = true;
+    }
+
+    void on_ready(uint32_t events) override
+    {
+        bool failed = events & (EPOLLERR | EPOLLHUP);
+        callback<> readable, writable;
+        if (failed || (events & EPOLLIN))
+        {
+            readable = std::move(m_on_readable);
+        }
+        if (failed || (events & EPOLLOUT))
+        {
+            writable = std::move(m_on_writable);
+        }
+        m_armed = false;
+        if (writable)
+        {
+            writable();
+        }
+        if (readable)
+        {
+            readable();
+        }
+        // ONESHOT disarmed the direction that did not fire as well
+        if (!m_armed && (m_on_readable || m_on_writable))
+        {
+            _arm();
+        }
+    }
+
+    // run the completion inline unless this fd is over its budget
+    template <class T>
+    void _complete(callback<T> cb, T ret)
+    {
+        if (m_loop->charge(m_budget))
+        {
+            cb(ret);
+            return;
+        }
+        m_loop->requeue([cb = std::move(cb), ret]() mutable
+                        { cb(ret); });
+    }
+
+    ssize_t sync_read(bytes_view buf)
+    {
+        return CHECK_CALL( read, m_fd, buf.data(), buf.size());
+
+    }
+
+    void enable_rx_timestamps()
+    {
+        int on = 1;
+        m_rx_stamps = setsockopt(m_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0;
+    }
+
+    ssize_t _recv_stamped(void *buf, size_t size)
+    {
+        struct iovec iov = {buf, size};
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(struct timespec))];
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t ret = recvmsg(m_fd, &msg, 0);
+        for (auto cmsg = CMSG_FIRSTHDR(&msg); ret > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                m_rx_stamp_ns = uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+            }
+        }
+        return ret;
+    }
+
+    ssize_t _raw_read(void *buf, size_t size)
+    {
+        ssize_t ret = m_rx_stamps ? _recv_stamped(buf, size) : read(m_fd, buf, size);
+        if (ret == -1 && errno == ECONNRESET)
+        {
+            ret = 0; // a reset peer is reported as eof
+        }
+        return check_error<EAGAIN>(SOURCE_INFO() "read", ret);
+    }
+
+    // -1 once the socket has nothing more, a failed handshake reads as eof
+    ssize_t _tls_read(bytes_view buf)
+    {
+        try
+        {
+            while (true)
+            {
+                ssize_t ret = m_tls->read(buf);
+                _tls_flush_later(); // handshake messages and tickets
+                if (ret != -1)
+                {
+                    return ret;
+                }
+                char cipher[16 * 1024];
+                ssize_t n = _raw_read(cipher, sizeof(cipher));
+                if (n <= 0)
+                {
+                    return n;
+                }
+                m_tls->feed(cipher, n);
+            }
+        }
+        catch (tls_error const &e)
+        {
+            LOG_DEBUG("tls on fd {}: {}", m_fd, e.what());
+            return 0;
+        }
+    }
+
+    // true once the ciphertext is out, what the socket did not take stays
+    // in the session
+    bool _tls_flush()
+    {
+        if (m_tls->m_ktls_tx)
+        {
+            m_tls->discard_output(); // see tls.hpp, sending it would encrypt it twice
+            return true;
+        }
+        auto out = m_tls->output();
+        size_t sent = 0;
+        while (sent < out.size())
+        {
+            ssize_t ret = _raw_send(out.data() + sent, out.size() - sent);
+            if (ret == -1)
+            {
+                break;
+            }
+            sent += size_t(ret);
+        }
+        if (sent)
+        {
+            m_tls->consume_output(sent);
+        }
+        if (sent < out.size())
+        {
+            return false;
+        }
+        if (!m_tls->m_ktls_tried && m_tls->handshake_done())
+        {
+            bool ktls = m_tls->enable_ktls_tx(m_fd);
+            LOG_DEBUG("tls handshake done on fd {}, resumed: {}, ktls tx: {}", m_fd, m_tls->resumed(), ktls);
+        }
+        return true;
+    }
+
+    // handshake output is sent on EPOLLOUT unless a writer already waits,
+    // every writer flushes the session first
+    void _tls_flush_later()
+    {
+        if (_tls_flush() || m_on_writable)
+        {
+            return;
+        }
+        m_on_writable = [this]
+        { _tls_flush_later(); };
+        _arm();
+    }
+
+    // -1 when the socket is full; a peer that went away takes everything,
+    // its eof is noticed by the next read
+    ssize_t _raw_send(void const *data, size_t size)
+    {
+        ssize_t ret = send(m_fd, data, size, MSG_NOSIGNAL);
+        if (ret == -1 && (errno == EPIPE || errno == ECONNRESET))
+        {
+            return ssize_t(size);
+        }
+        return check_error<EAGAIN>(SOURCE_INFO() "send", ret);
+    }
+
+    // with on_idle, a read that would block calls it instead of waiting
+    void async_read(bytes_view buf, callback<ssize_t> cb, callback<> on_idle = nullptr)
+    {
+        ssize_t ret = m_tls ? _tls_read(buf) : _raw_read(buf.data(), buf.size());
+        if(ret!=-1){
+            _complete(std::move(cb), ret);
+            return;
+        }
+        if (on_idle)
+        {
+            on_idle();
+            return;
+        }
+
+        m_on_readable = [this,buf,cb = std::move(cb)]() mutable{
+            async_read(buf, std::move(cb));
+        };
+        _arm();
+    }
+
+    // what the socket takes now, -1 if nothing; with TLS the plaintext is
+    // taken whole once the previous ciphertext is out, see flush_output()
+    ssize_t try_write(bytes_view buf)
+    {
+        if (m_tls && !m_tls->m_ktls_tx)
+        {
+            if (!_tls_flush())
+            {
+                return -1;
+            }
+            m_tls->write(buf);
+            _tls_flush();
+            return buf.size();
+        }
+        return _raw_send(buf.data(), buf.size());
+    }
+
+    ssize_t try_writev(struct iovec const *iov, int iovcnt)
+    {
+        size_t total = 0;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            total += iov[i].iov_len;
+        }
+        if (m_tls && !m_tls->m_ktls_tx)
+        {
+            if (!_tls_flush())
+            {
+                return -1;
+            }
+            for (int i = 0; i < iovcnt; ++i)
+            {
+                m_tls->write({static_cast<char const *>(iov[i].iov_base), iov[i].iov_len});
+            }
+            _tls_flush();
+            return total;
+        }
+        struct msghdr msg = {};
+        msg.msg_iov = const_cast<struct iovec *>(iov);
+        msg.msg_iovlen = iovcnt;
+        ssize_t ret = sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+        if (ret == -1 && (errno == EPIPE || errno == ECONNRESET))
+        {
+            return ssize_t(total);
+        }
+        return check_error<EAGAIN>(SOURCE_INFO() "sendmsg", ret);
+    }
+
+    // true once nothing written is held back in userspace
+    bool flush_output()
+    {
+        return !m_tls || m_tls->m_ktls_tx || _tls_flush();
+    }
+
+    void wait_writable(callback<> cb)
+    {
+        m_on_writable = std::move(cb);
+        _arm();
+    }
+
+    void async_accept(address_resolver::address &addr, callback<int>cb)
+    {
+        addr.m_addrlen = sizeof(addr.m_addr_storage); // accept() shrinks it to the last peer's
+        int ret = CHECK_CALL_EXCEPT(EAGAIN, accept, m_fd, &addr.m_addr, &addr.m_addrlen);
+        if(ret!=-1){
+            _complete(std::move(cb), ret);
+            return;
+        }
+
+        m_on_readable = [this,&addr,cb = std::move(cb)]() mutable{
+            async_accept(addr, std::move(cb));
+        };
+        _arm();
+    }
+
+    void close_file()
+    {
+        if (m_tls && m_tls->m_ktls_tx)
+        {
+            m_tls->ktls_close_notify(m_fd);
+        }
+        else if (m_tls && m_tls->handshake_done())
+        {
+            // best effort close_notify, the peer may already be gone
+            m_tls->shutdown();
+            auto out = m_tls->output();
+            (void)send(m_fd, out.data(), out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        m_loop->remove(m_fd);
+        close(m_fd);
+        m_on_readable = nullptr;
+        m_on_writable = nullptr;
+    }
+};
+
+
+// an error that maps to an HTTP status, e.g. 413
+struct http_status_error : std::runtime_error
+{
+    int m_status;
+
+    http_status_error(int status, char const *what) : std::runtime_error(what), m_status(status) {}
+};
+
+struct http_body_limits
+{
+    size_t max_body_size = size_t(1) << 30; // larger bodies get 413
+    size_t spill_threshold = 64 * 1024;     // bodies past this go to a temp file
+    std::string spill_dir = "/tmp";
+};
+
+http_body_limits body_limits;
+
+// the cap and the per-IP buckets are shared, queue delay is each loop's own
+admission_options admission_opts;
+admission_shared admission_state(admission_opts);
+thread_local admission_control admission(admission_state, admission_opts);
+
+// written as they are, before anything of the request is parsed; the
+// keep-alive 503 only after a read that held one whole request without a
+// body, which is then skipped instead of parsed
+constexpr std::string_view http_response_overloaded =
+    "HTTP/1.1 503 Service Unavailable\r\nServer: co_http\r\nConnection: close\r\n"
+    "Retry-After: 1\r\nContent-length: 0\r\n\r\n";
+constexpr std::string_view http_response_overloaded_keep_alive =
+    "HTTP/1.1 503 Service Unavailable\r\nServer: co_http\r\n"
+    "Retry-After: 1\r\nContent-length: 0\r\n\r\n";
+constexpr std::string_view http_response_rate_limited =
+    "HTTP/1.1 429 Too Many Requests\r\nServer: co_http\r\nConnection: close\r\n"
+    "Retry-After: 1\r\nContent-length: 0\r\n\r\n";
+
+// where the request body goes, fed as bytes arrive; HTTP/2 streams feed it
+// DATA frame by DATA frame
+struct http_body_sink : http2_body_sink
+{
+    void write(std::string_view data) override = 0;
+    size_t size() const override = 0;
+
+    // the whole body, if it is held in memory
+    virtual bool in_memory() const
+    {
+        return false;
+    }
+
+    virtual std::string_view memory() const
+    {
+        return {};
+    }
+
+    // the temp file holding the body, -1 if none
+    virtual int fd() const
+    {
+        return -1;
+    }
+
+    virtual ~http_body_sink() = default;
+};
+
+// hand each piece to the handler as it arrives
+struct callback_body_sink final : http_body_sink
+{
+    callback<std::string_view> m_cb;
+    size_t m_size = 0;
+
+    explicit callback_body_sink(callback<std::string_view> cb) : m_cb(std::move(cb)) {}
+
+    void write(std::string_view data) override
+    {
+        m_size += data.size();
+        m_cb(multishot_call, data);
+    }
+
+    size_t size() const override
+    {
+        return m_size;
+    }
+};
+
+struct discard_body_sink final : http_body_sink
+{
+    size_t m_size = 0;
+
+    void write(std::string_view data) override
+    {
+        m_size += data.size();
+    }
+
+    size_t size() const override
+    {
+        return m_size;
+    }
+};
+
+// keep small bodies in memory, spill larger ones to an unlinked temp file
+struct spill_body_sink final : http_body_sink
+{
+    size_t m_threshold;
+    std::string m_dir;
+    std::string m_memory;
+    int m_fd = -1;
+    size_t m_size = 0;
+
+    explicit spill_body_sink(http_body_limits const &limits)
+        : m_threshold(limits.spill_threshold), m_dir(limits.spill_dir) {}
+
+    spill_body_sink(spill_body_sink const &) = delete;
+    spill_body_sink &operator=(spill_body_sink const &) = delete;
+
+    ~spill_body_sink()
+    {
+        if (m_fd != -1)
+        {
+            close(m_fd);
+        }
+    }
+
+    int _open_temp()
+    {
+        int fd = open(m_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd != -1)
+        {
+            return fd;
+        }
+        // no O_TMPFILE support on this filesystem
+        std::string path = m_dir + "/co_http_body_XXXXXX";
+        fd = CHECK_CALL(mkstemp, path.data());
+        unlink(path.c_str());
+        return fd;
+    }
+
+    void _write_all(std::string_view data)
+    {
+        while (!data.empty())
+        {
+            ssize_t n = CHECK_CALL_EXCEPT(EINTR, ::write, m_fd, data.data(), data.size());
+            if (n > 0)
+            {
+                data.remove_prefix(n);
+            }
+        }
+    }
+
+    void write(std::string_view data) override
+    {
+        m_size += data.size();
+        if (m_fd == -1 && m_memory.size() + data.size() <= m_threshold)
+        {
+            m_memory.append(data);
+            return;
+        }
+        if (m_fd == -1)
+        {
+            m_fd = _open_temp();
+            _write_all(m_memory);
+            m_memory = std::string();
+        }
+        _write_all(data);
+    }
+
+    size_t size() const override
+    {
+        return m_size;
+    }
+
+    bool in_memory() const override
+    {
+        return m_fd == -1;
+    }
+
+    std::string_view memory() const override
+    {
+        return m_memory;
+    }
+
+    int fd() const override
+    {
+        return m_fd;
+    }
+};
+
+std::unique_ptr<http_body_sink> make_body_sink(std::string_view url)
+{
+    if (url == "/discard")
+    {
+        return std::make_unique<discard_body_sink>();
+    }
+    return std::make_unique<spill_body_sink>(body_limits);
+}
+
+struct http_connection_handler;
+
+// how far a websocket member may fall behind the broadcasts before it is
+// dropped instead of buffered for
+struct websocket_limits
+{
+    size_t max_queued_bytes = size_t(1) << 20;
+};
+
+websocket_limits ws_limits;
+
+// websocket connections of this loop; a broadcast reaches the other loops'
+// hubs through event_loop::post
+struct websocket_hub
+{
+    std::vector<http_connection_handler *> m_members;
+    std::atomic<size_t> m_member_count{0}; // m_members.size(), for a scrape on another loop
+    std::atomic<uint64_t> m_dropped{0};    // members cut off for not reading
+
+    std::string metrics(std::string_view labels = {}) const
+    {
+        return fmt::format("websocket_members{l} {}\n"
+                           "websocket_dropped_slow_total{l} {}\n",
+                           m_member_count.load(), m_dropped.load(), fmt::arg("l", labels));
+    }
+
+    void join(http_connection_handler *conn)
+    {
+        m_members.push_back(conn);
+        m_member_count.store(m_members.size(), std::memory_order_relaxed);
+    }
+
+    void leave(http_connection_handler *conn)
+    {
+        m_members.erase(std::remove(m_members.begin(), m_members.end(), conn), m_members.end());
+        m_member_count.store(m_members.size(), std::memory_order_relaxed);
+    }
+
+    void broadcast(event_loop &here, websocket_opcode opcode, std::string_view payload);
+    void deliver(std::shared_ptr<bytes_buffer const> const &frame);
+};
+
+thread_local websocket_hub ws_hub;
+
+// every loop's counters, so a /metrics scrape on any loop reports all of
+// them, each series labelled with its loop
+struct loop_metrics_registry
+{
+    struct entry
+    {
+        size_t m_loop;
+        response_compressor const *m_compressor;
+        admission_control const *m_admission;
+        websocket_hub const *m_ws;
+    };
+
+    std::mutex m_mutex; // also keeps a loop's thread from exiting mid-scrape
+    std::vector<entry> m_loops;
+
+    void add(entry const &e)
+    {
+        std::lock_guard lock(m_mutex);
+        m_loops.push_back(e);
+    }
+
+    void remove(admission_control const *admission)
+    {
+        std::lock_guard lock(m_mutex);
+        m_loops.erase(std::remove_if(m_loops.begin(), m_loops.end(), [admission](entry const &e)
+                                     { return e.m_admission == admission; }),
+                      m_loops.end());
+    }
+
+    // the lines of a series together, loop by loop, as the text format wants
+    std::string metrics()
+    {
+        std::vector<std::string> lines;
+        {
+            std::lock_guard lock(m_mutex);
+            for (auto &e : m_loops)
+            {
+                auto labels = fmt::format("{{loop=\"{}\"}}", e.m_loop);
+                auto text = e.m_compressor->metrics(labels) + e.m_admission->metrics(labels) + e.m_ws->metrics(labels);
+                for (size_t pos = 0, eol; (eol = text.find('\n', pos)) != std::string::npos; pos = eol + 1)
+                {
+                    lines.push_back(text.substr(pos, eol + 1 - pos));
+                }
+            }
+        }
+        std::stable_sort(lines.begin(), lines.end(), [](std::string const &a, std::string const &b)
+                         { return a.substr(0, a.find('{')) < b.substr(0, b.find('{')); });
+        std::string out = admission_state.metrics();
+        for (auto &line : lines)
+        {
+            out += line;
+        }
+        return out;
+    }
+};
+
+loop_metrics_registry loop_metrics;
+
+// on the loop's thread: its counters join the registry until the thread
+// exits, ahead of the thread_locals they point to
+void _register_loop_metrics(size_t index)
+{
+    struct registration
+    {
+        admission_control const *m_admission = &admission;
+
+        explicit registration(size_t index)
+        {
+            loop_metrics.add({index, &thread_response_compressor(), &admission, &ws_hub});
+        }
+
+        ~registration()
+        {
+            loop_metrics.remove(m_admission);
+        }
+    };
+    thread_local registration registered(index);
+}
+
+// 业务处理, HTTP/1.1 和 HTTP/2 共用
+struct http_handler_response
+{
+    int status = 200;
+    std::string content_type = "text/html;charset=utf-8";
+    std::string body;
+    // if set, the body is sent chunked: each call fills the next piece, an empty piece ends it
+    callback<std::string &> body_source;
+    // path and validator of a body that changes only with them, its encoded
+    // variants are cached under it
+    std::string cache_key;
+    std::string etag;                  // strong, of the identity body
+    std::string_view content_encoding; // set by encode_http_response
+    bool vary_encoding = false;
+};
+
+// files under root are served at /static/; size and mtime are their validator
+struct static_file_options
+{
+    std::string root; // empty: no /static/
+};
+
+static_file_options static_files;
+
+std::string_view static_content_type(std::string_view name)
+{
+    auto ext = name.substr(std::min(name.rfind('.'), name.size()));
+    if (ext == ".html" || ext == ".htm")
+    {
+        return "text/html;charset=utf-8";
+    }
+    if (ext == ".css")
+    {
+        return "text/css;charset=utf-8";
+    }
+    if (ext == ".js")
+    {
+        return "application/javascript";
+    }
+    if (ext == ".json")
+    {
+        return "application/json";
+    }
+    if (ext == ".svg")
+    {
+        return "image/svg+xml";
+    }
+    if (ext == ".txt")
+    {
+        return "text/plain;charset=utf-8";
+    }
+    return "application/octet-stream";
+}
+
+// a regular file under static_files.root, read whole; false if there is none
+bool serve_static_file(std::string_view name, http_handler_response &res)
+{
+    if (static_files.root.empty() || name.empty() || name[0] == '/' || name.find("..") != std::string_view::npos)
+    {
+        return false;
+    }
+    auto path = static_files.root + "/" + std::string(name);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+    res.body.resize(size_t(st.st_size));
+    size_t got = 0;
+    while (got < res.body.size())
+    {
+        ssize_t n = pread(fd, res.body.data() + got, res.body.size() - got, off_t(got));
+        if (n <= 0)
+        {
+            break;
+        }
+        got += size_t(n);
+    }
+    close(fd);
+    res.body.resize(got);
+    res.content_type = static_content_type(name);
+    uint64_t mtime_ns = uint64_t(st.st_mtim.tv_sec) * 1000000000 + uint64_t(st.st_mtim.tv_nsec);
+    res.etag = fmt::format("\"{:x}-{:x}\"", got, mtime_ns);
+    res.cache_key = fmt::format("/static/{} {}", name, res.etag);
+    return true;
+}
+
+http_handler_response handle_http_request(std::string_view url, http_body_sink &body)
+{
+    http_handler_response res;
+    if (url.substr(0, 8) == "/static/")
+    {
+        auto name = url.substr(8);
+        name = name.substr(0, name.find('?'));
+        if (!serve_static_file(name, res))
+        {
+            res.status = 404;
+            res.body = "<html><body><h1>not found</h1></body></html>";
+        }
+        return res;
+    }
+    if (url == "/stream")
+    {
+        // produced piece by piece while the connection writes them out
+        res.body_source = [i = 0](std::string &piece) mutable
+        {
+            if (i < 16)
+            {
+                piece = fmt::format("<p>chunk {}</p>\n", i++);
+            }
+        };
+        return res;
+    }
+    if (url == "/debug/trace" && trace_opts.sample_every)
+    {
+        res.content_type = "application/json";
+        res.body = trace_chrome_json();
+        return res;
+    }
+    if (url == "/metrics")
+    {
+        res.content_type = "text/plain;charset=utf-8";
+        res.body = loop_metrics.metrics();
+        return res;
+    }
+    if (body.size() == 0)
+    {
+        res.body = "<html><body><h1>your request is empty</h1></body></html>";
+    }
+    else if (body.in_memory())
+    {
+        res.body = "<html><body><h1>your request body is:</h1><p>" + std::string(body.memory()) + "</p></body></html>";
+    }
+    else if (body.fd() != -1)
+    {
+        // echo a spilled body straight from its temp file
+        res.body_source = [fd = body.fd(), off = off_t(-1)](std::string &piece) mutable
+        {
+            if (off == -1)
+            {
+                piece = "<html><body><h1>your request body is:</h1><p>";
+                off = 0;
+                return;
+            }
+            if (off == -2)
+            {
+                return;
+            }
+            piece.resize(16 * 1024);
+            ssize_t n = CHECK_CALL(pread, fd, piece.data(), piece.size(), off);
+            piece.resize(n);
+            off += n;
+            if (n == 0)
+            {
+                piece = "</p></body></html>";
+                off = -2;
+            }
+        };
+    }
+    else
+    {
+        res.body = fmt::format("<html><body><h1>discarded {} bytes</h1></body></html>", body.size());
+    }
+    return res;
+}
+
+// response pipeline stage: negotiate Accept-Encoding and compress the body
+void encode_http_response(http_handler_response &res, std::string_view accept_encoding)
+{
+    // chunked bodies are produced piece by piece and go out as they are
+    if (res.body_source || !response_compressor::compressible_type(res.content_type))
+    {
+        return;
+    }
+    res.vary_encoding = true;
+    auto coding = negotiate_content_coding(accept_encoding);
+    std::string encoded;
+    coding = thread_response_compressor().encode(coding, res.body, res.cache_key, encoded);
+    if (coding != content_coding::identity)
+    {
+        res.body = std::move(encoded);
+        res.content_encoding = content_coding_name(coding);
+        if (!res.etag.empty())
+        {
+            // each encoding is a representation of its own
+            res.etag.insert(res.etag.size() - 1, fmt::format("-{}", res.content_encoding));
+        }
+    }
+}
+
+// handlers are reused across the connections of a loop; a parked connection holds none
+struct http_connection_pool
+{
+    std::vector<http_connection_handler *> m_free;
+    size_t m_max_free = 1024;
+
+    http_connection_handler *acquire();
+    void release(http_connection_handler *conn);
+    void reserve(size_t count);
+};
+
+thread_local http_connection_pool connection_pool;
+
+struct http_connection_acceptor;
+
+struct reload_options
+{
+    std::string handoff_path = "@co_http.handoff"; // '@' 开头为 abstract namespace
+    int handoff_timeout_ms = 5000;
+    uint64_t drain_timeout_ms = 10000; // 超时后仍空闲的 keep-alive 连接直接关闭
+};
+
+// a loop that is draining stops itself once its connections are gone
+struct loop_drainer
+{
+    event_loop *m_loop;
+    async_file m_timer;
+    char m_ticks[8];
+    uint64_t m_deadline_ns = 0;
+
+    void do_start(uint64_t timeout_ms);
+    void do_tick();
+};
+
+// a new server takes the listening sockets over from the running one; the
+// old one then stops accepting, answers what is in flight with
+// "Connection: close" and exits once its connections are gone
+struct graceful_reload
+{
+    reload_options m_opts;
+    std::vector<handoff_listener> m_inherited; // from the server we replaced
+    std::vector<handoff_listener> m_listening; // to hand on, one fd per socket
+    std::vector<std::pair<event_loop *, http_connection_acceptor *>> m_acceptors;
+    std::vector<std::unique_ptr<loop_drainer>> m_drainers;
+    event_loop *m_control_loop = nullptr;
+    async_file m_control; // where the next server asks for the listeners
+    address_resolver::address m_control_addr;
+    async_file m_peer;      // the next server, until it acknowledges the listeners
+    async_file m_ack_timer; // gives up on it after handoff_timeout_ms
+    char m_ack[1];
+    char m_ack_ticks[8];
+    bool m_waiting_ack = false;
+    std::atomic<bool> m_draining = false;
+
+    void take_over(reload_options opts);
+    int take_inherited(std::string const &name);
+    void do_start(std::vector<event_loop *> const &loops);
+    int _bind_control();
+    void _accept_control(int fd);
+    void _hand_over(int peer);
+    void _on_ack(bool ok);
+    void _handed_over(bool ok);
+    void _drain_loop(loop_drainer &drainer);
+};
+
+graceful_reload reload;
+
+struct http_connection_handler 
+{
+
+    async_file m_conn;
+    bytes_buffer m_buf{1024};
+    http_request_parser<> m_req_parse;
+    http_response_writer<> m_res_writer;
+    std::unique_ptr<http2_connection> m_h2;
+    std::unique_ptr<websocket_connection> m_ws;
+    callback<std::string &> m_body_source; // chunked response in progress
+    std::unique_ptr<http_body_sink> m_body_sink;
+    std::deque<std::shared_ptr<bytes_buffer const>> m_shared_out; // written before m_res_writer's bytes
+    size_t m_shared_sent = 0; // of m_shared_out.front(), when the socket filled up
+    size_t m_shared_bytes = 0; // all of m_shared_out, m_shared_sent included
+    bool m_dropped = false;   // fell behind the broadcasts, closing
+    size_t m_out_sent = 0;    // of m_res_writer's bytes, when the socket filled up
+    bool m_flush_pending = false;
+    bool m_write_blocked = false; // the flush resumes on EPOLLOUT
+    callback<> m_on_drained;      // the next read, stream piece or close, once the output is out
+    bool m_h2_pump_queued = false; // h2 body sources go on next iteration
+    bool m_close_queued = false;   // closing once the queued pump has run
+    bool m_keep_alive = true; // what the response in progress told the client
+    uint32_t m_trace_id = 0;      // sampled request being handled, 0 when not traced
+    uint32_t m_trace_done_id = 0; // answered, ends with the flush that writes it
+    uint64_t m_accept_ticks = 0;  // for the first request's trace
+    ip_key m_peer;
+
+    void do_start(event_loop &loop, int connfd, ip_key peer, tls_context *tls = nullptr){
+        m_conn = async_file::async_wrap(loop, connfd);
+        m_conn.enable_rx_timestamps();
+        m_peer = peer;
+        if (trace_opts.sample_every)
+        {
+            m_accept_ticks = trace_now();
+        }
+        TRACE_PHASE(accept, connfd, 0);
+        if (tls)
+        {
+            m_conn.m_tls = std::make_unique<tls_session>(*tls);
+        }
+        loop.apply_busy_poll(connfd);
+        _reset_parser();
+        do_read();
+    }
+
+    // a parked fd is readable again, it is still nonblocking and in epoll
+    void do_resume(event_loop &loop, int connfd)
+    {
+        m_conn = async_file::adopt(loop, connfd);
+        m_conn.m_rx_stamps = true; // still set on the socket
+        address_resolver::address addr;
+        if (getpeername(connfd, &addr.m_addr, &addr.m_addrlen) == 0)
+        {
+            m_peer = ip_key::from_sockaddr(&addr.m_addr);
+        }
+        _reset_parser();
+        do_read();
+    }
+
+    // back to the state of a fresh handler, keeping buffer capacity
+    void _recycle()
+    {
+        m_conn = {};
+        m_req_parse.reset();
+        m_res_writer.reset_state();
+        m_h2 = nullptr;
+        m_ws = nullptr;
+        m_body_source = nullptr;
+        m_body_sink = nullptr;
+        m_shared_out.clear();
+        m_shared_sent = 0;
+        m_shared_bytes = 0;
+        m_dropped = false;
+        m_out_sent = 0;
+        m_flush_pending = false;
+        m_write_blocked = false;
+        m_on_drained = nullptr;
+        m_h2_pump_queued = false;
+        m_close_queued = false;
+        m_keep_alive = true;
+        m_trace_id = 0;
+        m_trace_done_id = 0;
+        m_accept_ticks = 0;
+    }
+
+    void _reset_parser()
+    {
+        m_req_parse.reset();
+        m_req_parse.on_header_finished([this]
+                                       { _on_headers(); });
+        m_req_parse.on_body_chunk([this](std::string_view data)
+                                  { _on_body(data); });
+    }
+
+    void _on_headers()
+    {
+        TRACE_PHASE(header_complete, m_conn.m_fd, m_trace_id);
+        if (m_req_parse.m_content_length > body_limits.max_body_size)
+        {
+            throw http_status_error(413, "request body too large");
+        }
+        m_body_sink = make_body_sink(m_req_parse.url());
+    }
+
+    void _on_body(std::string_view data)
+    {
+        if (m_body_sink->size() + data.size() > body_limits.max_body_size)
+        {
+            throw http_status_error(413, "request body too large");
+        }
+        m_body_sink->write(data);
+    }
+
+    // plain HTTP/1.1 between requests: nothing to keep but the fd
+    // (a TLS session cannot be dropped, so TLS connections stay unparked,
+    // nor can a traced connection's accept time before its first request)
+    [[nodiscard]] bool _parkable() const
+    {
+        return !m_h2 && !m_ws && !m_body_source && !m_conn.m_tls && m_req_parse.idle() && !m_accept_ticks;
+    }
+
+    void do_read()
+    {
+        if (m_write_blocked)
+        {
+            // a client that does not read its responses gets nothing more parsed
+            m_on_drained = [this]
+            { do_read(); };
+            return;
+        }
+        LOG_DEBUG("reading fd {}", m_conn.m_fd);
+        callback<> on_idle = nullptr;
+        if (_parkable())
+        {
+            on_idle = [this]
+            { do_park(); };
+        }
+        m_conn.async_read(m_buf, [this](size_t n){
+            if(n==0){
+                //if eof is received
+                LOG_DEBUG("eof received from fd {}", m_conn.m_fd);
+                do_close();
+                return;
+            }
+            LOG_DEBUG("read {} bytes from fd {}: {}", n, m_conn.m_fd, std::string_view{m_buf.data(), n});
+            if(m_h2){
+                do_h2_chunk(m_buf.subspan(0,n));
+            }else if(m_ws){
+                do_ws_chunk(m_buf.subspan(0,n));
+            }else{
+                if (m_req_parse.idle())
+                {
+                    _trace_begin();
+                    if (!_admit_request(m_buf.subspan(0, n)))
+                    {
+                        return;
+                    }
+                }
+                do_chunk(m_buf.subspan(0,n));
+            } }, std::move(on_idle));
+    }
+
+    // first bytes of a request; decides whether it is sampled
+    void _trace_begin()
+    {
+        if (trace_opts.sample_every && !m_trace_id)
+        {
+            auto &ring = thread_trace_ring();
+            m_trace_id = ring.sample();
+            if (m_trace_id && m_accept_ticks)
+            {
+                ring.record(trace_phase::accept, m_trace_id, m_conn.m_fd, m_accept_ticks);
+            }
+        }
+        m_accept_ticks = 0;
+        TRACE_PHASE(first_byte, m_conn.m_fd, m_trace_id);
+    }
+
+    // the response is queued; the request's trace ends once it is written
+    void _trace_answered()
+    {
+        _trace_end(m_trace_done_id); // a pipelined predecessor not flushed yet
+        m_trace_done_id = m_trace_id;
+        m_trace_id = 0;
+    }
+
+    void _trace_end(uint32_t &id)
+    {
+        if (id)
+        {
+            thread_trace_ring().end(id, m_conn.m_fd);
+            id = 0;
+        }
+    }
+
+    void do_park()
+    {
+        // deferred like do_close, so the response is flushed first
+        m_conn.m_loop->defer([this]
+                             {
+            if (m_write_blocked)
+            {
+                m_on_drained = [this]
+                { do_read(); };
+                return;
+            }
+            m_conn.m_loop->park(m_conn.m_fd);
+            connection_pool.release(this); });
+    }
+
+    // first bytes of a request: shed or rate limit before parsing anything
+    bool _admit_request(bytes_view chunk)
+    {
+        uint64_t waited = 0; // in the socket queue, behind everything else the loop had to do
+        if (m_conn.m_rx_stamp_ns != 0)
+        {
+            uint64_t now = realtime_ns();
+            waited = now > m_conn.m_rx_stamp_ns ? now - m_conn.m_rx_stamp_ns : 0;
+        }
+        switch (admission.admit_request(m_peer, waited))
+        {
+        case admission_control::verdict::overloaded:
+            if (_lone_bodyless_request(chunk))
+            {
+                _trace_end(m_trace_id);
+                m_res_writer.buffer().append(http_response_overloaded_keep_alive);
+                _schedule_flush();
+                do_read();
+                return false;
+            }
+            do_reject(http_response_overloaded);
+            return false;
+        case admission_control::verdict::rate_limited:
+            do_reject(http_response_rate_limited);
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    // the read holds exactly one HTTP/1.1 request head, and nothing in it
+    // can make a body follow or ask for the connection to change; only then
+    // can a shed request be answered without closing the connection
+    static bool _lone_bodyless_request(bytes_view chunk)
+    {
+        std::string_view text(chunk.data(), chunk.size());
+        size_t end = text.find("\r\n\r\n");
+        size_t line_end = text.find("\r\n");
+        if (end == std::string_view::npos || end + 4 != text.size() ||
+            text.substr(0, line_end).substr(std::max<size_t>(line_end, 8) - 8) != "HTTP/1.1")
+        {
+            return false;
+        }
+        while (line_end < end)
+        {
+            size_t next = text.find("\r\n", line_end + 2);
+            auto line = text.substr(line_end + 2, next - line_end - 2);
+            auto name = line.substr(0, line.find(':'));
+            for (auto unsafe : {"content-length", "transfer-encoding", "connection", "upgrade"})
+            {
+                if (_iequals(name, unsafe))
+                {
+                    return false;
+                }
+            }
+            line_end = next;
+        }
+        return true;
+    }
+
+    void do_reject(std::string_view response)
+    {
+        m_res_writer.buffer().append(response);
+        _schedule_flush();
+        do_close();
+    }
+
+    void do_chunk(std::string_view chunk)
+    {
+        try
+        {
+            m_req_parse.push_chunk(chunk);
+        }
+        catch (http_status_error const &e)
+        {
+            LOG_DEBUG("rejected request: {}", e.what());
+            do_error(e.m_status);
+            return;
+        }
+        catch (std::exception const &e)
+        {
+            LOG_DEBUG("bad request: {}", e.what());
+            do_error(400);
+            return;
+        }
+        if (!m_req_parse.request_finished())
+        {
+            do_read();
+            return;
+        }
+        TRACE_PHASE(body_complete, m_conn.m_fd, m_trace_id);
+        if (m_req_parse.method() == "PRI" && m_req_parse.http_version() == "HTTP/2.0")
+        {
+            _trace_answered(); // HTTP/2 streams are not traced
+            do_h2_start();
+        }
+        else if (_wants_websocket_upgrade())
+        {
+            _trace_answered();
+            do_ws_upgrade();
+        }
+        else if (_wants_h2c_upgrade())
+        {
+            _trace_answered();
+            do_h2_upgrade();
+        }
+        else
+        {
+            do_write();
+        }
+    }
+
+    void do_write()
+    {
+        LOG_DEBUG("request on fd {}: {}", m_conn.m_fd, m_req_parse.headline());
+        TRACE_PHASE(handler_start, m_conn.m_fd, m_trace_id);
+        auto res = handle_http_request(m_req_parse.url(), *m_body_sink);
+        encode_http_response(res, m_req_parse.headers().get(http_header_id::accept_encoding));
+        TRACE_PHASE(handler_end, m_conn.m_fd, m_trace_id);
+
+        // responses are appended and flushed once at the end of the loop iteration
+        auto &res_writer = m_res_writer;
+        res_writer.begin_header(res.status);
+        res_writer.write_header("Server", "co_http");
+        res_writer.write_header("Content-Type", res.content_type);
+        // a message with both lengths may have been framed differently by
+        // whoever forwarded it, so nothing after it on this connection is
+        // trusted (RFC 9112 6.3)
+        auto &req_headers = m_req_parse.headers();
+        m_keep_alive = !reload.m_draining &&
+                       !(req_headers.has(http_header_id::transfer_encoding) &&
+                         req_headers.has(http_header_id::content_length));
+        res_writer.write_header("Connection", m_keep_alive ? "keep-alive" : "close");
+        if (!res.content_encoding.empty())
+        {
+            res_writer.write_header("Content-Encoding", res.content_encoding);
+        }
+        if (res.vary_encoding)
+        {
+            res_writer.write_header("Vary", "Accept-Encoding");
+        }
+        if (!res.etag.empty())
+        {
+            res_writer.write_header("ETag", res.etag);
+        }
+        if (res.body_source)
+        {
+            res_writer.write_header("Transfer-Encoding", "chunked");
+            res_writer.end_header();
+            _schedule_flush();
+            m_body_source = std::move(res.body_source);
+            do_stream();
+            return;
+        }
+        res_writer.write_header("Content-length", std::to_string(res.body.size()));
+        res_writer.end_header();
+        res_writer.write_body(res.body);
+        _schedule_flush();
+        _next_request();
+    }
+
+    // one piece per loop iteration, each flushed before the next is produced
+    void do_stream()
+    {
+        if (m_write_blocked)
+        {
+            m_on_drained = [this]
+            { do_stream(); };
+            return;
+        }
+        std::string piece;
+        m_body_source(multishot_call, piece);
+        if (piece.empty())
+        {
+            m_body_source = nullptr;
+            m_res_writer.end_chunked_body();
+            _schedule_flush();
+            _next_request();
+            return;
+        }
+        m_res_writer.write_chunk(piece);
+        _schedule_flush();
+        m_conn.m_loop->requeue([this]
+                               { do_stream(); });
+    }
+
+    void do_error(int status)
+    {
+        m_res_writer.begin_header(status);
+        m_res_writer.write_header("Server", "co_http");
+        m_res_writer.write_header("Connection", "close");
+        m_res_writer.write_header("Content-length", "0");
+        m_res_writer.end_header();
+        _schedule_flush();
+        do_close();
+    }
+
+    void _next_request()
+    {
+        LOG_DEBUG("handled request on fd {}", m_conn.m_fd);
+        _trace_answered();
+        if (!m_keep_alive)
+        {
+            do_close(); // the client reconnects, to the server that replaced this one
+            return;
+        }
+        std::string leftover = std::move(m_req_parse.leftover());
+        m_body_sink = nullptr;
+        _reset_parser();
+        if (leftover.empty())
+        {
+            do_read();
+        }
+        else
+        {
+            _trace_begin();
+            do_chunk(leftover);
+        }
+    }
+
+    static bool _iequals(std::string_view a, std::string_view b)
+    {
+        return a.size() == b.size() &&
+               std::equal(a.begin(), a.end(), b.begin(), [](char x, char y)
+                          { return tolower((unsigned char)x) == tolower((unsigned char)y); });
+    }
+
+    bool _wants_websocket_upgrade()
+    {
+        auto &headers = m_req_parse.headers();
+        return _iequals(headers.get(http_header_id::upgrade), "websocket") &&
+               headers.has(http_header_id::sec_websocket_key) &&
+               headers.get(http_header_id::sec_websocket_version) == "13" && m_req_parse.method() == "GET";
+    }
+
+    void do_ws_upgrade()
+    {
+        auto &headers = m_req_parse.headers();
+        m_res_writer._begin_header("HTTP/1.1", "101", "Switching Protocols");
+        m_res_writer.write_header("Upgrade", "websocket");
+        m_res_writer.write_header("Connection", "Upgrade");
+        m_res_writer.write_header("Sec-WebSocket-Accept", websocket_accept_key(headers.get(http_header_id::sec_websocket_key)));
+        m_res_writer.end_header();
+        _schedule_flush();
+
+        std::string rest = std::move(m_req_parse.leftover());
+        _reset_parser();
+        m_ws = std::make_unique<websocket_connection>(
+            m_res_writer.buffer(), [this](websocket_connection &, websocket_opcode opcode, std::string_view payload)
+            { ws_hub.broadcast(*m_conn.m_loop, opcode, payload); });
+        ws_hub.join(this);
+        do_ws_chunk(bytes_view{rest.data(), rest.size()});
+    }
+
+    void do_ws_chunk(bytes_view chunk)
+    {
+        m_ws->push_chunk(chunk);
+        if (m_res_writer.buffer().size())
+        {
+            _schedule_flush();
+        }
+        if (m_ws->wants_close())
+        {
+            do_close();
+            return;
+        }
+        do_read();
+    }
+
+    // queue a frame shared with other connections, keeping the output order;
+    // past ws_limits.max_queued_bytes unsent the connection is dropped instead
+    void queue_shared(std::shared_ptr<bytes_buffer const> frame)
+    {
+        if (m_dropped)
+        {
+            return;
+        }
+        auto &buffer = m_res_writer.buffer();
+        size_t unsent = m_shared_bytes - m_shared_sent + buffer.size() - m_out_sent;
+        if (unsent + frame->size() > ws_limits.max_queued_bytes)
+        {
+            _drop_slow();
+            return;
+        }
+        if (buffer.size() > m_out_sent)
+        {
+            auto rest = std::make_shared<bytes_buffer>();
+            rest->append(std::as_const(buffer).subspan(m_out_sent, buffer.size() - m_out_sent));
+            m_shared_bytes += rest->size();
+            m_shared_out.push_back(std::move(rest));
+        }
+        buffer.clear();
+        m_out_sent = 0;
+        m_shared_bytes += frame->size();
+        m_shared_out.push_back(std::move(frame));
+        _schedule_flush();
+    }
+
+    // what was queued goes, and shutdown() turns the blocked write into
+    // EPIPE and the next read into eof, so the usual close path runs without
+    // waiting on a client that does not read
+    void _drop_slow()
+    {
+        LOG_DEBUG("dropping websocket fd {}: more than {} bytes queued", m_conn.m_fd, ws_limits.max_queued_bytes);
+        m_dropped = true;
+        ++ws_hub.m_dropped;
+        m_shared_out.clear();
+        m_shared_sent = 0;
+        m_shared_bytes = 0;
+        m_res_writer.buffer().clear();
+        m_out_sent = 0;
+        shutdown(m_conn.m_fd, SHUT_RDWR);
+    }
+
+    bool _wants_h2c_upgrade()
+    {
+        auto &headers = m_req_parse.headers();
+        return headers.get(http_header_id::upgrade) == "h2c" &&
+               headers.has(http_header_id::http2_settings) && m_body_sink->size() == 0;
+    }
+
+    void _make_h2()
+    {
+        m_h2 = std::make_unique<http2_connection>(
+            m_res_writer.buffer(), [this](http2_connection &h2, http2_request &req)
+            {
+                // m_on_open gave it the sink its DATA frames went into,
+                // within m_max_body_size
+                auto &body = static_cast<http_body_sink &>(*req.m_body);
+                auto res = handle_http_request(req.path(), body);
+                encode_http_response(res, req.header("accept-encoding"));
+                hpack_header_list headers = {{"server", "co_http"},
+                                             {"content-type", res.content_type}};
+                if (!res.body_source)
+                {
+                    headers.emplace_back("content-length", std::to_string(res.body.size()));
+                }
+                if (!res.content_encoding.empty())
+                {
+                    headers.emplace_back("content-encoding", res.content_encoding);
+                }
+                if (res.vary_encoding)
+                {
+                    headers.emplace_back("vary", "accept-encoding");
+                }
+                if (!res.etag.empty())
+                {
+                    headers.emplace_back("etag", res.etag);
+                }
+                if (res.body_source)
+                {
+                    // DATA frames as the windows open, like do_stream's chunks;
+                    // the source may read from the body, which it keeps open
+                    h2.submit_response(req.m_stream_id, res.status, headers,
+                                       [source = std::move(res.body_source),
+                                        keep = std::move(req.m_body)](std::string &piece) mutable
+                                       { source(multishot_call, piece); });
+                    return;
+                }
+                h2.submit_response(req.m_stream_id, res.status, headers, std::move(res.body)); });
+        m_h2->m_on_open = [](http2_request &req)
+        { req.m_body = make_body_sink(req.path()); };
+        m_h2->m_max_body_size = body_limits.max_body_size;
+    }
+
+    // prior knowledge: the HTTP/1.1 parser has consumed "PRI * HTTP/2.0\r\n\r\n"
+    void do_h2_start()
+    {
+        std::string rest = std::move(m_req_parse.leftover());
+        _reset_parser();
+        _make_h2();
+        m_h2->start();
+        do_h2_chunk(std::string(http2_connection::preface.substr(0, 18)) + rest);
+    }
+
+    void do_h2_upgrade()
+    {
+        auto &headers = m_req_parse.headers();
+        http2_request req;
+        req.m_headers = {{":method", m_req_parse.method()},
+                         {":scheme", "http"},
+                         {":path", m_req_parse.url()},
+                         {":authority", std::string(headers.get(http_header_id::host))}};
+        std::string settings;
+        try
+        {
+            settings = http2_decode_settings_header(headers.get(http_header_id::http2_settings));
+        }
+        catch (http2_error const &)
+        {
+            do_write(); // ignore a malformed upgrade, answer over HTTP/1.1
+            return;
+        }
+
+        m_res_writer._begin_header("HTTP/1.1", "101", "Switching Protocols");
+        m_res_writer.write_header("Connection", "Upgrade");
+        m_res_writer.write_header("Upgrade", "h2c");
+        m_res_writer.end_header();
+
+        std::string rest = std::move(m_req_parse.leftover());
+        _reset_parser();
+        _make_h2();
+        m_h2->start_upgraded(std::move(req), settings);
+        do_h2_chunk(rest);
+    }
+
+    void do_h2_chunk(std::string_view chunk)
+    {
+        m_h2->push_chunk(chunk);
+        if (reload.m_draining)
+        {
+            m_h2->go_away();
+        }
+        if (m_res_writer.buffer().size())
+        {
+            _schedule_flush();
+        }
+        if (m_h2->wants_close())
+        {
+            do_close();
+            return;
+        }
+        do_read();
+    }
+
+    // after a flush: body sources held back by the output high water mark
+    // continue next iteration, one batch per iteration as in do_stream
+    void _queue_h2_pump()
+    {
+        if (!m_h2 || !m_h2->m_output_held || m_h2_pump_queued || m_close_queued)
+        {
+            return;
+        }
+        m_h2_pump_queued = true;
+        m_conn.m_loop->requeue([this]
+                               { do_h2_pump(); });
+    }
+
+    void do_h2_pump()
+    {
+        m_h2_pump_queued = false;
+        if (m_close_queued)
+        {
+            _close_flushed();
+            return;
+        }
+        m_h2->pump();
+        if (m_res_writer.buffer().size())
+        {
+            _schedule_flush();
+        }
+    }
+
+    void _schedule_flush()
+    {
+        if (m_flush_pending)
+        {
+            return;
+        }
+        m_flush_pending = true;
+        m_conn.m_loop->defer([this]
+                             { do_flush(); });
+    }
+
+    // deferred, and never blocks: what the socket does not take waits for
+    // EPOLLOUT, with reads, stream pieces and the close held back meanwhile
+    void do_flush()
+    {
+        m_flush_pending = false;
+        if (m_write_blocked)
+        {
+            return; // the writable callback flushes what was queued meanwhile
+        }
+        uint32_t trace_id = m_trace_done_id ? m_trace_done_id : m_trace_id;
+        TRACE_PHASE(write_begin, m_conn.m_fd, trace_id);
+        if (!_write_out())
+        {
+            m_write_blocked = true;
+            m_conn.wait_writable([this]
+                                 {
+                m_write_blocked = false;
+                _schedule_flush(); });
+            return;
+        }
+        m_out_sent = 0;
+        m_res_writer.reset_state();
+        TRACE_PHASE(write_end, m_conn.m_fd, trace_id);
+        _trace_end(m_trace_done_id);
+        _queue_h2_pump();
+        if (m_on_drained)
+        {
+            auto next = std::move(m_on_drained);
+            next();
+        }
+    }
+
+    // false once the socket is full
+    bool _write_out()
+    {
+        if (!_write_shared())
+        {
+            return false;
+        }
+        auto &buffer = m_res_writer.buffer();
+        while (m_out_sent < buffer.size())
+        {
+            ssize_t n = m_conn.try_write(buffer.subspan(m_out_sent, buffer.size() - m_out_sent));
+            if (n == -1)
+            {
+                return false;
+            }
+            m_out_sent += size_t(n);
+        }
+        return m_conn.flush_output();
+    }
+
+    bool _write_shared()
+    {
+        while (!m_shared_out.empty())
+        {
+            struct iovec iov[64];
+            int iovcnt = 0;
+            for (auto it = m_shared_out.begin(); it != m_shared_out.end() && iovcnt < 64; ++it)
+            {
+                size_t off = iovcnt == 0 ? m_shared_sent : 0;
+                iov[iovcnt].iov_base = const_cast<char *>((*it)->data() + off);
+                iov[iovcnt].iov_len = (*it)->size() - off;
+                ++iovcnt;
+            }
+            ssize_t ret = m_conn.try_writev(iov, iovcnt);
+            if (ret == -1)
+            {
+                return false;
+            }
+            size_t n = size_t(ret);
+            while (!m_shared_out.empty() && n >= m_shared_out.front()->size() - m_shared_sent)
+            {
+                n -= m_shared_out.front()->size() - m_shared_sent;
+                m_shared_bytes -= m_shared_out.front()->size();
+                m_shared_sent = 0;
+                m_shared_out.pop_front();
+            }
+            m_shared_sent += n;
+        }
+        return true;
+    }
+
+    void do_close()
+    {
+        if (m_ws)
+        {
+            ws_hub.leave(this);
+        }
+        // deferred tasks run in order, so a pending flush goes out first
+        m_conn.m_loop->defer([this]
+                             { _close_flushed(); });
+    }
+
+    void _close_flushed()
+    {
+        if (m_write_blocked)
+        {
+            m_on_drained = [this]
+            { _close_flushed(); };
+            return;
+        }
+        if (m_h2_pump_queued)
+        {
+            m_close_queued = true; // the pump holds this, it closes instead
+            return;
+        }
+        TRACE_PHASE(close, m_conn.m_fd, m_trace_id ? m_trace_id : m_trace_done_id);
+        _trace_end(m_trace_done_id);
+        _trace_end(m_trace_id);
+        m_conn.close_file();
+        connection_pool.release(this);
+        admission.closed();
+    }
+
+
+};
+
+http_connection_handler *http_connection_pool::acquire()
+{
+    if (m_free.empty())
+    {
+        return new http_connection_handler{};
+    }
+    auto conn = m_free.back();
+    m_free.pop_back();
+    return conn;
+}
+
+// called on the loop's thread, so first touch puts the handlers on its node
+void http_connection_pool::reserve(size_t count)
+{
+    while (m_free.size() < std::min(count, m_max_free))
+    {
+        m_free.push_back(new http_connection_handler{});
+    }
+}
+
+void http_connection_pool::release(http_connection_handler *conn)
+{
+    if (m_free.size() >= m_max_free)
+    {
+        delete conn;
+        return;
+    }
+    conn->_recycle();
+    m_free.push_back(conn);
+}
+
+// which cpu each loop is pinned to; set up before the loops start, read-only after
+struct loop_placement
+{
+    std::vector<event_loop *> m_loops;
+    std::vector<int> m_cpus; // of loop i, empty when loops are not pinned
+    size_t m_prealloc_handlers = 256; // per pinned loop
+
+    // the first loop pinned to cpu, if any
+    event_loop *loop_on(int cpu) const
+    {
+        for (size_t i = 0; i < m_cpus.size(); ++i)
+        {
+            if (m_cpus[i] == cpu)
+            {
+                return m_loops[i];
+            }
+        }
+        return nullptr;
+    }
+};
+
+loop_placement placement;
+
+void websocket_hub::broadcast(event_loop &here, websocket_opcode opcode, std::string_view payload)
+{
+    auto frame = websocket_make_shared_frame(opcode, payload);
+    deliver(frame);
+    for (auto *loop : placement.m_loops)
+    {
+        if (loop != &here)
+        {
+            // run on that loop's thread, where ws_hub is that loop's hub
+            loop->post([frame]
+                       { ws_hub.deliver(frame); });
+        }
+    }
+}
+
+// a member too far behind is dropped by queue_shared; it leaves m_members
+// only once its close runs, so this loop is not disturbed
+void websocket_hub::deliver(std::shared_ptr<bytes_buffer const> const &frame)
+{
+    for (auto *conn : m_members)
+    {
+        if (!conn->m_ws->m_close_sent)
+        {
+            conn->queue_shared(frame);
+        }
+    }
+}
+
+struct http_connection_acceptor{
+    async_file m_listen;
+    address_resolver::address m_addr;
+    tls_context *m_tls = nullptr;
+    bool m_stopped = false;
+    int m_cpu = -1;             // of this acceptor's loop
+    bool m_incoming_cpu = false; // hand connections to the loop on their softirq cpu
+
+    // listenfd is bound and listening (see open_listener), and this acceptor's
+    // own: loops sharing a socket each get a dup of it
+    void do_start(event_loop &loop, int listenfd, tls_context *tls = nullptr)
+    {
+        m_tls = tls;
+        m_listen = async_file::async_wrap(loop, listenfd);
+        loop.apply_busy_poll(listenfd);
+
+        do_accept();
+    }
+
+    // the loop pinned to the cpu that received connfd's packets, if that is
+    // not this one
+    event_loop *_incoming_loop(int connfd) const
+    {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1 || cpu == m_cpu)
+        {
+            return nullptr;
+        }
+        return placement.loop_on(cpu);
+    }
+
+    // on the thread of the loop that serves connfd
+    static void start_connection(event_loop &loop, int connfd, ip_key peer, tls_context *tls)
+    {
+        if (!admission.try_open())
+        {
+            _refuse(connfd, http_response_overloaded, tls);
+            return;
+        }
+        if (admission.admit_connection(peer) != admission_control::verdict::admit)
+        {
+            admission.closed();
+            _refuse(connfd, http_response_rate_limited, tls);
+            return;
+        }
+        auto conn_handler = connection_pool.acquire();
+        conn_handler->do_start(loop, connfd, peer, tls);
+    }
+
+    // a TLS peer would only see a bad record, it just gets the close
+    static void _refuse(int connfd, std::string_view response, tls_context *tls)
+    {
+        if (!tls)
+        {
+            (void)send(connfd, response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        close(connfd);
+    }
+
+    // the socket lives on in the server that took it over
+    void do_stop()
+    {
+        m_stopped = true;
+        m_listen.close_file();
+    }
+
+    void do_accept(){
+        //fmt::println("waiting for accept...");
+        if (m_stopped)
+        {
+            return;
+        }
+        if (admission.m_conns.full())
+        {
+            // new connections queue in the listen backlog until one closes
+            ++admission.m_stats.m_accept_pauses;
+            admission.m_conns.wait([this, loop = m_listen.m_loop]
+                                   { loop->post([this]
+                                                { do_accept(); }); });
+            return;
+        }
+        m_listen.async_accept(m_addr, [this](int connfd){
+            LOG_DEBUG("accepted fd {}", connfd);
+            auto peer = ip_key::from_sockaddr(&m_addr.m_addr);
+            event_loop *owner = m_incoming_cpu ? _incoming_loop(connfd) : nullptr;
+            if (owner)
+            {
+                // the cap is shared by every loop; the owner takes the slot
+                // (or refuses the connection) when start_connection runs there
+                owner->post([owner, connfd, peer, tls = m_tls]
+                            { start_connection(*owner, connfd, peer, tls); });
+            }
+            else
+            {
+                start_connection(*m_listen.m_loop, connfd, peer, m_tls);
+            }
+
+            do_accept();
+        });
+    }
+};
+
+void graceful_reload::take_over(reload_options opts)
+{
+    m_opts = std::move(opts);
+    m_inherited = handoff_take_over(m_opts.handoff_path, m_opts.handoff_timeout_ms);
+    for (auto &l : m_inherited)
+    {
+        fmt::println("inherited listener {} (fd {})", l.m_name, l.m_fd);
+    }
+}
+
+int graceful_reload::take_inherited(std::string const &name)
+{
+    for (auto it = m_inherited.begin(); it != m_inherited.end(); ++it)
+    {
+        if (it->m_name == name)
+        {
+            int fd = it->m_fd;
+            m_inherited.erase(it);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// after the listeners are open, so what this server will hand on is known
+void graceful_reload::do_start(std::vector<event_loop *> const &loops)
+{
+    for (auto &l : m_inherited)
+    {
+        fmt::println("listener {} is no longer configured, closing it", l.m_name);
+        close(l.m_fd);
+    }
+    m_inherited.clear();
+    for (auto loop : loops)
+    {
+        m_drainers.push_back(std::make_unique<loop_drainer>());
+        m_drainers.back()->m_loop = loop;
+    }
+    m_control_loop = loops.front();
+    int fd = _bind_control();
+    m_control_loop->post([this, fd]
+                         { _accept_control(fd); });
+}
+
+int graceful_reload::_bind_control()
+{
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(m_opts.handoff_path, addr);
+    if (m_opts.handoff_path[0] != '@')
+    {
+        unlink(m_opts.handoff_path.c_str());
+    }
+    int fd = CHECK_CALL(socket, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK_CALL(bind, fd, reinterpret_cast<struct sockaddr *>(&addr), len);
+    CHECK_CALL(listen, fd, 4);
+    return fd;
+}
+
+void graceful_reload::_accept_control(int fd)
+{
+    m_control = async_file::async_wrap(*m_control_loop, fd);
+    m_control.async_accept(m_control_addr, [this](int peer)
+                           { _hand_over(peer); });
+}
+
+// the acknowledgement is waited for in the loop like any read, raced
+// against a timerfd, so the connections keep being served meanwhile
+void graceful_reload::_hand_over(int peer)
+{
+    m_control.close_file(); // the new server listens on the same name
+    m_peer = async_file::async_wrap(*m_control_loop, peer);
+    try
+    {
+        handoff_send(peer, m_listening);
+    }
+    catch (std::system_error const &e)
+    {
+        fmt::println(stderr, "handoff: {}", e.what());
+        m_control_loop->defer([this]
+                              { _handed_over(false); });
+        return;
+    }
+    int ms = m_opts.handoff_timeout_ms;
+    int tfd = CHECK_CALL(timerfd_create, CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec its = {{0, 0}, {ms / 1000, (ms % 1000) * 1000000L}};
+    CHECK_CALL(timerfd_settime, tfd, 0, &its, nullptr);
+    m_ack_timer = async_file::async_wrap(*m_control_loop, tfd);
+    m_waiting_ack = true;
+    m_ack_timer.async_read({m_ack_ticks, sizeof(m_ack_ticks)}, [this](ssize_t)
+                           { _on_ack(false); });
+    m_peer.async_read({m_ack, sizeof(m_ack)}, [this](ssize_t n)
+                      { _on_ack(n == 1); });
+}
+
+// whichever comes first; the other may have its event in this iteration
+// too, so the files are closed once it is over
+void graceful_reload::_on_ack(bool ok)
+{
+    if (!m_waiting_ack)
+    {
+        return;
+    }
+    m_waiting_ack = false;
+    m_control_loop->defer([this, ok]
+                          {
+        m_ack_timer.close_file();
+        _handed_over(ok); });
+}
+
+void graceful_reload::_handed_over(bool ok)
+{
+    m_peer.close_file();
+    if (!ok)
+    {
+        fmt::println("handoff failed, still serving");
+        _accept_control(_bind_control());
+        return;
+    }
+    fmt::println("handed {} listeners over, draining", m_listening.size());
+    m_draining = true;
+    // posted, also to this loop: events for the listening fds may still be
+    // in the current iteration
+    for (auto &drainer : m_drainers)
+    {
+        drainer->m_loop->post([this, d = drainer.get()]
+                              { _drain_loop(*d); });
+    }
+}
+
+// on the loop's own thread
+void graceful_reload::_drain_loop(loop_drainer &drainer)
+{
+    for (auto &[loop, acceptor] : m_acceptors)
+    {
+        if (loop == drainer.m_loop)
+        {
+            acceptor->do_stop();
+        }
+    }
+    for (auto *conn : ws_hub.m_members)
+    {
+        conn->m_ws->close(websocket_close_code::going_away);
+        conn->_schedule_flush();
+    }
+    // parked keep-alives are idle for sure: nothing was sent that is not
+    // answered, so they go now rather than at the deadline
+    drainer.m_loop->defer([loop = drainer.m_loop]
+                          {
+        for (size_t n = loop->close_parked(); n > 0; --n)
+        {
+            admission.closed();
+        } });
+    drainer.do_start(m_opts.drain_timeout_ms);
+}
+
+// connections with a request in progress answer it with "Connection: close";
+// idle ones that could not be parked (TLS, traced) get it on their next
+// request, or are closed with the process once the deadline passes
+void loop_drainer::do_start(uint64_t timeout_ms)
+{
+    m_deadline_ns = monotonic_ns() + timeout_ms * 1000000;
+    int tfd = CHECK_CALL(timerfd_create, CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec its = {{0, 100000000}, {0, 100000000}};
+    CHECK_CALL(timerfd_settime, tfd, 0, &its, nullptr);
+    m_timer = async_file::async_wrap(*m_loop, tfd);
+    do_tick();
+}
+
+void loop_drainer::do_tick()
+{
+    m_timer.async_read({m_ticks, sizeof(m_ticks)}, [this](ssize_t)
+                       {
+        size_t open = admission.m_open;
+        if (open == 0 || monotonic_ns() >= m_deadline_ns)
+        {
+            fmt::println("drained, {} connections still open", open);
+            m_loop->stop();
+            return;
+        }
+        do_tick(); });
+}
+
+void _set_socket_option(int fd, int level, int name, int value, char const *what)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == -1)
+    {
+        fmt::println(stderr, "{}: {}", what, strerror(errno));
+    }
+}
+
+// v6only: the name also resolved to IPv4, so [::] must leave 0.0.0.0 alone
+int _bind_tcp(listener_config const &l, address_resolver::address_resolved_entry const &entry, bool v6only)
+{
+    int fd = entry.create_socket();
+    if (l.m_reuseaddr)
+    {
+        _set_socket_option(fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+    }
+    if (l.m_reuseport)
+    {
+        _set_socket_option(fd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+    }
+    if (entry.m_curr->ai_family == AF_INET6 && (l.m_v6only != -1 || v6only))
+    {
+        _set_socket_option(fd, IPPROTO_IPV6, IPV6_V6ONLY, l.m_v6only != -1 ? l.m_v6only : 1, "IPV6_V6ONLY");
+    }
+    if (l.m_rcvbuf)
+    {
+        _set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, l.m_rcvbuf, "SO_RCVBUF");
+    }
+    if (l.m_sndbuf)
+    {
+        _set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, l.m_sndbuf, "SO_SNDBUF");
+    }
+    if (l.m_nodelay)
+    {
+        // accepted sockets inherit it
+        _set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    auto addr = entry.get_address();
+    CHECK_CALL(bind, fd, addr.m_addr, addr.m_addrlen);
+    CHECK_CALL(listen, fd, l.m_backlog);
+    if (l.m_defer_accept)
+    {
+        _set_socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, l.m_defer_accept, "TCP_DEFER_ACCEPT");
+    }
+    if (l.m_fastopen)
+    {
+        _set_socket_option(fd, IPPROTO_TCP, TCP_FASTOPEN, l.m_fastopen, "TCP_FASTOPEN");
+    }
+    return fd;
+}
+
+int _bind_unix(listener_config const &l)
+{
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(l.m_path, addr);
+    bool abstract = l.m_path[0] == '@';
+    struct stat st;
+    if (!abstract && stat(l.m_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        // left by a server that is gone; a running one hands its socket over
+        unlink(l.m_path.c_str());
+    }
+    int fd = CHECK_CALL(socket, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK_CALL(bind, fd, reinterpret_cast<struct sockaddr *>(&addr), len);
+    if (!abstract && l.m_mode != -1)
+    {
+        CHECK_CALL(chmod, l.m_path.c_str(), mode_t(l.m_mode));
+    }
+    CHECK_CALL(listen, fd, l.m_backlog);
+    return fd;
+}
+
+// one socket per resolved address, named like "tcp [::1]:8080" or
+// "unix @co_http"; inherited sockets are bound already
+std::vector<handoff_listener> open_listener(listener_config const &l)
+{
+    std::vector<handoff_listener> sockets;
+    if (l.m_kind == listener_kind::unix_stream)
+    {
+        std::string name = "unix " + l.m_path;
+        int fd = reload.take_inherited(name);
+        sockets.push_back({name, fd != -1 ? fd : _bind_unix(l)});
+        return sockets;
+    }
+    struct addrinfo hints = {};
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    address_resolver resolver;
+    auto entry = resolver.resolve(l.m_host, l.m_port, &hints);
+    bool several = entry.m_curr->ai_next != nullptr;
+    do
+    {
+        std::string name = "tcp " + entry.describe();
+        int fd = reload.take_inherited(name);
+        sockets.push_back({name, fd != -1 ? fd : _bind_tcp(l, entry, several)});
+    } while (entry.next_entry());
+    return sockets;
+}
+
+// SIGUSR2 writes the trace rings to a file
+struct trace_signal_dumper
+{
+    async_file m_signals;
+    struct signalfd_siginfo m_info;
+
+    void do_start(event_loop &loop, int signal_fd)
+    {
+        m_signals = async_file::async_wrap(loop, signal_fd);
+        do_wait();
+    }
+
+    void do_wait()
+    {
+        m_signals.async_read({reinterpret_cast<char *>(&m_info), sizeof(m_info)}, [this](ssize_t)
+                             {
+            auto path = trace_dump_file();
+            fmt::println("trace: {}", path.empty() ? std::string("dump failed: ") + strerror(errno) : "written to " + path);
+            do_wait(); });
+    }
+};
+
+// a loop that throws takes the server down, as the single loop used to
+void _run_loop(event_loop &loop)
+{
+    try
+    {
+        loop.run();
+    }
+    catch (std::exception const &e)
+    {
+        fmt::println(stderr, "error:{}", e.what());
+        std::_Exit(1);
+    }
+}
+
+// first task of every loop, on its own thread: everything the loop
+// allocates later is touched here first
+void _place_loop(size_t index, event_loop &loop)
+{
+    loop.on_parked([&loop](int connfd)
+                   { connection_pool.acquire()->do_resume(loop, connfd); });
+    _register_loop_metrics(index);
+    if (placement.m_cpus.empty())
+    {
+        return;
+    }
+    int cpu = placement.m_cpus[index];
+    bool pinned = pin_current_thread(cpu);
+    int pin_errno = errno;
+    int node = cpu_numa_node(cpu);
+    // on a single node the default policy is already local
+    bool local = numa_node_count() > 1 && prefer_numa_node(node);
+    connection_pool.reserve(placement.m_prealloc_handlers);
+    fmt::println("placement: loop {} on cpu {} ({}), running on cpu {}, numa node {}{}, {} handlers preallocated",
+                 index, cpu, pinned ? "pinned" : strerror(pin_errno), sched_getcpu(), node,
+                 local ? " (memory preferred there)" : "", connection_pool.m_free.size());
+}
+
+void server(server_config const &cfg)
+{
+    log_verbosity = cfg.m_log;
+    event_loop_options opts;
+    opts.max_events = cfg.m_max_events;
+    opts.work_budget = cfg.m_work_budget;
+    opts.busy_poll_spins = cfg.m_busy_poll_spins;
+    opts.busy_poll_usec = cfg.m_busy_poll_usec;
+    static_files.root = cfg.m_static_dir;
+    // before any loop thread builds its admission_control from them
+    admission_opts.max_connections = cfg.m_max_connections;
+    admission_opts.shed_target_ns = uint64_t(cfg.m_shed_target_ms) * 1000000;
+    admission_opts.per_ip_rate = cfg.m_per_ip_rate;
+    admission_opts.per_ip_burst = cfg.m_per_ip_burst ? cfg.m_per_ip_burst : cfg.m_per_ip_rate;
+    admission_state.m_conns.m_max = cfg.m_max_connections;
+    admission_state.m_buckets.set_rate(admission_opts.per_ip_rate, admission_opts.per_ip_burst);
+    std::vector<std::unique_ptr<event_loop>> loops;
+    std::vector<event_loop *> loop_ptrs;
+    for (size_t i = 0; i < cfg.m_loops; ++i)
+    {
+        loops.push_back(std::make_unique<event_loop>(opts));
+        loop_ptrs.push_back(loops.back().get());
+    }
+    placement.m_loops = loop_ptrs;
+    placement.m_cpus = loop_cpus(cfg);
+    fmt::println("placement: {} loops, {}, {} numa nodes", loops.size(),
+                 cfg.m_cpus.empty() ? "not pinned" : "cpus " + cfg.m_cpus, numa_node_count());
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        loops[i]->post([i, &loop = *loops[i]]
+                       { _place_loop(i, loop); });
+    }
+
+    trace_opts.sample_every = cfg.m_trace_every;
+    if (trace_opts.sample_every)
+    {
+        trace_rings(); // the clock base for the dumps
+        // blocked before any loop thread exists, so only the signalfd sees it
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+        int signal_fd = CHECK_CALL(signalfd, -1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        auto dumper = new trace_signal_dumper;
+        loops[0]->post([dumper, &loop = *loops[0], signal_fd]
+                       { dumper->do_start(loop, signal_fd); });
+        fmt::println("trace: one request in {}, dump with kill -USR2 {} or GET /debug/trace",
+                     trace_opts.sample_every, getpid());
+    }
+
+    reload_options reload_opts;
+    if (char const *path = getenv("COHTTP_HANDOFF_SOCKET"))
+    {
+        reload_opts.handoff_path = path;
+    }
+    // the listening sockets of a running server, if there is one
+    reload.take_over(reload_opts);
+
+    std::vector<std::unique_ptr<tls_context>> tls_contexts;
+    for (auto &l : cfg.m_listeners)
+    {
+        tls_context *tls = nullptr;
+        if (l.tls())
+        {
+            tls_contexts.push_back(std::make_unique<tls_context>(l.m_cert, l.m_key));
+            tls = tls_contexts.back().get();
+        }
+        std::vector<size_t> on = l.m_loops;
+        if (on.empty())
+        {
+            for (size_t i = 0; i < loops.size(); ++i)
+            {
+                on.push_back(i);
+            }
+        }
+        for (auto &[name, fd] : open_listener(l))
+        {
+            std::string loop_list;
+            for (size_t i : on)
+            {
+                loop_list += (loop_list.empty() ? "" : ",") + std::to_string(i);
+            }
+            fmt::println("listening: {}{} on loops {}{}", name, tls ? " (tls)" : "", loop_list,
+                         l.m_incoming_cpu ? ", steered by SO_INCOMING_CPU" : "");
+            reload.m_listening.push_back({name, fd});
+            for (size_t k = 0; k < on.size(); ++k)
+            {
+                auto &loop = *loops[on[k]];
+                int loop_fd = k == 0 ? fd : CHECK_CALL(fcntl, fd, F_DUPFD_CLOEXEC, 0);
+                auto acceptor = new http_connection_acceptor;
+                acceptor->m_cpu = placement.m_cpus.empty() ? -1 : placement.m_cpus[on[k]];
+                acceptor->m_incoming_cpu = l.m_incoming_cpu;
+                reload.m_acceptors.emplace_back(&loop, acceptor);
+                // started on the loop's thread, whose pool and admission state it uses
+                loop.post([acceptor, &loop, loop_fd, tls]
+                          { acceptor->do_start(loop, loop_fd, tls); });
+            }
+        }
+    }
+    reload.do_start(loop_ptrs);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < loops.size(); ++i)
+    {
+        threads.emplace_back([&loop = *loops[i]]
+                             { _run_loop(loop); });
+    }
+    _run_loop(*loops[0]);
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    fmt::println("all tasks done,exiting...");
+};
+
+// without any listen directive: 127.0.0.1:8080, plus 8443 once a TLS
+// certificate is given in the environment
+void _add_default_listeners(server_config &cfg)
+{
+    if (!cfg.m_listeners.empty())
+    {
+        return;
+    }
+    cfg.m_listeners.push_back(parse_listener("tcp 127.0.0.1:8080"));
+    char const *cert = getenv("COHTTP_TLS_CERT");
+    char const *key = getenv("COHTTP_TLS_KEY");
+    if (cert && key)
+    {
+        auto tls = parse_listener("tcp 127.0.0.1:8443");
+        tls.m_cert = cert;
+        tls.m_key = key;
+        cfg.m_listeners.push_back(std::move(tls));
+    }
+}
+
+// loop_bench.cpp builds this file without main
+#ifndef CO_HTTP_NO_MAIN
+int main(int argc, char **argv)
+{
+    setlocale(LC_ALL, "zh_CN.UTF-8");
+    try
+    {
+        auto cfg = parse_command_line(argc, argv);
+        _add_default_listeners(cfg);
+        validate_config(cfg);
+        server(cfg);
+    }
+    catch (config_error const &e)
+    {
+        fmt::println(stderr, "config: {}", e.what());
+        return 2;
+    }
+    catch (std::system_error const &e)
+    {
+        fmt::println("error:{}", e.what());
+    }
+    catch (tls_error const &e)
+    {
+        fmt::println("error:{}", e.what());
+    }
+
+    return 0;
+}
+#endif
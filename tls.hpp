@@ -0,0 +1,365 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "bytes_buffer.hpp"
+
+// TLS termination: OpenSSL works on memory BIOs and never touches the
+// socket, the event loop does the IO. After a TLS 1.3 handshake the
+// transmit side can move into the kernel (kTLS), after which plain write()
+// and sendfile() produce the records. From then on OpenSSL's own output is
+// encrypted under keys the kernel does not follow, so it is dropped: the
+// tickets have gone out before, close_notify is sent through the kernel,
+// and a KeyUpdate that asks for ours ends the connection.
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+struct tls_error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+inline std::string _tls_last_error(std::string_view what) {
+    char buf[256];
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    ERR_clear_error();
+    return std::string(what) + ": " + buf;
+}
+
+// HKDF-Expand-Label(secret, label, "", len) of RFC 8446 7.1
+inline bool _tls13_expand_label(char const *digest, std::string_view secret,
+                                std::string_view label, unsigned char *out,
+                                size_t len) {
+    std::string info;
+    info.push_back(static_cast<char>(len >> 8));
+    info.push_back(static_cast<char>(len));
+    info.push_back(static_cast<char>(6 + label.size()));
+    info.append("tls13 ");
+    info.append(label);
+    info.push_back(0);
+
+    EVP_KDF *kdf = EVP_KDF_fetch(nullptr, "HKDF", nullptr);
+    EVP_KDF_CTX *kctx = kdf ? EVP_KDF_CTX_new(kdf) : nullptr;
+    EVP_KDF_free(kdf);
+    if (!kctx) {
+        return false;
+    }
+    int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+                                         const_cast<char *>(digest), 0),
+        OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+        OSSL_PARAM_construct_octet_string(
+            OSSL_KDF_PARAM_KEY, const_cast<char *>(secret.data()),
+            secret.size()),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info.data(),
+                                          info.size()),
+        OSSL_PARAM_construct_end(),
+    };
+    bool ok = EVP_KDF_derive(kctx, out, len, params) == 1;
+    EVP_KDF_CTX_free(kctx);
+    return ok;
+}
+
+struct tls_session;
+
+struct tls_context {
+    SSL_CTX *m_ctx = nullptr;
+    bool m_ktls = true; // move transmit into the kernel after the handshake
+
+    tls_context(std::string const &cert_file, std::string const &key_file) {
+        m_ctx = SSL_CTX_new(TLS_server_method());
+        if (!m_ctx) {
+            throw tls_error(_tls_last_error("SSL_CTX_new"));
+        }
+        SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+        if (SSL_CTX_use_certificate_chain_file(m_ctx, cert_file.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(m_ctx, key_file.c_str(),
+                                        SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(m_ctx) != 1) {
+            auto what = _tls_last_error(cert_file);
+            SSL_CTX_free(m_ctx);
+            throw tls_error(what);
+        }
+        // resumption: TLS 1.3 tickets and TLS 1.2 tickets are stateless
+        // (encrypted with the context's ticket key), session ids hit the cache
+        static unsigned char const sid_ctx[] = "co_http";
+        SSL_CTX_set_session_id_context(m_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+        SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_set_num_tickets(m_ctx, 2);
+        SSL_CTX_set_options(m_ctx, SSL_OP_NO_RENEGOTIATION);
+        SSL_CTX_set_mode(m_ctx, SSL_MODE_RELEASE_BUFFERS);
+        SSL_CTX_set_alpn_select_cb(m_ctx, _select_alpn, nullptr);
+        SSL_CTX_set_keylog_callback(m_ctx, _keylog);
+    }
+
+    tls_context(tls_context const &) = delete;
+    tls_context &operator=(tls_context const &) = delete;
+
+    ~tls_context() {
+        SSL_CTX_free(m_ctx);
+    }
+
+    // h2 is started from its preface by the HTTP/1.1 parser either way
+    static int _select_alpn(SSL *, unsigned char const **out,
+                            unsigned char *outlen, unsigned char const *in,
+                            unsigned int inlen, void *) {
+        static unsigned char const protos[] = "\x02h2\x08http/1.1";
+        unsigned char *selected;
+        if (SSL_select_next_proto(&selected, outlen, protos, sizeof(protos) - 1,
+                                  in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    static void _keylog(SSL const *ssl, char const *line);
+};
+
+struct tls_session {
+    SSL *m_ssl = nullptr;
+    BIO *m_in = nullptr;  // ciphertext received from the peer
+    BIO *m_out = nullptr; // ciphertext waiting for the socket
+    bool m_ktls_tx = false;
+    bool m_ktls_tried = false;
+    bool m_key_update_requested = false; // by the peer, once m_ktls_tx
+    uint64_t m_tx_records = 0; // sent under the application key, kTLS needs it
+    size_t m_out_record = 0;   // where the next record header is in output()
+    std::string m_tx_secret;   // server application traffic secret, until kTLS
+
+    explicit tls_session(tls_context &ctx) {
+        m_ssl = SSL_new(ctx.m_ctx);
+        if (!m_ssl) {
+            throw tls_error(_tls_last_error("SSL_new"));
+        }
+        m_in = BIO_new(BIO_s_mem());
+        m_out = BIO_new(BIO_s_mem());
+        BIO_set_mem_eof_return(m_in, -1); // empty means "retry", not eof
+        SSL_set_bio(m_ssl, m_in, m_out);
+        SSL_set_accept_state(m_ssl);
+        SSL_set_app_data(m_ssl, this);
+        m_ktls_tried = !ctx.m_ktls;
+    }
+
+    tls_session(tls_session const &) = delete;
+    tls_session &operator=(tls_session const &) = delete;
+
+    ~tls_session() {
+        OPENSSL_cleanse(m_tx_secret.data(), m_tx_secret.size());
+        SSL_free(m_ssl);
+    }
+
+    [[nodiscard]] bool handshake_done() const {
+        return SSL_is_init_finished(m_ssl);
+    }
+
+    [[nodiscard]] bool resumed() const {
+        return SSL_session_reused(m_ssl);
+    }
+
+    void feed(char const *data, size_t n) {
+        BIO_write(m_in, data, static_cast<int>(n));
+    }
+
+    // also drives the handshake; plaintext size, 0 on close_notify, -1 when
+    // more ciphertext is needed
+    ssize_t read(bytes_view buf) {
+        ERR_clear_error();
+        int ret = SSL_read(m_ssl, buf.data(), static_cast<int>(buf.size()));
+        if (m_key_update_requested) {
+            throw tls_error("SSL_read: KeyUpdate requested, the kernel holds the transmit key");
+        }
+        if (ret > 0) {
+            return ret;
+        }
+        switch (SSL_get_error(m_ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            throw tls_error(_tls_last_error("SSL_read"));
+        }
+    }
+
+    // a memory BIO never asks to retry a write
+    void write(std::string_view data) {
+        while (!data.empty()) {
+            ERR_clear_error();
+            int ret =
+                SSL_write(m_ssl, data.data(), static_cast<int>(data.size()));
+            if (ret <= 0) {
+                throw tls_error(_tls_last_error("SSL_write"));
+            }
+            data.remove_prefix(static_cast<size_t>(ret));
+        }
+    }
+
+    void shutdown() {
+        ERR_clear_error();
+        SSL_shutdown(m_ssl);
+    }
+
+    std::string_view output() const {
+        char *data;
+        long n = BIO_get_mem_data(m_out, &data);
+        return {data, static_cast<size_t>(n)};
+    }
+
+    // after the first n bytes of output() have been written out
+    void consume_output(size_t n) {
+        auto out = output();
+        // in TLS 1.3 everything after the handshake (tickets) is sent under
+        // the application key
+        bool counted = handshake_done();
+        while (m_out_record < n && m_out_record + 5 <= out.size()) {
+            m_tx_records += counted;
+            m_out_record += 5 + ((size_t(uint8_t(out[m_out_record + 3])) << 8) |
+                                 uint8_t(out[m_out_record + 4]));
+        }
+        m_out_record -= n;
+        if (n == out.size()) {
+            (void)BIO_reset(m_out);
+            return;
+        }
+        char skip[4096];
+        while (n) {
+            int ret = BIO_read(m_out, skip,
+                               static_cast<int>(std::min(n, sizeof(skip))));
+            n -= static_cast<size_t>(ret);
+        }
+    }
+
+    // what OpenSSL wrote once kTLS took over, it cannot go out
+    void discard_output() {
+        (void)BIO_reset(m_out);
+        m_out_record = 0;
+    }
+
+    // close_notify as an alert record of the kernel's
+    void ktls_close_notify(int fd) {
+        static char const alert[] = {1, 0}; // warning, close_notify
+        struct iovec iov = {const_cast<char *>(alert), sizeof(alert)};
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(unsigned char))] = {};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_TLS;
+        cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+        *CMSG_DATA(cmsg) = 21; // alert
+        (void)sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+
+    // a KeyUpdate with update_requested set would have OpenSSL move to a
+    // transmit key the kernel does not have
+    static void _on_message(int write_p, int, int content_type, void const *buf,
+                            size_t len, SSL *ssl, void *) {
+        auto p = static_cast<unsigned char const *>(buf);
+        if (!write_p && content_type == SSL3_RT_HANDSHAKE && len >= 5 &&
+            p[0] == SSL3_MT_KEY_UPDATE && p[4] == SSL_KEY_UPDATE_REQUESTED) {
+            static_cast<tls_session *>(SSL_get_app_data(ssl))
+                ->m_key_update_requested = true;
+        }
+    }
+
+    // TLS 1.3 with AES-GCM only, anything else stays in userspace; called
+    // once the handshake output, tickets included, is all on the wire
+    bool enable_ktls_tx(int fd) {
+        m_ktls_tried = true;
+        if (SSL_version(m_ssl) != TLS1_3_VERSION || m_tx_secret.empty()) {
+            return false;
+        }
+        auto id = SSL_CIPHER_get_protocol_id(SSL_get_current_cipher(m_ssl));
+        if (id != 0x1301 && id != 0x1302) {
+            return false;
+        }
+        bool aes256 = id == 0x1302;
+        char const *digest = aes256 ? "SHA384" : "SHA256";
+        size_t key_len = aes256 ? 32 : 16;
+        unsigned char key[32], iv[12], seq[8];
+        bool ok =
+            _tls13_expand_label(digest, m_tx_secret, "key", key, key_len) &&
+            _tls13_expand_label(digest, m_tx_secret, "iv", iv, sizeof(iv));
+        OPENSSL_cleanse(m_tx_secret.data(), m_tx_secret.size());
+        m_tx_secret.clear();
+        for (int i = 0; i < 8; ++i) {
+            seq[i] = static_cast<unsigned char>(m_tx_records >> (56 - 8 * i));
+        }
+        if (ok && setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+            if (aes256) {
+                tls12_crypto_info_aes_gcm_256 info{};
+                info.info.version = TLS_1_3_VERSION;
+                info.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+                _fill_crypto_info(info, key, iv, seq);
+                ok = setsockopt(fd, SOL_TLS, TLS_TX, &info, sizeof(info)) == 0;
+                OPENSSL_cleanse(&info, sizeof(info));
+            } else {
+                tls12_crypto_info_aes_gcm_128 info{};
+                info.info.version = TLS_1_3_VERSION;
+                info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+                _fill_crypto_info(info, key, iv, seq);
+                ok = setsockopt(fd, SOL_TLS, TLS_TX, &info, sizeof(info)) == 0;
+                OPENSSL_cleanse(&info, sizeof(info));
+            }
+        } else {
+            ok = false;
+        }
+        OPENSSL_cleanse(key, sizeof(key));
+        OPENSSL_cleanse(iv, sizeof(iv));
+        m_ktls_tx = ok;
+        if (ok) {
+            SSL_set_msg_callback(m_ssl, _on_message);
+        }
+        return ok;
+    }
+
+    // the 12-byte TLS 1.3 nonce is split into a 4-byte salt and an 8-byte iv
+    template <class Info>
+    static void _fill_crypto_info(Info &info, unsigned char const *key,
+                                  unsigned char const *iv,
+                                  unsigned char const *seq) {
+        memcpy(info.key, key, sizeof(info.key));
+        memcpy(info.salt, iv, sizeof(info.salt));
+        memcpy(info.iv, iv + sizeof(info.salt), sizeof(info.iv));
+        memcpy(info.rec_seq, seq, sizeof(info.rec_seq));
+    }
+};
+
+// "SERVER_TRAFFIC_SECRET_0 <client random> <secret>", in hex
+inline void tls_context::_keylog(SSL const *ssl, char const *line) {
+    std::string_view prefix = "SERVER_TRAFFIC_SECRET_0 ";
+    std::string_view text = line;
+    auto session = static_cast<tls_session *>(SSL_get_app_data(ssl));
+    if (!session || session->m_ktls_tried ||
+        text.substr(0, prefix.size()) != prefix) {
+        return;
+    }
+    auto hex = text.substr(text.rfind(' ') + 1);
+    auto nibble = [](char c) {
+        return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    };
+    session->m_tx_secret.clear();
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        session->m_tx_secret.push_back(
+            static_cast<char>(nibble(hex[i]) << 4 | nibble(hex[i + 1])));
+    }
+}
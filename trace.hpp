@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/format.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Opt-in request tracing. Phase boundaries of sampled requests are stamped
+// with the TSC into a ring per loop thread, and exported as Chrome
+// trace-event JSON (chrome://tracing, ui.perfetto.dev): every request gets
+// its own track with headers / body / handler / write slices, and
+// epoll_wait shows on the thread's track while a sampled request is open.
+//
+// With tracing off a phase costs a branch on the handler's trace id. The
+// same phases are USDT probes (provider co_http) when <sys/sdt.h> is
+// available, nops until perf or bpftrace attaches, e.g.
+//   bpftrace -e 'usdt:./server:co_http:handler_start { @[tid] = count(); }'
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CO_HTTP_PROBE(phase, fd, id) DTRACE_PROBE2(co_http, phase, fd, id)
+#else
+#define CO_HTTP_PROBE(phase, fd, id) ((void)0)
+#endif
+
+enum class trace_phase : uint8_t {
+    accept,
+    first_byte,
+    header_complete,
+    body_complete,
+    handler_start,
+    handler_end,
+    write_begin,
+    write_end,
+    request_end,
+    close,
+    poll_begin,
+    poll_end,
+};
+
+// TSC ticks where there is one, CLOCK_MONOTONIC nanoseconds elsewhere;
+// converted to time only when the rings are dumped
+inline uint64_t trace_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+#endif
+}
+
+inline uint64_t _trace_monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+struct trace_event {
+    uint64_t m_ticks;
+    uint32_t m_id; // request, per ring; 0 for loop events
+    int32_t m_fd;
+    trace_phase m_phase;
+};
+
+struct trace_options {
+    uint32_t sample_every = 0; // 0: tracing off, 1: every request, N: one in N
+    size_t ring_events = 1 << 16; // per thread, the oldest are overwritten
+    std::string dump_dir = "/tmp";
+};
+
+inline trace_options trace_opts;
+
+// written by its own thread only; a dump copies it from another thread and
+// drops whatever may have been overwritten while copying
+struct trace_ring {
+    std::vector<trace_event> m_events;
+    size_t m_mask;
+    std::atomic<uint64_t> m_head{0};
+    int m_tid;
+    uint32_t m_next_id = 0;
+    uint32_t m_countdown = 0;
+    size_t m_active = 0; // sampled requests not yet ended
+
+    explicit trace_ring(size_t events) : m_tid(int(syscall(SYS_gettid))) {
+        size_t n = 1;
+        while (n < events) {
+            n <<= 1;
+        }
+        m_events.resize(n);
+        m_mask = n - 1;
+    }
+
+    void record(trace_phase phase, uint32_t id, int fd, uint64_t ticks) {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        m_events[head & m_mask] = {ticks, id, fd, phase};
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    void record(trace_phase phase, uint32_t id, int fd) {
+        record(phase, id, fd, trace_now());
+    }
+
+    // a new request: its trace id, or 0 when it is not sampled
+    uint32_t sample() {
+        if (m_countdown > 1) {
+            --m_countdown;
+            return 0;
+        }
+        m_countdown = trace_opts.sample_every;
+        if (++m_next_id == 0) {
+            m_next_id = 1;
+        }
+        ++m_active;
+        return m_next_id;
+    }
+
+    void end(uint32_t id, int fd) {
+        record(trace_phase::request_end, id, fd);
+        --m_active;
+    }
+
+    std::vector<trace_event> snapshot() const {
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        uint64_t first = head > m_events.size() ? head - m_events.size() : 0;
+        std::vector<trace_event> events;
+        events.reserve(head - first);
+        for (uint64_t i = first; i < head; ++i) {
+            events.push_back(m_events[i & m_mask]);
+        }
+        // the writer may be halfway through the slot of index `now` too
+        uint64_t now = m_head.load(std::memory_order_acquire) + 1;
+        if (now > first + m_events.size()) {
+            events.erase(events.begin(), events.begin() + std::min<uint64_t>(now - first - m_events.size(), events.size()));
+        }
+        return events;
+    }
+};
+
+struct trace_registry {
+    std::mutex m_mutex;
+    std::vector<trace_ring *> m_rings; // one per thread, never freed
+    uint64_t m_base_ticks = trace_now();
+    uint64_t m_base_ns = _trace_monotonic_ns();
+};
+
+inline trace_registry &trace_rings() {
+    static trace_registry registry;
+    return registry;
+}
+
+inline trace_ring &thread_trace_ring() {
+    thread_local trace_ring *ring = [] {
+        auto ring = new trace_ring(trace_opts.ring_events);
+        auto &registry = trace_rings();
+        std::lock_guard lock(registry.m_mutex);
+        registry.m_rings.push_back(ring);
+        return ring;
+    }();
+    return *ring;
+}
+
+// a phase of the request with trace id `id` on fd; the probe fires for
+// every request, the ring only records sampled ones
+#define TRACE_PHASE(phase, fd, id)                                        \
+    do {                                                                  \
+        CO_HTTP_PROBE(phase, fd, id);                                     \
+        if (id) {                                                         \
+            thread_trace_ring().record(trace_phase::phase, id, fd);       \
+        }                                                                 \
+    } while (0)
+
+inline void _trace_json_event(std::string &out, char ph, std::string_view name, double ts_us,
+                              int pid, int tid, uint32_t id, int fd) {
+    if (id) {
+        fmt::format_to(std::back_inserter(out),
+                       "{{\"name\":\"{}\",\"cat\":\"request\",\"ph\":\"{}\",\"ts\":{:.3f},"
+                       "\"pid\":{},\"tid\":{},\"id\":\"{}.{}\",\"args\":{{\"fd\":{}}}}},\n",
+                       name, ph, ts_us, pid, tid, tid, id, fd);
+    } else {
+        fmt::format_to(std::back_inserter(out),
+                       "{{\"name\":\"{}\",\"cat\":\"loop\",\"ph\":\"{}\",\"ts\":{:.3f},\"pid\":{},\"tid\":{}}},\n",
+                       name, ph, ts_us, pid, tid);
+    }
+}
+
+// request slices are nestable async events ("b"/"e"/"n") keyed by
+// thread and id, loop slices are plain "B"/"E" on the thread
+inline std::string trace_chrome_json() {
+    auto &registry = trace_rings();
+    std::vector<std::pair<int, std::vector<trace_event>>> rings;
+    {
+        std::lock_guard lock(registry.m_mutex);
+        for (auto ring : registry.m_rings) {
+            rings.emplace_back(ring->m_tid, ring->snapshot());
+        }
+    }
+    uint64_t ticks = trace_now() - registry.m_base_ticks;
+    uint64_t ns = _trace_monotonic_ns() - registry.m_base_ns;
+    double ns_per_tick = ticks ? double(ns) / double(ticks) : 1.0;
+    int pid = getpid();
+
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    for (auto &[tid, events] : rings) {
+        for (auto &e : events) {
+            double us = double(e.m_ticks - registry.m_base_ticks) * ns_per_tick / 1000.0;
+            auto ev = [&](char ph, std::string_view name) {
+                _trace_json_event(out, ph, name, us, pid, tid, e.m_id, e.m_fd);
+            };
+            switch (e.m_phase) {
+            case trace_phase::accept:
+                ev('n', "accept");
+                break;
+            case trace_phase::first_byte:
+                ev('b', "request");
+                ev('b', "headers");
+                break;
+            case trace_phase::header_complete:
+                ev('e', "headers");
+                ev('b', "body");
+                break;
+            case trace_phase::body_complete:
+                ev('e', "body");
+                break;
+            case trace_phase::handler_start:
+                ev('b', "handler");
+                break;
+            case trace_phase::handler_end:
+                ev('e', "handler");
+                break;
+            case trace_phase::write_begin:
+                ev('b', "write");
+                break;
+            case trace_phase::write_end:
+                ev('e', "write");
+                break;
+            case trace_phase::request_end:
+                ev('e', "request");
+                break;
+            case trace_phase::close:
+                ev('n', "close");
+                break;
+            case trace_phase::poll_begin:
+                ev('B', "epoll_wait");
+                break;
+            case trace_phase::poll_end:
+                ev('E', "epoll_wait");
+                break;
+            }
+        }
+    }
+    out += fmt::format("{{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":{},\"args\":{{\"name\":\"co_http\"}}}}\n]}}\n", pid);
+    return out;
+}
+
+// the path written, empty on failure
+inline std::string trace_dump_file() {
+    static std::atomic<unsigned> dumps{0};
+    auto path = fmt::format("{}/co_http-trace-{}-{}.json", trace_opts.dump_dir, getpid(), dumps++);
+    auto json = trace_chrome_json();
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        return {};
+    }
+    bool ok = fwrite(json.data(), 1, json.size(), f) == json.size();
+    ok = fclose(f) == 0 && ok;
+    return ok ? path : std::string{};
+}
@@ -0,0 +1,464 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "bytes_buffer.hpp"
+#include "callback.hpp"
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// WebSocket (RFC 6455): handshake, streaming frame codec, server connection
+
+enum class websocket_opcode : uint8_t {
+    continuation = 0x0,
+    text = 0x1,
+    binary = 0x2,
+    close = 0x8,
+    ping = 0x9,
+    pong = 0xa,
+};
+
+namespace websocket_close_code {
+inline constexpr uint16_t normal = 1000;
+inline constexpr uint16_t going_away = 1001;
+inline constexpr uint16_t protocol_error = 1002;
+inline constexpr uint16_t invalid_payload = 1007;
+inline constexpr uint16_t message_too_big = 1009;
+} // namespace websocket_close_code
+
+struct _sha1 {
+    uint32_t m_h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                       0xc3d2e1f0};
+    unsigned char m_block[64];
+    size_t m_block_len = 0;
+    uint64_t m_total = 0;
+
+    static uint32_t _rol(uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    void _compress() {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(m_block[i * 4]) << 24) |
+                   (uint32_t(m_block[i * 4 + 1]) << 16) |
+                   (uint32_t(m_block[i * 4 + 2]) << 8) |
+                   uint32_t(m_block[i * 4 + 3]);
+        }
+        for (int i = 16; i < 80; ++i) {
+            w[i] = _rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = m_h[0], b = m_h[1], c = m_h[2], d = m_h[3], e = m_h[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = _rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = _rol(b, 30);
+            b = a;
+            a = t;
+        }
+        m_h[0] += a;
+        m_h[1] += b;
+        m_h[2] += c;
+        m_h[3] += d;
+        m_h[4] += e;
+    }
+
+    void update(std::string_view data) {
+        for (unsigned char c : data) {
+            m_block[m_block_len++] = c;
+            if (m_block_len == 64) {
+                _compress();
+                m_block_len = 0;
+            }
+        }
+        m_total += data.size();
+    }
+
+    std::array<unsigned char, 20> finish() {
+        uint64_t bits = m_total * 8;
+        update(std::string_view{"\x80", 1});
+        while (m_block_len != 56) {
+            update(std::string_view{"\0", 1});
+        }
+        for (int i = 7; i >= 0; --i) {
+            char c = static_cast<char>(bits >> (i * 8));
+            update(std::string_view{&c, 1});
+        }
+        std::array<unsigned char, 20> digest;
+        for (int i = 0; i < 20; ++i) {
+            digest[i] = static_cast<unsigned char>(m_h[i / 4] >> (24 - (i % 4) * 8));
+        }
+        return digest;
+    }
+};
+
+inline std::string _base64_encode(unsigned char const *data, size_t n) {
+    static constexpr char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t v = uint32_t(data[i]) << 16;
+        if (i + 1 < n) {
+            v |= uint32_t(data[i + 1]) << 8;
+        }
+        if (i + 2 < n) {
+            v |= data[i + 2];
+        }
+        out.push_back(table[(v >> 18) & 63]);
+        out.push_back(table[(v >> 12) & 63]);
+        out.push_back(i + 1 < n ? table[(v >> 6) & 63] : '=');
+        out.push_back(i + 2 < n ? table[v & 63] : '=');
+    }
+    return out;
+}
+
+// Sec-WebSocket-Accept = base64(sha1(key + GUID))
+inline std::string websocket_accept_key(std::string_view key) {
+    _sha1 sha;
+    sha.update(key);
+    sha.update("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    auto digest = sha.finish();
+    return _base64_encode(digest.data(), digest.size());
+}
+
+// xor payload bytes with the masking key, 32/16 bytes per step where the
+// target supports it; phase is the payload offset of p[0] within the frame
+inline void websocket_unmask(char *p, size_t n, std::array<char, 4> key,
+                             size_t phase) {
+    char k[4];
+    for (size_t i = 0; i < 4; ++i) {
+        k[i] = key[(phase + i) & 3];
+    }
+    uint32_t k32;
+    std::memcpy(&k32, k, 4);
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i m256 = _mm256_set1_epi32(static_cast<int>(k32));
+    for (; i + 32 <= n; i += 32) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + i),
+                            _mm256_xor_si256(v, m256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i m128 = _mm_set1_epi32(static_cast<int>(k32));
+    for (; i + 16 <= n; i += 16) {
+        auto v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(p + i),
+                         _mm_xor_si128(v, m128));
+    }
+#endif
+    uint64_t k64 = (uint64_t(k32) << 32) | k32;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, p + i, 8);
+        v ^= k64;
+        std::memcpy(p + i, &v, 8);
+    }
+    for (; i < n; ++i) {
+        p[i] ^= k[i & 3];
+    }
+}
+
+inline bool websocket_valid_utf8(std::string_view s) {
+    size_t i = 0;
+    while (i < s.size()) {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        size_t len;
+        uint32_t cp;
+        if (c < 0x80) {
+            ++i;
+            continue;
+        } else if ((c & 0xe0) == 0xc0) {
+            len = 2;
+            cp = c & 0x1f;
+        } else if ((c & 0xf0) == 0xe0) {
+            len = 3;
+            cp = c & 0x0f;
+        } else if ((c & 0xf8) == 0xf0) {
+            len = 4;
+            cp = c & 0x07;
+        } else {
+            return false;
+        }
+        if (i + len > s.size()) {
+            return false;
+        }
+        for (size_t j = 1; j < len; ++j) {
+            unsigned char cc = static_cast<unsigned char>(s[i + j]);
+            if ((cc & 0xc0) != 0x80) {
+                return false;
+            }
+            cp = (cp << 6) | (cc & 0x3f);
+        }
+        // overlong, surrogate or out of range
+        if ((len == 2 && cp < 0x80) || (len == 3 && cp < 0x800) ||
+            (len == 4 && cp < 0x10000) || cp > 0x10ffff ||
+            (cp >= 0xd800 && cp <= 0xdfff)) {
+            return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+// server frames are never masked
+inline void websocket_write_frame(bytes_buffer &out, websocket_opcode opcode,
+                                  std::string_view payload, bool fin = true) {
+    char hdr[10];
+    size_t n = 2;
+    hdr[0] = static_cast<char>((fin ? 0x80 : 0) | uint8_t(opcode));
+    if (payload.size() < 126) {
+        hdr[1] = static_cast<char>(payload.size());
+    } else if (payload.size() <= 0xffff) {
+        hdr[1] = 126;
+        hdr[2] = static_cast<char>(payload.size() >> 8);
+        hdr[3] = static_cast<char>(payload.size());
+        n = 4;
+    } else {
+        hdr[1] = 127;
+        for (int i = 0; i < 8; ++i) {
+            hdr[2 + i] = static_cast<char>(uint64_t(payload.size()) >> (56 - i * 8));
+        }
+        n = 10;
+    }
+    out.append(std::string_view{hdr, n});
+    out.append(payload);
+}
+
+// serialize once, share the bytes between every receiving connection
+inline std::shared_ptr<bytes_buffer const>
+websocket_make_shared_frame(websocket_opcode opcode, std::string_view payload) {
+    auto frame = std::make_shared<bytes_buffer>();
+    frame->reserve(payload.size() + 10);
+    websocket_write_frame(*frame, opcode, payload);
+    return frame;
+}
+
+struct websocket_frame_header {
+    bool m_fin;
+    websocket_opcode m_opcode;
+    uint64_t m_length;
+    std::array<char, 4> m_mask;
+};
+
+struct websocket_connection {
+    using handler_type =
+        callback<websocket_connection &, websocket_opcode, std::string_view>;
+
+    static constexpr size_t max_message_size = 16 * 1024 * 1024;
+
+    bytes_buffer *m_out;
+    handler_type m_handler;
+
+    // frame header is at most 14 bytes and may straddle reads
+    char m_hdr[14];
+    size_t m_hdr_len = 0;
+    bool m_in_payload = false;
+    websocket_frame_header m_frame;
+    uint64_t m_payload_off = 0;
+
+    std::string m_message; // fragments of the current data message
+    websocket_opcode m_message_opcode = websocket_opcode::text;
+    bool m_in_message = false;
+    std::string m_control; // control frames may interleave with fragments
+
+    bool m_close_sent = false;
+    bool m_closed = false;
+
+    websocket_connection(bytes_buffer &out, handler_type handler)
+        : m_out(&out), m_handler(std::move(handler)) {}
+
+    websocket_connection(websocket_connection const &) = delete;
+    websocket_connection &operator=(websocket_connection const &) = delete;
+
+    [[nodiscard]] bool wants_close() const {
+        return m_closed;
+    }
+
+    void send(websocket_opcode opcode, std::string_view payload) {
+        if (!m_close_sent) {
+            websocket_write_frame(*m_out, opcode, payload);
+        }
+    }
+
+    void close(uint16_t code, std::string_view reason = {}) {
+        if (!m_close_sent) {
+            std::string payload{char(code >> 8), char(code)};
+            payload.append(reason.substr(0, 123));
+            websocket_write_frame(*m_out, websocket_opcode::close, payload);
+            m_close_sent = true;
+        }
+        m_closed = true;
+    }
+
+    // payload bytes are unmasked in place inside the read buffer
+    void push_chunk(bytes_view chunk) {
+        char *p = chunk.data();
+        char *end = p + chunk.size();
+        while (p != end && !m_closed) {
+            if (!m_in_payload) {
+                p = _parse_header(p, end);
+                continue;
+            }
+            size_t n = static_cast<size_t>(
+                std::min<uint64_t>(m_frame.m_length - m_payload_off, end - p));
+            websocket_unmask(p, n, m_frame.m_mask, m_payload_off);
+            _on_payload(std::string_view{p, n});
+            m_payload_off += n;
+            p += n;
+            if (m_payload_off == m_frame.m_length) {
+                _on_frame_end();
+            }
+        }
+    }
+
+    size_t _header_size() const {
+        size_t n = 2 + 4; // clients always mask
+        if (m_hdr_len >= 2) {
+            uint8_t len7 = m_hdr[1] & 0x7f;
+            n += len7 == 126 ? 2 : len7 == 127 ? 8 : 0;
+        }
+        return n;
+    }
+
+    char *_parse_header(char *p, char *end) {
+        while (p != end && m_hdr_len < _header_size()) {
+            m_hdr[m_hdr_len++] = *p++;
+        }
+        if (m_hdr_len < _header_size()) {
+            return p;
+        }
+        auto u = reinterpret_cast<unsigned char const *>(m_hdr);
+        m_frame.m_fin = u[0] & 0x80;
+        m_frame.m_opcode = websocket_opcode(u[0] & 0x0f);
+        size_t off = 2;
+        uint64_t len = u[1] & 0x7f;
+        if (len == 126) {
+            len = (uint64_t(u[2]) << 8) | u[3];
+            off = 4;
+        } else if (len == 127) {
+            len = 0;
+            for (int i = 0; i < 8; ++i) {
+                len = (len << 8) | u[2 + i];
+            }
+            off = 10;
+        }
+        m_frame.m_length = len;
+        std::memcpy(m_frame.m_mask.data(), m_hdr + off, 4);
+        m_hdr_len = 0;
+        m_payload_off = 0;
+        m_in_payload = true;
+
+        if ((u[0] & 0x70) || !(u[1] & 0x80) || (len >> 63)) {
+            close(websocket_close_code::protocol_error); // RSV bits or unmasked
+            return p;
+        }
+        switch (m_frame.m_opcode) {
+        case websocket_opcode::close:
+        case websocket_opcode::ping:
+        case websocket_opcode::pong:
+            if (!m_frame.m_fin || len > 125) {
+                close(websocket_close_code::protocol_error);
+            }
+            m_control.clear();
+            break;
+        case websocket_opcode::continuation:
+            if (!m_in_message) {
+                close(websocket_close_code::protocol_error);
+            }
+            break;
+        case websocket_opcode::text:
+        case websocket_opcode::binary:
+            if (m_in_message) {
+                close(websocket_close_code::protocol_error);
+            }
+            m_in_message = true;
+            m_message_opcode = m_frame.m_opcode;
+            m_message.clear();
+            break;
+        default:
+            close(websocket_close_code::protocol_error);
+            break;
+        }
+        if (!m_closed && _is_data() && m_message.size() + len > max_message_size) {
+            close(websocket_close_code::message_too_big);
+        }
+        if (!m_closed && len == 0) {
+            _on_frame_end();
+        }
+        return p;
+    }
+
+    bool _is_data() const {
+        return (uint8_t(m_frame.m_opcode) & 0x8) == 0;
+    }
+
+    void _on_payload(std::string_view data) {
+        if (_is_data()) {
+            m_message.append(data);
+        } else {
+            m_control.append(data);
+        }
+    }
+
+    void _on_frame_end() {
+        m_in_payload = false;
+        switch (m_frame.m_opcode) {
+        case websocket_opcode::ping:
+            send(websocket_opcode::pong, m_control);
+            break;
+        case websocket_opcode::pong:
+            break;
+        case websocket_opcode::close:
+            _on_close();
+            break;
+        default:
+            if (!m_frame.m_fin) {
+                break;
+            }
+            m_in_message = false;
+            if (m_message_opcode == websocket_opcode::text &&
+                !websocket_valid_utf8(m_message)) {
+                close(websocket_close_code::invalid_payload);
+                break;
+            }
+            m_handler(multishot_call, *this, m_message_opcode, m_message);
+            break;
+        }
+    }
+
+    void _on_close() {
+        if (m_control.size() == 1) {
+            close(websocket_close_code::protocol_error);
+            return;
+        }
+        uint16_t code = websocket_close_code::normal;
+        if (m_control.size() >= 2) {
+            auto u = reinterpret_cast<unsigned char const *>(m_control.data());
+            code = static_cast<uint16_t>((u[0] << 8) | u[1]);
+        }
+        close(code); // echo the peer's code back
+    }
+};